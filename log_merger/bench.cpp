@@ -0,0 +1,808 @@
+/*
+*  MIT License
+*
+*  Copyright (c) 2025 Pawel Drzycimski
+*
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+*
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+*
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*
+*/
+
+#include "simplelog/simplelog.hpp"
+#include "xxhash.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+/*
+ * Synthetic log tree generator and runner for log_merger_2..5 and
+ * combinations of log_merger_pipeline stages.
+ *
+ * Tree is generated once (or reused when directory exists), every variant then
+ * runs inside it with cold page cache (tree pages dropped with fadvise before
+ * each run) and with warm one. Per stage times come from the moment variant
+ * prints its "Finished ..." lines, peak RSS and CPU times from wait4.
+ */
+
+enum class ReportFormat
+{
+  Csv,
+  Json
+};
+
+enum class CacheMode
+{
+  Cold,
+  Warm,
+  Both
+};
+
+struct TreeSpec
+{
+  size_t files {1000};
+  size_t minKb {1};
+  size_t maxKb {256};
+  bool logSizes {true};
+  unsigned duplicatePercent {20};
+  unsigned depth {3};
+  uint64_t seed {1};
+};
+
+struct BenchArgs
+{
+  std::string_view treeRoot;
+  std::string_view reportPath;
+  std::string_view binDir;
+  std::string_view variants {"2,3,4,5"};
+  std::string_view extraArgs;
+  TreeSpec spec;
+  unsigned runs {1};
+  CacheMode cache {CacheMode::Both};
+  ReportFormat format {ReportFormat::Csv};
+  bool valid {true};
+};
+
+static void usage()
+{
+  LOG << "bench -t <tree dir> [-n <files>] [-s <min KB>:<max KB>] [-u] [-r <percent>] [-d <depth>] [-S <seed>]";
+  LOG << "      [-v <variants>] [-b <bin dir>] [-x <args>] [-R <runs>] [-k cold|warm|both] [-o csv|json] [-f <report>]";
+  LOG << "  -t <tree dir>  - synthetic tree, generated when it doesn't exist, reused otherwise";
+  LOG << "  -n <files>     - number of .log files, default 1000";
+  LOG << "  -s <min>:<max> - file size range in KB, default 1:256";
+  LOG << "  -u             - uniform sizes, default is log-uniform (many small, few big)";
+  LOG << "  -r <percent>   - files which are byte copies of earlier ones, default 20";
+  LOG << "  -d <depth>     - max directory depth, 4 subdirectories per level, default 3";
+  LOG << "  -S <seed>      - generator seed, default 1";
+  LOG << "  -v <variants>  - comma separated merger variants, default 2,3,4,5,";
+  LOG << "                   pipeline=<spec> runs log_merger_pipeline -P <spec> ex. pipeline=walker:xxh3:chunks:fd";
+  LOG << "  -b <bin dir>   - where log_merger_N binaries are, default directory of bench";
+  LOG << "  -x <args>      - extra space separated arguments for log_merger_2 ex. \"-c uring -p\"";
+  LOG << "  -R <runs>      - runs per variant and cache mode, default 1";
+  LOG << "  -k <cache>     - page cache state, cold, warm or both (default)";
+  LOG << "  -o <format>    - report format, csv (default) or json";
+  LOG << "  -f <report>    - report file, default bench.csv or bench.json";
+}
+
+/*
+ * splitmix64, deterministic for given seed so trees are reproducible
+ */
+class Rng final
+{
+  uint64_t m_state;
+
+public:
+  explicit Rng(uint64_t seed)
+    : m_state{seed}
+  {}
+
+  uint64_t next()
+  {
+    uint64_t z = (m_state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+  }
+
+  uint64_t below(uint64_t bound)
+  {
+    return bound ? next() % bound : 0;
+  }
+
+  double unit()
+  {
+    return static_cast<double>(next() >> 11) * 0x1.0p-53;
+  }
+};
+
+static bool writeAll(int fd, const char *data, size_t size)
+{
+  while(size)
+  {
+    const ssize_t written = ::write(fd, data, size);
+    if(written < 0 && errno == EINTR)
+      continue;
+    if(written <= 0)
+      return false;
+
+    data += written;
+    size -= static_cast<size_t>(written);
+  }
+
+  return true;
+}
+
+/*
+ * Exactly size bytes of timestamped log lines, same seed and size give same bytes
+ */
+static bool writeLogContent(int fd, uint64_t seed, uint64_t size)
+{
+  static constexpr size_t BUFFER_SIZE = 1024 * 1024;
+  static constexpr const char *LEVELS[] = {"DEBUG", "INFO", "INFO", "INFO", "WARN", "ERROR"};
+  static constexpr const char *WORDS[] = {"request", "session", "cache", "miss", "hit", "retry", "connection",
+                                          "closed", "opened", "timeout", "user", "query", "flush", "commit"};
+
+  Rng rng{seed};
+  std::unique_ptr<char[]> buffer{ new char[BUFFER_SIZE + 512] };
+  size_t used = 0;
+  uint64_t left = size;
+  // somewhere in 2025, milliseconds
+  int64_t timestamp = (1735689600ll + static_cast<int64_t>(rng.below(300 * 86400))) * 1000;
+
+  while(left)
+  {
+    const time_t seconds = static_cast<time_t>(timestamp / 1000);
+    struct tm tm;
+    ::gmtime_r(&seconds, &tm);
+
+    int len = std::snprintf(buffer.get() + used, 256, "%04d-%02d-%02d %02d:%02d:%02d.%03d [%s] worker-%u",
+        tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+        static_cast<int>(timestamp % 1000), LEVELS[rng.below(std::size(LEVELS))], static_cast<unsigned>(rng.below(64)));
+    for(uint64_t words = 3 + rng.below(10); words; --words)
+      len += std::snprintf(buffer.get() + used + len, 32, " %s", WORDS[rng.below(std::size(WORDS))]);
+    len += std::snprintf(buffer.get() + used + len, 64, " id=%016llx\n", static_cast<unsigned long long>(rng.next()));
+
+    const size_t take = static_cast<size_t>(std::min<uint64_t>(static_cast<uint64_t>(len), left));
+    used += take;
+    left -= take;
+    timestamp += static_cast<int64_t>(rng.below(2000));
+
+    // last line cut to size still ends with newline
+    if(!left)
+      buffer[used - 1] = '\n';
+
+    if(used >= BUFFER_SIZE || !left)
+    {
+      if(!writeAll(fd, buffer.get(), used))
+        return false;
+      used = 0;
+    }
+  }
+
+  return true;
+}
+
+static uint64_t pickSize(const TreeSpec &spec, Rng &rng)
+{
+  const double minBytes = static_cast<double>(spec.minKb) * 1024;
+  const double maxBytes = static_cast<double>(spec.maxKb) * 1024;
+  if(spec.logSizes)
+    return static_cast<uint64_t>(std::exp(std::log(minBytes) + rng.unit() * (std::log(maxBytes) - std::log(minBytes))));
+
+  return static_cast<uint64_t>(minBytes + rng.unit() * (maxBytes - minBytes));
+}
+
+static bool generateTree(const fs::path &root, const TreeSpec &spec)
+{
+  static constexpr unsigned FANOUT = 4;
+
+  std::error_code ec;
+  if(!fs::create_directories(root, ec))
+  {
+    LOG << "Couldn't create " << root.string() << ": " << ec.message();
+    return false;
+  }
+
+  Rng rng{spec.seed};
+  // seed and size of every unique file, duplicates regenerate one of them
+  std::vector<std::pair<uint64_t, uint64_t>> uniques;
+  uint64_t totalBytes = 0;
+
+  for(size_t i = 0; i < spec.files; ++i)
+  {
+    fs::path dir = root;
+    for(uint64_t level = rng.below(spec.depth + 1); level; --level)
+      dir /= "dir" + std::to_string(rng.below(FANOUT));
+    fs::create_directories(dir, ec);
+
+    std::pair<uint64_t, uint64_t> content;
+    if(!uniques.empty() && rng.below(100) < spec.duplicatePercent)
+    {
+      content = uniques[rng.below(uniques.size())];
+    }
+    else
+    {
+      content = {rng.next(), pickSize(spec, rng)};
+      uniques.push_back(content);
+    }
+
+    const fs::path path = dir / ("app_" + std::to_string(i) + ".log");
+    const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0)
+    {
+      LOG << "Couldn't create " << path.string();
+      return false;
+    }
+
+    const bool ok = writeLogContent(fd, content.first, content.second);
+    ::close(fd);
+    if(!ok)
+    {
+      LOG << "Couldn't write " << path.string();
+      return false;
+    }
+
+    totalBytes += content.second;
+  }
+
+  LOG << "Generated " << spec.files << " files (" << uniques.size() << " unique), "
+      << totalBytes / (1024 * 1024) << " MB in " << root.string();
+  return true;
+}
+
+struct TreeInfo
+{
+  std::vector<std::string> paths;
+  uint64_t bytes {0};
+  uint64_t uniqueFiles {0};
+  uint64_t uniqueBytes {0};
+};
+
+/*
+ * Every .log file of the tree and bytes a correct merge should produce,
+ * content is compared by xxh64 and size which is plenty for a sanity check
+ */
+static std::optional<TreeInfo> scanTree(const fs::path &root)
+{
+  static constexpr size_t BUFFER_SIZE = 1024 * 1024;
+
+  TreeInfo ret;
+  std::set<std::pair<uint64_t, uint64_t>> seen;
+  std::unique_ptr<char[]> buffer{ new char[BUFFER_SIZE] };
+
+  std::error_code ec;
+  for(auto it = fs::recursive_directory_iterator(root, ec); !ec && it != fs::recursive_directory_iterator(); it.increment(ec))
+  {
+    if(!it->is_regular_file() || it->path().extension() != ".log")
+      continue;
+
+    const int fd = ::open(it->path().c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+      continue;
+
+    xxh::hash_state_t<64> state;
+    uint64_t size = 0;
+    ssize_t got;
+    while((got = ::read(fd, buffer.get(), BUFFER_SIZE)) > 0)
+    {
+      state.update(buffer.get(), static_cast<size_t>(got));
+      size += static_cast<uint64_t>(got);
+    }
+    ::close(fd);
+
+    ret.paths.push_back(it->path().string());
+    ret.bytes += size;
+    if(seen.emplace(state.digest(), size).second)
+    {
+      ++ret.uniqueFiles;
+      ret.uniqueBytes += size;
+    }
+  }
+
+  if(ec)
+  {
+    LOG << "Couldn't scan " << root.string() << ": " << ec.message();
+    return std::nullopt;
+  }
+
+  return ret;
+}
+
+/*
+ * Drops clean pages of the tree, works without root unlike drop_caches,
+ * pages written by generator are flushed first so they can be dropped too
+ */
+static void dropPageCache(const TreeInfo &tree)
+{
+  ::sync();
+  for(const auto &path : tree.paths)
+  {
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+      continue;
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    ::close(fd);
+  }
+}
+
+static void warmPageCache(const TreeInfo &tree)
+{
+  static constexpr size_t BUFFER_SIZE = 1024 * 1024;
+  std::unique_ptr<char[]> buffer{ new char[BUFFER_SIZE] };
+  for(const auto &path : tree.paths)
+  {
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+      continue;
+    while(::read(fd, buffer.get(), BUFFER_SIZE) > 0)
+    {}
+    ::close(fd);
+  }
+}
+
+struct RunResult
+{
+  std::string variant;
+  std::string cache;
+  unsigned run {0};
+  int exitCode {-1};
+  double wallMs {0};
+  // since start, negative when variant didn't report the stage
+  double traversalMs {-1};
+  double hashingMs {-1};
+  double writingMs {-1};
+  double userMs {0};
+  double sysMs {0};
+  long peakRssKb {0};
+  uint64_t outputBytes {0};
+};
+
+static double toMs(const struct timeval &tv)
+{
+  return static_cast<double>(tv.tv_sec) * 1000.0 + static_cast<double>(tv.tv_usec) / 1000.0;
+}
+
+/*
+ * Runs binary inside tree root with its stdout piped back, so the moment
+ * of every "Finished ..." line can be taken as end of that stage
+ */
+static std::optional<RunResult> runVariant(const std::string &binary, const std::vector<std::string> &args,
+                                           const fs::path &root, const fs::path &output)
+{
+  int pipeFds[2];
+  if(::pipe2(pipeFds, O_CLOEXEC) != 0)
+    return std::nullopt;
+
+  std::vector<char*> argv;
+  argv.push_back(const_cast<char*>(binary.c_str()));
+  for(const auto &arg : args)
+    argv.push_back(const_cast<char*>(arg.c_str()));
+  argv.push_back(nullptr);
+
+  const auto start = NOW();
+  const pid_t pid = ::fork();
+  if(pid < 0)
+  {
+    ::close(pipeFds[0]);
+    ::close(pipeFds[1]);
+    return std::nullopt;
+  }
+
+  if(pid == 0)
+  {
+    ::dup2(pipeFds[1], STDOUT_FILENO);
+    if(::chdir(root.c_str()) != 0)
+      ::_exit(127);
+    ::execv(binary.c_str(), argv.data());
+    ::_exit(127);
+  }
+
+  ::close(pipeFds[1]);
+
+  RunResult ret;
+  const auto sinceStart = [&start] {
+    return static_cast<double>(DURATION_US(start).count()) / 1000.0;
+  };
+
+  std::string line;
+  char buffer[4096];
+  ssize_t got;
+  while((got = ::read(pipeFds[0], buffer, sizeof(buffer))) != 0)
+  {
+    if(got < 0 && errno == EINTR)
+      continue;
+    if(got < 0)
+      break;
+
+    for(ssize_t i = 0; i < got; ++i)
+    {
+      if(buffer[i] != '\n')
+      {
+        line.push_back(buffer[i]);
+        continue;
+      }
+
+      if(line.find("Finished path traversal") != std::string::npos)
+        ret.traversalMs = sinceStart();
+      else if(line.find("Finished hashing") != std::string::npos)
+        ret.hashingMs = sinceStart();
+      else if(line.find("Finished writing") != std::string::npos)
+        ret.writingMs = sinceStart();
+      line.clear();
+    }
+  }
+  ::close(pipeFds[0]);
+
+  int status = 0;
+  struct rusage usage {};
+  while(::wait4(pid, &status, 0, &usage) < 0 && errno == EINTR)
+  {}
+  ret.wallMs = sinceStart();
+
+  ret.exitCode = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+  ret.userMs = toMs(usage.ru_utime);
+  ret.sysMs = toMs(usage.ru_stime);
+  ret.peakRssKb = usage.ru_maxrss;
+
+  std::error_code ec;
+  const auto size = fs::file_size(output, ec);
+  ret.outputBytes = ec ? 0 : size;
+  fs::remove(output, ec);
+
+  return ret;
+}
+
+/*
+ * Stage durations from "Finished ..." moments, empty when stage wasn't reported
+ */
+static std::string stageMs(double end, double begin)
+{
+  if(end < 0 || begin < 0)
+    return {};
+
+  char buffer[32];
+  std::snprintf(buffer, sizeof(buffer), "%.1f", end - begin);
+  return buffer;
+}
+
+static std::string number(double value)
+{
+  char buffer[32];
+  std::snprintf(buffer, sizeof(buffer), "%.1f", value);
+  return buffer;
+}
+
+static std::vector<std::pair<std::string_view, std::string>> reportFields(const RunResult &result, const TreeInfo &tree)
+{
+  const double seconds = result.wallMs / 1000.0;
+  const double mb = static_cast<double>(tree.bytes) / (1024.0 * 1024.0);
+
+  return {
+    {"variant", result.variant},
+    {"cache", result.cache},
+    {"run", std::to_string(result.run)},
+    {"exit", std::to_string(result.exitCode)},
+    {"files", std::to_string(tree.paths.size())},
+    {"input_bytes", std::to_string(tree.bytes)},
+    {"output_bytes", std::to_string(result.outputBytes)},
+    {"output_match", result.outputBytes == tree.uniqueBytes ? "1" : "0"},
+    {"wall_ms", number(result.wallMs)},
+    {"traversal_ms", stageMs(result.traversalMs, 0)},
+    {"hashing_ms", stageMs(result.hashingMs, result.traversalMs)},
+    {"writing_ms", stageMs(result.writingMs, result.hashingMs)},
+    {"files_per_s", number(seconds > 0 ? static_cast<double>(tree.paths.size()) / seconds : 0)},
+    {"mb_per_s", number(seconds > 0 ? mb / seconds : 0)},
+    {"peak_rss_kb", std::to_string(result.peakRssKb)},
+    {"user_ms", number(result.userMs)},
+    {"sys_ms", number(result.sysMs)}
+  };
+}
+
+static bool writeReport(std::FILE &out, ReportFormat format, const std::vector<RunResult> &results, const TreeInfo &tree)
+{
+  bool first = true;
+  if(format == ReportFormat::Json)
+    std::fputs("[\n", &out);
+
+  for(const auto &result : results)
+  {
+    const auto fields = reportFields(result, tree);
+    if(format == ReportFormat::Csv)
+    {
+      if(first)
+      {
+        for(size_t i = 0; i < fields.size(); ++i)
+          std::fprintf(&out, "%s%.*s", i ? "," : "", static_cast<int>(fields[i].first.size()), fields[i].first.data());
+        std::fputc('\n', &out);
+      }
+      for(size_t i = 0; i < fields.size(); ++i)
+        std::fprintf(&out, "%s%s", i ? "," : "", fields[i].second.c_str());
+      std::fputc('\n', &out);
+    }
+    else
+    {
+      std::fputs(first ? "  {" : ",\n  {", &out);
+      for(size_t i = 0; i < fields.size(); ++i)
+      {
+        const auto &[key, value] = fields[i];
+        const bool text = key == "variant" || key == "cache";
+        std::fprintf(&out, "%s\"%.*s\": ", i ? ", " : "", static_cast<int>(key.size()), key.data());
+        if(text)
+          std::fprintf(&out, "\"%s\"", value.c_str());
+        else
+          std::fputs(value.empty() ? "null" : value.c_str(), &out);
+      }
+      std::fputc('}', &out);
+    }
+    first = false;
+  }
+
+  if(format == ReportFormat::Json)
+    std::fputs("\n]\n", &out);
+
+  return std::ferror(&out) == 0;
+}
+
+static std::vector<std::string> split(std::string_view text, char separator)
+{
+  std::vector<std::string> ret;
+  while(!text.empty())
+  {
+    const size_t pos = text.find(separator);
+    const auto token = text.substr(0, pos);
+    if(!token.empty())
+      ret.emplace_back(token);
+    if(pos == std::string_view::npos)
+      break;
+    text.remove_prefix(pos + 1);
+  }
+
+  return ret;
+}
+
+int main(int argc, char *argv[])
+{
+  auto args = [argc, argv] {
+    BenchArgs ret;
+    for(size_t i = 1; i < static_cast<size_t>(argc); ++i)
+    {
+      if(std::strcmp("-u", argv[i]) == 0)
+        ret.spec.logSizes = false;
+      else if(i + 1 == static_cast<size_t>(argc))
+        ret.valid = false;
+      else if(std::strcmp("-t", argv[i]) == 0)
+        ret.treeRoot = argv[++i];
+      else if(std::strcmp("-f", argv[i]) == 0)
+        ret.reportPath = argv[++i];
+      else if(std::strcmp("-b", argv[i]) == 0)
+        ret.binDir = argv[++i];
+      else if(std::strcmp("-v", argv[i]) == 0)
+        ret.variants = argv[++i];
+      else if(std::strcmp("-x", argv[i]) == 0)
+        ret.extraArgs = argv[++i];
+      else if(std::strcmp("-n", argv[i]) == 0)
+      {
+        const long files = std::atol(argv[++i]);
+        if(files <= 0)
+          ret.valid = false;
+        else
+          ret.spec.files = static_cast<size_t>(files);
+      }
+      else if(std::strcmp("-s", argv[i]) == 0)
+      {
+        long minKb = 0;
+        long maxKb = 0;
+        if(std::sscanf(argv[++i], "%ld:%ld", &minKb, &maxKb) != 2 || minKb <= 0 || maxKb < minKb)
+          ret.valid = false;
+        else
+        {
+          ret.spec.minKb = static_cast<size_t>(minKb);
+          ret.spec.maxKb = static_cast<size_t>(maxKb);
+        }
+      }
+      else if(std::strcmp("-r", argv[i]) == 0)
+      {
+        const int percent = std::atoi(argv[++i]);
+        if(percent < 0 || percent > 100)
+          ret.valid = false;
+        else
+          ret.spec.duplicatePercent = static_cast<unsigned>(percent);
+      }
+      else if(std::strcmp("-d", argv[i]) == 0)
+      {
+        const int depth = std::atoi(argv[++i]);
+        if(depth < 0 || depth > 32)
+          ret.valid = false;
+        else
+          ret.spec.depth = static_cast<unsigned>(depth);
+      }
+      else if(std::strcmp("-S", argv[i]) == 0)
+        ret.spec.seed = std::strtoull(argv[++i], nullptr, 10);
+      else if(std::strcmp("-R", argv[i]) == 0)
+      {
+        const int runs = std::atoi(argv[++i]);
+        if(runs <= 0)
+          ret.valid = false;
+        else
+          ret.runs = static_cast<unsigned>(runs);
+      }
+      else if(std::strcmp("-k", argv[i]) == 0)
+      {
+        const std::string_view cache = argv[++i];
+        if(cache == "cold")
+          ret.cache = CacheMode::Cold;
+        else if(cache == "warm")
+          ret.cache = CacheMode::Warm;
+        else if(cache == "both")
+          ret.cache = CacheMode::Both;
+        else
+          ret.valid = false;
+      }
+      else if(std::strcmp("-o", argv[i]) == 0)
+      {
+        const std::string_view format = argv[++i];
+        if(format == "csv")
+          ret.format = ReportFormat::Csv;
+        else if(format == "json")
+          ret.format = ReportFormat::Json;
+        else
+          ret.valid = false;
+      }
+      else
+        ret.valid = false;
+    }
+    return ret;
+  }();
+
+  if(!args.valid)
+  {
+    LOG << "Invalid parameters!";
+    usage();
+    return 1;
+  }
+  if(args.treeRoot.empty())
+  {
+    LOG << "Missing -t parameter!";
+    usage();
+    return 1;
+  }
+
+  std::error_code ec;
+  const fs::path root = fs::absolute(args.treeRoot, ec);
+  if(!fs::exists(root))
+  {
+    if(!generateTree(root, args.spec))
+      return 1;
+  }
+  else
+  {
+    LOG << "Reusing existing tree " << root.string();
+  }
+
+  const auto tree = scanTree(root);
+  if(!tree)
+    return 1;
+  LOG << "Tree has " << tree->paths.size() << " files, " << tree->bytes << " bytes, "
+      << tree->uniqueFiles << " unique files, " << tree->uniqueBytes << " unique bytes";
+
+  const fs::path binDir = args.binDir.empty() ? fs::read_symlink("/proc/self/exe", ec).parent_path() : fs::path{args.binDir};
+  // next to the tree, so it's never picked up as input
+  const fs::path output = root.string() + ".bench.out";
+
+  std::vector<std::pair<std::string, CacheMode>> caches;
+  if(args.cache != CacheMode::Warm)
+    caches.emplace_back("cold", CacheMode::Cold);
+  if(args.cache != CacheMode::Cold)
+    caches.emplace_back("warm", CacheMode::Warm);
+
+  std::vector<RunResult> results;
+  for(const auto &variant : split(args.variants, ','))
+  {
+    // stage combination of one binary, spec goes to its -P
+    const size_t specPos = variant.starts_with("pipeline=") ? variant.find('=') : std::string::npos;
+    const std::string name = "log_merger_" + variant;
+    const std::string binary = (binDir / (specPos == std::string::npos ? name : "log_merger_pipeline")).string();
+    if(::access(binary.c_str(), X_OK) != 0)
+    {
+      LOG << "Skipping " << name << ", no " << binary;
+      continue;
+    }
+
+    std::vector<std::string> variantArgs {"-f", output.string(), "-e", ".log"};
+    if(specPos != std::string::npos)
+    {
+      variantArgs.push_back("-P");
+      variantArgs.push_back(variant.substr(specPos + 1));
+    }
+    // older variants take exactly these four
+    if(variant == "2")
+    {
+      for(auto &arg : split(args.extraArgs, ' '))
+        variantArgs.push_back(std::move(arg));
+    }
+
+    for(const auto &[cacheName, cache] : caches)
+    {
+      if(cache == CacheMode::Warm)
+        warmPageCache(*tree);
+
+      for(unsigned run = 0; run < args.runs; ++run)
+      {
+        if(cache == CacheMode::Cold)
+          dropPageCache(*tree);
+
+        auto result = runVariant(binary, variantArgs, root, output);
+        if(!result)
+        {
+          LOG << "Couldn't start " << binary;
+          continue;
+        }
+
+        result->variant = name;
+        result->cache = cacheName;
+        result->run = run;
+        LOG << name << ' ' << cacheName << " run " << run << ": " << result->wallMs << " ms, exit " << result->exitCode
+            << ", peak RSS " << result->peakRssKb << " KB"
+            << (result->outputBytes == tree->uniqueBytes ? "" : ", output size differs from unique input");
+        results.push_back(std::move(*result));
+      }
+    }
+  }
+
+  const std::string reportPath = args.reportPath.empty()
+    ? (args.format == ReportFormat::Csv ? "bench.csv" : "bench.json")
+    : std::string{args.reportPath};
+  std::FILE *report = std::fopen(reportPath.c_str(), "w");
+  if(!report)
+  {
+    LOG << "Couldn't open " << reportPath << " for writing";
+    return 1;
+  }
+
+  const bool written = writeReport(*report, args.format, results, *tree);
+  const bool closed = std::fclose(report) == 0;
+  if(!written || !closed)
+  {
+    LOG << "Couldn't write " << reportPath;
+    return 1;
+  }
+
+  LOG << "Report written to " << reportPath;
+  return 0;
+}
@@ -0,0 +1,312 @@
+/*
+*  MIT License
+*
+*  Copyright (c) 2025 Pawel Drzycimski
+*
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+*
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+*
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*
+*/
+
+#ifndef LOG_MERGER_CHUNK_DEDUP_HPP_
+#define LOG_MERGER_CHUNK_DEDUP_HPP_
+
+#include "input_reader.hpp"
+#include "xxhash.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct ChunkDedupStats
+{
+  uint64_t files {0};
+  uint64_t unreadable {0};
+  uint64_t chunks {0};
+  uint64_t uniqueChunks {0};
+  uint64_t bytesIn {0};
+  uint64_t bytesOut {0};
+  uint64_t indexBytes {0};
+
+  // share of input bytes dropped as already written
+  double dedupRatio() const { return bytesIn ? 1.0 - static_cast<double>(bytesOut) / static_cast<double>(bytesIn) : 0.0; }
+};
+
+namespace chunk_dedup_detail
+{
+  consteval std::array<uint64_t, 256> gearTable()
+  {
+    // splitmix64, any fixed random table does
+    std::array<uint64_t, 256> ret{};
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    for(uint64_t &value : ret)
+    {
+      state += 0x9e3779b97f4a7c15ULL;
+      uint64_t z = state;
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+      value = z ^ (z >> 31);
+    }
+    return ret;
+  }
+
+  inline constexpr std::array<uint64_t, 256> GEAR = gearTable();
+}
+
+/*
+ * FastCDC style cut points: Gear rolling hash, harder mask before average size
+ * and easier one after it (normalized chunking), min and max size bounds.
+ * Cut is moved forward to end of line when there's one before max size, so
+ * chunks are whole lines and output of partially overlapping logs stays readable.
+ */
+class GearChunker final
+{
+  size_t m_minSize;
+  size_t m_avgSize;
+  size_t m_maxSize;
+  uint64_t m_maskHard;
+  uint64_t m_maskEasy;
+
+public:
+  explicit GearChunker(size_t avgSize)
+    : m_avgSize{std::bit_ceil(std::max<size_t>(avgSize, 256))}
+  {
+    m_minSize = m_avgSize / 4;
+    m_maxSize = m_avgSize * 8;
+
+    // shifted hash carries last 64 bytes in high bits, masks go there
+    const unsigned bits = static_cast<unsigned>(std::countr_zero(m_avgSize));
+    m_maskHard = ((uint64_t{1} << (bits + 2)) - 1) << (64 - bits - 2);
+    m_maskEasy = ((uint64_t{1} << (bits - 2)) - 1) << (64 - bits + 2);
+  }
+
+  size_t maxSize() const { return m_maxSize; }
+
+  /*
+   * Length of first chunk of data, len shorter than max size is taken
+   * as end of input
+   */
+  size_t cut(const uint8_t *data, size_t len) const
+  {
+    if(len <= m_minSize)
+      return len;
+
+    const size_t end = std::min(len, m_maxSize);
+    const size_t normal = std::min(end, m_avgSize);
+    uint64_t hash = 0;
+    size_t pos = m_minSize;
+    size_t ret = end;
+    for(; pos < normal; ++pos)
+    {
+      hash = (hash << 1) + chunk_dedup_detail::GEAR[data[pos]];
+      if(!(hash & m_maskHard))
+      {
+        ret = pos + 1;
+        break;
+      }
+    }
+    if(ret == end && pos == normal)
+    {
+      for(; pos < end; ++pos)
+      {
+        hash = (hash << 1) + chunk_dedup_detail::GEAR[data[pos]];
+        if(!(hash & m_maskEasy))
+        {
+          ret = pos + 1;
+          break;
+        }
+      }
+    }
+
+    if(ret == len)
+      return ret;
+
+    const auto *newline = static_cast<const uint8_t*>(std::memchr(data + ret - 1, '\n', end - ret + 1));
+    return newline ? static_cast<size_t>(newline - data) + 1 : ret;
+  }
+};
+
+/*
+ * Set of 128 bit chunk digests, open addressing, single threaded
+ */
+class ChunkDigestSet final
+{
+  struct Slot
+  {
+    uint64_t low {0};
+    uint64_t high {0};
+  };
+
+  std::unique_ptr<Slot[]> m_slots;
+  size_t m_capacity {0};
+  size_t m_size {0};
+  // zero digest marks empty slot, it's kept aside
+  bool m_hasZero {false};
+
+public:
+  bool insert(xxh::hash128_t digest)
+  {
+    if(!digest.low64 && !digest.high64)
+    {
+      const bool ret = !m_hasZero;
+      m_hasZero = true;
+      return ret;
+    }
+
+    if((m_size + 1) * 4 > m_capacity * 3)
+      grow();
+
+    const size_t mask = m_capacity - 1;
+    for(size_t idx = digest.low64 & mask; ; idx = (idx + 1) & mask)
+    {
+      Slot &slot = m_slots[idx];
+      if(!slot.low && !slot.high)
+      {
+        slot = Slot{ digest.low64, digest.high64 };
+        ++m_size;
+        return true;
+      }
+      if(slot.low == digest.low64 && slot.high == digest.high64)
+        return false;
+    }
+  }
+
+  size_t bytes() const { return m_capacity * sizeof(Slot); }
+
+private:
+  void grow()
+  {
+    const size_t capacity = std::max<size_t>(1024, m_capacity * 2);
+    std::unique_ptr<Slot[]> slots{ new Slot[capacity] };
+    const size_t mask = capacity - 1;
+    for(size_t i = 0; i < m_capacity; ++i)
+    {
+      const Slot &slot = m_slots[i];
+      if(!slot.low && !slot.high)
+        continue;
+
+      size_t idx = slot.low & mask;
+      while(slots[idx].low || slots[idx].high)
+        idx = (idx + 1) & mask;
+      slots[idx] = slot;
+    }
+
+    m_slots = std::move(slots);
+    m_capacity = capacity;
+  }
+};
+
+/*
+ * Writes inputs in given order chunk by chunk, dropping every chunk whose
+ * content was written before, wherever it was. Catches regions shared by
+ * rotated logs which whole file digests can't.
+ */
+class ChunkDedup final
+{
+  GearChunker m_chunker;
+  ChunkDigestSet m_seen;
+  ChunkDedupStats m_stats;
+
+public:
+  explicit ChunkDedup(size_t avgChunkSize)
+    : m_chunker{avgChunkSize}
+  {}
+
+  const ChunkDedupStats &stats()
+  {
+    m_stats.indexBytes = m_seen.bytes();
+    return m_stats;
+  }
+
+  /*
+   * False on write error
+   */
+  bool copy(const std::vector<std::string> &paths, std::FILE &out, bool decode)
+  {
+    const size_t capacity = std::max<size_t>(1024 * 1024, m_chunker.maxSize() * 2);
+    std::unique_ptr<uint8_t[]> buffer{ new uint8_t[capacity] };
+    bool ok = true;
+    for(const std::string &path : paths)
+    {
+      InputReader input;
+      if(!input.open(path.c_str(), decode))
+      {
+        ++m_stats.unreadable;
+        continue;
+      }
+
+      ++m_stats.files;
+      size_t filled = 0;
+      bool eof = false;
+      while(true)
+      {
+        while(!eof && filled < capacity)
+        {
+          const ssize_t got = input.read(buffer.get() + filled, capacity - filled);
+          if(got <= 0)
+          {
+            if(got < 0)
+              ++m_stats.unreadable;
+            eof = true;
+            break;
+          }
+          filled += static_cast<size_t>(got);
+        }
+        if(!filled)
+          break;
+
+        // chunks are cut while there's max size ahead, tail waits for more input
+        size_t pos = 0;
+        while(pos < filled && (eof || filled - pos >= m_chunker.maxSize()))
+        {
+          const size_t len = m_chunker.cut(buffer.get() + pos, filled - pos);
+          ok = emit(buffer.get() + pos, len, out) && ok;
+          pos += len;
+        }
+
+        std::memmove(buffer.get(), buffer.get() + pos, filled - pos);
+        filled -= pos;
+        if(eof && !filled)
+          break;
+      }
+    }
+
+    return ok;
+  }
+
+private:
+  bool emit(const uint8_t *data, size_t len, std::FILE &out)
+  {
+    ++m_stats.chunks;
+    m_stats.bytesIn += len;
+    if(!m_seen.insert(xxh::xxhash3<128>(data, len)))
+      return true;
+
+    ++m_stats.uniqueChunks;
+    m_stats.bytesOut += len;
+    return std::fwrite(data, 1, len, &out) == len;
+  }
+};
+
+#endif
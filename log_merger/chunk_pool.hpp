@@ -0,0 +1,265 @@
+/*
+*  MIT License
+*
+*  Copyright (c) 2025 Pawel Drzycimski
+*
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+*
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+*
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*
+*/
+
+#ifndef LOG_MERGER_CHUNK_POOL_HPP_
+#define LOG_MERGER_CHUNK_POOL_HPP_
+
+#include "mpmc_queue.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <sys/mman.h>
+
+/*
+ * Fixed size piece of pool memory, size is how much of it is filled
+ */
+struct Chunk
+{
+  uint8_t *data {nullptr};
+  size_t size {0};
+  unsigned lane {0};
+};
+
+/*
+ * count chunks of chunkSize bytes in one mapping, which is all the memory
+ * readers ever get. Chunks are split evenly between lanes (one per reader),
+ * acquire blocks while lane has nothing free, that's the back-pressure.
+ * Separate lanes keep reader of a later file from taking every chunk while
+ * file being written still needs one, which would deadlock in-order writer.
+ */
+class ChunkPool final
+{
+  static constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+  size_t m_count;
+  size_t m_chunkSize;
+  const unsigned m_lanes;
+
+  void *m_region {MAP_FAILED};
+  size_t m_regionSize {0};
+  bool m_hugePages {false};
+
+  std::unique_ptr<Chunk[]> m_chunks;
+  std::vector<std::unique_ptr<MpmcQueue<Chunk*>>> m_free;
+
+public:
+  ChunkPool(size_t count, size_t chunkSize, unsigned lanes)
+    : m_count{count}, m_chunkSize{chunkSize}, m_lanes{std::max(lanes, 1u)}
+  {}
+
+  ChunkPool(const ChunkPool&) = delete;
+  ChunkPool(ChunkPool&&) = delete;
+
+  ~ChunkPool()
+  {
+    if(m_region != MAP_FAILED)
+      ::munmap(m_region, m_regionSize);
+  }
+
+  /*
+   * Returns 0 or errno. With hugePages chunk size is rounded up to 2MB and
+   * hugetlb pages are tried first, then transparent huge pages are asked for.
+   */
+  int init(bool hugePages)
+  {
+    const size_t perLane = std::max<size_t>(m_count / m_lanes, 1);
+    m_count = perLane * m_lanes;
+    if(hugePages)
+      m_chunkSize = (m_chunkSize + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    m_regionSize = m_count * m_chunkSize;
+
+    if(hugePages)
+    {
+      m_region = ::mmap(nullptr, m_regionSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      m_hugePages = m_region != MAP_FAILED;
+    }
+    if(m_region == MAP_FAILED)
+    {
+      m_region = ::mmap(nullptr, m_regionSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if(m_region == MAP_FAILED)
+        return errno;
+      if(hugePages)
+        ::madvise(m_region, m_regionSize, MADV_HUGEPAGE);
+    }
+
+    m_chunks.reset(new Chunk[m_count]);
+    for(unsigned lane = 0; lane < m_lanes; ++lane)
+      m_free.push_back(std::make_unique<MpmcQueue<Chunk*>>(perLane));
+
+    for(size_t i = 0; i < m_count; ++i)
+    {
+      m_chunks[i].data = static_cast<uint8_t*>(m_region) + i * m_chunkSize;
+      m_chunks[i].lane = static_cast<unsigned>(i / perLane);
+      m_free[m_chunks[i].lane]->push(&m_chunks[i]);
+    }
+
+    return 0;
+  }
+
+  Chunk *acquire(unsigned lane)
+  {
+    Chunk *chunk = nullptr;
+    m_free[lane % m_lanes]->pop(chunk);
+    chunk->size = 0;
+    return chunk;
+  }
+
+  /*
+   * nullptr when lane has nothing free right now
+   */
+  Chunk *tryAcquire(unsigned lane)
+  {
+    Chunk *chunk = nullptr;
+    if(!m_free[lane % m_lanes]->tryPop(chunk))
+      return nullptr;
+    chunk->size = 0;
+    return chunk;
+  }
+
+  void release(Chunk *chunk)
+  {
+    m_free[chunk->lane]->push(chunk);
+  }
+
+  size_t chunkSize() const { return m_chunkSize; }
+  size_t count() const { return m_count; }
+  size_t bytes() const { return m_regionSize; }
+  bool hugePages() const { return m_hugePages; }
+};
+
+/*
+ * Chunks of many files filled concurrently, handed out strictly in ticket
+ * order (ticket = order in which readers took files), so every file lands
+ * in output in one piece. nullptr pushed for a ticket ends that file.
+ *
+ * Reader whose ticket is next may claim output and write file itself,
+ * no chunk of it is queued then and pop() waits until claim ends.
+ */
+class OrderedChunkQueue final
+{
+  std::mutex m_mutex;
+  std::condition_variable m_signal;
+  std::map<uint64_t, std::deque<Chunk*>> m_pending;
+  uint64_t m_next {0};
+  uint64_t m_end {std::numeric_limits<uint64_t>::max()};
+  // chunk returned by last pop() may still be written
+  bool m_writing {false};
+  bool m_claimed {false};
+
+public:
+  void push(uint64_t ticket, Chunk *chunk)
+  {
+    {
+      std::lock_guard lock(m_mutex);
+      m_pending[ticket].push_back(chunk);
+    }
+    m_signal.notify_one();
+  }
+
+  /*
+   * No ticket at or past tickets will come
+   */
+  void close(uint64_t tickets)
+  {
+    {
+      std::lock_guard lock(m_mutex);
+      m_end = tickets;
+    }
+    m_signal.notify_one();
+  }
+
+  /*
+   * True when ticket is next, nothing of it is queued and output is idle,
+   * caller writes whole file then and ends it with endClaim()
+   */
+  bool tryClaim(uint64_t ticket)
+  {
+    std::lock_guard lock(m_mutex);
+    if(m_claimed || m_writing || m_next != ticket || m_pending.contains(ticket))
+      return false;
+
+    m_claimed = true;
+    return true;
+  }
+
+  /*
+   * Claimed ticket is done, no nullptr needed
+   */
+  void endClaim()
+  {
+    {
+      std::lock_guard lock(m_mutex);
+      m_claimed = false;
+      ++m_next;
+    }
+    m_signal.notify_one();
+  }
+
+  /*
+   * Next chunk in order, false once every ticket before close() is done.
+   * Calling it again means previous chunk is written.
+   */
+  bool pop(Chunk *&chunk)
+  {
+    std::unique_lock lock(m_mutex);
+    m_writing = false;
+    while(true)
+    {
+      m_signal.wait(lock, [this] { return !m_claimed && (m_next >= m_end || hasNext()); });
+      if(m_next >= m_end)
+        return false;
+
+      auto it = m_pending.find(m_next);
+      chunk = it->second.front();
+      it->second.pop_front();
+      if(chunk)
+      {
+        m_writing = true;
+        return true;
+      }
+
+      m_pending.erase(it);
+      ++m_next;
+    }
+  }
+
+private:
+  bool hasNext() const
+  {
+    const auto it = m_pending.find(m_next);
+    return it != m_pending.end() && !it->second.empty();
+  }
+};
+
+#endif
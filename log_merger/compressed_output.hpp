@@ -0,0 +1,436 @@
+/*
+*  MIT License
+*
+*  Copyright (c) 2025 Pawel Drzycimski
+*
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+*
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+*
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*
+*/
+
+#ifndef LOG_MERGER_COMPRESSED_OUTPUT_HPP_
+#define LOG_MERGER_COMPRESSED_OUTPUT_HPP_
+
+#include "mpmc_queue.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+#include <zlib.h>
+
+// make ZSTD=1, needs libzstd headers
+#ifdef LOG_MERGER_ZSTD
+  #include <zstd.h>
+#endif
+
+enum class Compression
+{
+  None,
+  Gzip,
+  Zstd
+};
+
+struct CompressionArgs
+{
+  Compression format {Compression::None};
+  int level {0};
+};
+
+/*
+ * "gzip", "zstd", optionally with ":level"
+ */
+inline std::optional<CompressionArgs> parseCompression(std::string_view arg)
+{
+  CompressionArgs ret;
+  const size_t colon = arg.find(':');
+  const std::string_view name = arg.substr(0, colon);
+  if(name == "gzip")
+  {
+    ret.format = Compression::Gzip;
+    ret.level = 6;
+  }
+#ifdef LOG_MERGER_ZSTD
+  else if(name == "zstd")
+  {
+    ret.format = Compression::Zstd;
+    ret.level = 3;
+  }
+#endif
+  else
+  {
+    return std::nullopt;
+  }
+
+  if(colon != std::string_view::npos)
+  {
+    const std::string level{arg.substr(colon + 1)};
+    if(level.empty() || level.find_first_not_of("0123456789") != std::string::npos || level.size() > 3)
+      return std::nullopt;
+    ret.level = std::atoi(level.c_str());
+  }
+
+  // out of range level would only fail later, in every compressor thread
+  int minLevel = 0;
+  int maxLevel = 9;
+#ifdef LOG_MERGER_ZSTD
+  if(ret.format == Compression::Zstd)
+  {
+    minLevel = 1;
+    maxLevel = ZSTD_maxCLevel();
+  }
+#endif
+  if(ret.level < minLevel || ret.level > maxLevel)
+    return std::nullopt;
+
+  return ret;
+}
+
+struct CompressionStats
+{
+  uint64_t frames {0};
+  uint64_t rawBytes {0};
+  uint64_t compressedBytes {0};
+  uint64_t producerStalls {0};
+};
+
+/*
+ * Output stream cut into fixed size frames, every frame compressed on its own
+ * by pool of threads and written in order. Concatenated gzip members and zstd
+ * frames are valid streams for regular tools.
+ *
+ * Every frame starts at known offset, so output is seekable by frame:
+ *   zstd - seek table in skippable frame at the end (zstd seekable format)
+ *   gzip - "<output>.frames" next to output, text lines "<compressed offset> <raw offset>",
+ *          compressed offsets are file offsets, raw ones count from where this run started
+ *
+ * Memory is bounded by frame pool, producer waits when all frames are in flight.
+ */
+class CompressedOutput final
+{
+  static constexpr size_t STREAM_BUFFER_SIZE = 64 * 1024;
+
+  struct Frame
+  {
+    std::unique_ptr<uint8_t[]> in;
+    size_t inSize {0};
+    std::vector<uint8_t> out;
+    uint64_t seq {0};
+    bool ok {true};
+  };
+
+  const int m_fd;
+  const CompressionArgs m_args;
+  const size_t m_frameSize;
+  const std::string m_indexPath;
+
+  std::vector<std::unique_ptr<Frame>> m_frames;
+  MpmcQueue<Frame*> m_free;
+  MpmcQueue<Frame*> m_toCompress;
+  std::vector<std::jthread> m_threads;
+
+  // producer side, single producer at a time
+  Frame *m_current {nullptr};
+  uint64_t m_nextSeq {0};
+  bool m_finished {false};
+
+  // ordered writing
+  std::mutex m_writeMutex;
+  std::map<uint64_t, Frame*> m_done;
+  uint64_t m_nextWrite {0};
+  uint64_t m_baseOffset {0};
+  std::vector<std::pair<uint64_t, uint64_t>> m_frameIndex; // compressed size, raw size
+  std::atomic_bool m_writeFailed {false};
+
+  CompressionStats m_stats;
+
+public:
+  CompressedOutput(int fd, CompressionArgs args, size_t frameSize, unsigned threadCount, std::string indexPath)
+    : m_fd{fd},
+      m_args{args},
+      m_frameSize{frameSize},
+      m_indexPath{std::move(indexPath)},
+      m_free{2 * std::max(threadCount, 1u) + 2},
+      m_toCompress{2 * std::max(threadCount, 1u) + 2}
+  {
+    threadCount = std::max(threadCount, 1u);
+    m_baseOffset = static_cast<uint64_t>(std::max<off_t>(0, ::lseek(m_fd, 0, SEEK_CUR)));
+    for(size_t i = 0; i < 2 * threadCount + 2; ++i)
+    {
+      auto frame = std::make_unique<Frame>();
+      frame->in.reset(new uint8_t[m_frameSize]);
+      m_free.push(frame.get());
+      m_frames.push_back(std::move(frame));
+    }
+
+    for(unsigned i = 0; i < threadCount; ++i)
+      m_threads.emplace_back([this] { compressWorker(); });
+  }
+
+  CompressedOutput(const CompressedOutput&) = delete;
+  CompressedOutput(CompressedOutput&&) = delete;
+
+  ~CompressedOutput()
+  {
+    finish();
+  }
+
+  bool write(const uint8_t *data, size_t size)
+  {
+    // nothing written after first failure would make a valid stream anyway
+    while(size && !m_writeFailed.load(std::memory_order_relaxed))
+    {
+      if(!m_current)
+      {
+        if(!m_free.tryPop(m_current))
+        {
+          ++m_stats.producerStalls;
+          m_free.pop(m_current);
+        }
+        m_current->inSize = 0;
+      }
+
+      const size_t chunk = std::min(size, m_frameSize - m_current->inSize);
+      std::memcpy(m_current->in.get() + m_current->inSize, data, chunk);
+      m_current->inSize += chunk;
+      data += chunk;
+      size -= chunk;
+
+      if(m_current->inSize == m_frameSize)
+        submitCurrent();
+    }
+
+    return !m_writeFailed.load(std::memory_order_relaxed);
+  }
+
+  /*
+   * Flushes last partial frame, waits for compressors and writes seek table.
+   * Returns false when anything failed on the way.
+   */
+  bool finish()
+  {
+    if(m_finished)
+      return !m_writeFailed;
+    m_finished = true;
+
+    if(m_current && m_current->inSize)
+      submitCurrent();
+
+    m_toCompress.close();
+    m_threads.clear();
+
+    if(m_args.format == Compression::Zstd)
+      writeSeekTable();
+    else
+      writeIndexFile();
+
+    return !m_writeFailed;
+  }
+
+  CompressionStats stats() const { return m_stats; }
+
+  /*
+   * FILE wrapper, so stdio writers and line modes don't need to know about compression.
+   * Caller closes it before finish(). Failures are reported by finish() only, glibc
+   * reads past caller's buffer in fwrite when cookie write returns an error.
+   */
+  std::FILE *openStream()
+  {
+    cookie_io_functions_t io;
+    std::memset(&io, 0x00, sizeof(io));
+    io.write = [](void *cookie, const char *buf, size_t size) -> ssize_t {
+      static_cast<CompressedOutput*>(cookie)->write(reinterpret_cast<const uint8_t*>(buf), size);
+      return static_cast<ssize_t>(size);
+    };
+
+    std::FILE *stream = ::fopencookie(this, "w", io);
+    if(stream)
+      std::setvbuf(stream, nullptr, _IOFBF, STREAM_BUFFER_SIZE);
+    return stream;
+  }
+
+private:
+  void submitCurrent()
+  {
+    m_current->seq = m_nextSeq++;
+    m_stats.rawBytes += m_current->inSize;
+    m_toCompress.push(m_current);
+    m_current = nullptr;
+  }
+
+  void compressWorker()
+  {
+    z_stream zs;
+    std::memset(&zs, 0x00, sizeof(zs));
+    const bool gzip = m_args.format == Compression::Gzip;
+    const bool deflateReady = gzip && deflateInit2(&zs, m_args.level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+    bool ready = deflateReady;
+
+#ifdef LOG_MERGER_ZSTD
+    ZSTD_CCtx *cctx = gzip ? nullptr : ZSTD_createCCtx();
+    if(!gzip)
+      ready = cctx != nullptr;
+#endif
+
+    if(!ready)
+      m_writeFailed = true;
+
+    // worker which couldn't start still takes its share of frames, failed,
+    // so they go back to pool and producer never waits for them
+    Frame *frame;
+    while(m_toCompress.pop(frame))
+    {
+      if(!ready)
+      {
+        frame->ok = false;
+        frame->out.clear();
+      }
+      else if(gzip)
+      {
+        deflateReset(&zs);
+        frame->out.resize(deflateBound(&zs, frame->inSize));
+        zs.next_in = frame->in.get();
+        zs.avail_in = static_cast<uInt>(frame->inSize);
+        zs.next_out = frame->out.data();
+        zs.avail_out = static_cast<uInt>(frame->out.size());
+        frame->ok = deflate(&zs, Z_FINISH) == Z_STREAM_END;
+        frame->out.resize(frame->out.size() - zs.avail_out);
+      }
+#ifdef LOG_MERGER_ZSTD
+      else
+      {
+        frame->out.resize(ZSTD_compressBound(frame->inSize));
+        const size_t ret = ZSTD_compressCCtx(cctx, frame->out.data(), frame->out.size(), frame->in.get(), frame->inSize, m_args.level);
+        frame->ok = !ZSTD_isError(ret);
+        frame->out.resize(frame->ok ? ret : 0);
+      }
+#endif
+
+      writeInOrder(frame);
+    }
+
+    if(deflateReady)
+      deflateEnd(&zs);
+#ifdef LOG_MERGER_ZSTD
+    ZSTD_freeCCtx(cctx);
+#endif
+  }
+
+  /*
+   * Whoever completes the next expected frame writes it and everything ready after it
+   */
+  void writeInOrder(Frame *frame)
+  {
+    std::lock_guard lock(m_writeMutex);
+    m_done.emplace(frame->seq, frame);
+
+    for(auto it = m_done.begin(); it != m_done.end() && it->first == m_nextWrite; it = m_done.erase(it))
+    {
+      Frame *ready = it->second;
+      if(!ready->ok || !writeAll(ready->out.data(), ready->out.size()))
+        m_writeFailed = true;
+
+      m_frameIndex.emplace_back(ready->out.size(), ready->inSize);
+      m_stats.compressedBytes += ready->out.size();
+      ++m_stats.frames;
+      ++m_nextWrite;
+
+      m_free.push(ready);
+    }
+  }
+
+  bool writeAll(const uint8_t *data, size_t size)
+  {
+    while(size)
+    {
+      const ssize_t ret = ::write(m_fd, data, size);
+      if(ret < 0 && errno == EINTR)
+        continue;
+      if(ret <= 0)
+        return false;
+
+      data += ret;
+      size -= static_cast<size_t>(ret);
+    }
+
+    return true;
+  }
+
+  void putLe32(std::vector<uint8_t> &out, uint32_t value)
+  {
+    for(int i = 0; i < 4; ++i)
+      out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+  }
+
+  void writeSeekTable()
+  {
+    static constexpr uint32_t SKIPPABLE_MAGIC = 0x184D2A5E;
+    static constexpr uint32_t SEEKABLE_MAGIC = 0x8F92EAB1;
+
+    std::vector<uint8_t> table;
+    putLe32(table, SKIPPABLE_MAGIC);
+    putLe32(table, static_cast<uint32_t>(m_frameIndex.size() * 8 + 9));
+    for(const auto &[compressed, raw] : m_frameIndex)
+    {
+      putLe32(table, static_cast<uint32_t>(compressed));
+      putLe32(table, static_cast<uint32_t>(raw));
+    }
+    putLe32(table, static_cast<uint32_t>(m_frameIndex.size()));
+    table.push_back(0); // descriptor, no checksums
+    putLe32(table, SEEKABLE_MAGIC);
+
+    if(!writeAll(table.data(), table.size()))
+      m_writeFailed = true;
+  }
+
+  void writeIndexFile()
+  {
+    std::FILE *index = std::fopen(m_indexPath.c_str(), "w");
+    if(!index)
+    {
+      m_writeFailed = true;
+      return;
+    }
+
+    uint64_t compressedOffset = m_baseOffset;
+    uint64_t rawOffset = 0;
+    for(const auto &[compressed, raw] : m_frameIndex)
+    {
+      std::fprintf(index, "%llu %llu\n", static_cast<unsigned long long>(compressedOffset), static_cast<unsigned long long>(rawOffset));
+      compressedOffset += compressed;
+      rawOffset += raw;
+    }
+
+    if(std::fclose(index) != 0)
+      m_writeFailed = true;
+  }
+};
+
+#endif
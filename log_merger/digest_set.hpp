@@ -0,0 +1,210 @@
+/*
+*  MIT License
+*
+*  Copyright (c) 2025 Pawel Drzycimski
+*
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+*
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+*
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*
+*/
+
+#ifndef LOG_MERGER_DIGEST_SET_HPP_
+#define LOG_MERGER_DIGEST_SET_HPP_
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+/*
+ * Digest stored inline, one per cache line, shorter digests are zero padded
+ */
+struct alignas(64) Digest
+{
+  static constexpr size_t SIZE = 64;
+
+  uint8_t bytes[SIZE];
+
+  bool isZero() const
+  {
+    static constexpr uint8_t ZERO[SIZE] {};
+    return std::memcmp(bytes, ZERO, SIZE) == 0;
+  }
+
+  bool operator==(const Digest &other) const { return std::memcmp(bytes, other.bytes, SIZE) == 0; }
+};
+
+static_assert(sizeof(Digest) == 64);
+
+/*
+ * Set of file digests shared by hash workers. Split into shards by digest
+ * prefix, each one open addressing table with linear probing under its own
+ * lock, so workers only meet when their digests land in the same shard.
+ * All-zero slot means empty, so zero digest (also what failed hashing
+ * gives, empty vector) is kept in a flag instead.
+ */
+class DigestSet final
+{
+  static constexpr unsigned SHARD_BITS = 8;
+  static constexpr size_t SHARDS = size_t{1} << SHARD_BITS;
+  static constexpr size_t MIN_CAPACITY = 16;
+
+  struct alignas(64) Shard
+  {
+    std::mutex mutex;
+    std::unique_ptr<Digest[]> slots;
+    size_t capacity {0};
+    size_t size {0};
+    bool hasZero {false};
+  };
+
+  std::unique_ptr<Shard[]> m_shards{ new Shard[SHARDS] };
+
+public:
+  /*
+   * Room for count digests up front, false when memory is not there
+   */
+  bool reserve(size_t count)
+  {
+    const size_t perShard = std::bit_ceil(std::max(MIN_CAPACITY, count / SHARDS * 4 / 3 + 1));
+    try{
+      for(size_t i = 0; i < SHARDS; ++i)
+      {
+        std::lock_guard lock(m_shards[i].mutex);
+        if(m_shards[i].capacity < perShard)
+          rehash(m_shards[i], perShard);
+      }
+    }catch(const std::bad_alloc&)
+    {
+      return false;
+    }
+
+    return true;
+  }
+
+  /*
+   * True when digest was not there yet
+   */
+  bool insert(const uint8_t *digest, size_t len)
+  {
+    Digest key;
+    std::memcpy(key.bytes, digest, std::min(len, Digest::SIZE));
+    if(len < Digest::SIZE)
+      std::memset(key.bytes + len, 0, Digest::SIZE - len);
+
+    const uint64_t hash = hashOf(key);
+    Shard &shard = m_shards[hash >> (64 - SHARD_BITS)];
+    std::lock_guard lock(shard.mutex);
+    if(key.isZero())
+    {
+      const bool ret = !shard.hasZero;
+      shard.hasZero = true;
+      return ret;
+    }
+
+    if((shard.size + 1) * 4 > shard.capacity * 3)
+      rehash(shard, std::max(MIN_CAPACITY, shard.capacity * 2));
+
+    const size_t mask = shard.capacity - 1;
+    for(size_t idx = hash & mask; ; idx = (idx + 1) & mask)
+    {
+      Digest &slot = shard.slots[idx];
+      if(slot.isZero())
+      {
+        slot = key;
+        ++shard.size;
+        return true;
+      }
+      if(slot == key)
+        return false;
+    }
+  }
+
+  bool insert(const std::vector<uint8_t> &digest)
+  {
+    return insert(digest.data(), digest.size());
+  }
+
+  size_t size()
+  {
+    size_t ret = 0;
+    for(size_t i = 0; i < SHARDS; ++i)
+    {
+      std::lock_guard lock(m_shards[i].mutex);
+      ret += m_shards[i].size + m_shards[i].hasZero;
+    }
+    return ret;
+  }
+
+  size_t bytes()
+  {
+    size_t ret = SHARDS * sizeof(Shard);
+    for(size_t i = 0; i < SHARDS; ++i)
+    {
+      std::lock_guard lock(m_shards[i].mutex);
+      ret += m_shards[i].capacity * sizeof(Digest);
+    }
+    return ret;
+  }
+
+private:
+  /*
+   * Digests are uniform already, prefix only gets mixed in case they are short
+   */
+  static uint64_t hashOf(const Digest &key)
+  {
+    uint64_t first;
+    uint64_t second;
+    std::memcpy(&first, key.bytes, sizeof(first));
+    std::memcpy(&second, key.bytes + sizeof(first), sizeof(second));
+
+    uint64_t ret = first ^ std::rotl(second, 31);
+    ret ^= ret >> 33;
+    ret *= 0xff51afd7ed558ccdULL;
+    ret ^= ret >> 33;
+    ret *= 0xc4ceb9fe1a85ec53ULL;
+    ret ^= ret >> 33;
+    return ret;
+  }
+
+  static void rehash(Shard &shard, size_t capacity)
+  {
+    std::unique_ptr<Digest[]> slots{ new Digest[capacity]() };
+    const size_t mask = capacity - 1;
+    for(size_t i = 0; i < shard.capacity; ++i)
+    {
+      const Digest &digest = shard.slots[i];
+      if(digest.isZero())
+        continue;
+
+      size_t idx = hashOf(digest) & mask;
+      while(!slots[idx].isZero())
+        idx = (idx + 1) & mask;
+      slots[idx] = digest;
+    }
+
+    shard.slots = std::move(slots);
+    shard.capacity = capacity;
+  }
+};
+
+#endif
@@ -0,0 +1,359 @@
+/*
+*  MIT License
+*
+*  Copyright (c) 2025 Pawel Drzycimski
+*
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+*
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+*
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*
+*/
+
+#ifndef LOG_MERGER_DIR_WALKER_HPP_
+#define LOG_MERGER_DIR_WALKER_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+struct WalkStats
+{
+  uint64_t dirs {0};
+  uint64_t entries {0};
+  uint64_t files {0};
+  uint64_t stats {0};
+  uint64_t steals {0};
+  uint64_t errors {0};
+};
+
+/*
+ * Regular file found by walker. dirFd and name are valid only during callback,
+ * use them for fstatat/openat instead of full path.
+ */
+struct WalkEntry
+{
+  std::string_view path;
+  std::string_view name;
+  int dirFd;
+};
+
+/*
+ * Parallel directory walker on raw getdents64.
+ *
+ * Entry type comes from d_type, stat is needed only when file system doesn't
+ * fill it in or for symlinks. Subdirectories are opened relative to parent fd
+ * while it's still open, as long as there is budget for open descriptors.
+ *
+ * Every thread owns deque of directories, takes newest one from the back
+ * (depth first, small working set), idle threads steal oldest from the front
+ * of others (top of tree, biggest chunk of work).
+ *
+ * Like recursive_directory_iterator symlinked directories are not followed,
+ * symlinked files are reported.
+ */
+class DirWalker final
+{
+  static constexpr size_t DENTS_BUFFER_SIZE = 64 * 1024;
+  static constexpr int MAX_PENDING_FDS = 512;
+
+  struct DirJob
+  {
+    std::string path;
+    int fd {-1};
+  };
+
+  struct alignas(64) WorkerQueue
+  {
+    std::mutex mutex;
+    std::deque<DirJob> jobs;
+  };
+
+  // matches kernel's struct linux_dirent64
+  struct LinuxDirent64
+  {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+  };
+
+  std::vector<std::unique_ptr<WorkerQueue>> m_queues;
+
+  // directories queued or being read, walk is done when it drops to 0
+  alignas(64) std::atomic<size_t> m_pending{0};
+  std::atomic<uint32_t> m_workSeq{0};
+  std::atomic<uint32_t> m_idle{0};
+  std::atomic<int> m_pendingFds{0};
+
+  std::atomic<uint64_t> m_dirs{0};
+  std::atomic<uint64_t> m_entries{0};
+  std::atomic<uint64_t> m_files{0};
+  std::atomic<uint64_t> m_stats{0};
+  std::atomic<uint64_t> m_steals{0};
+  std::atomic<uint64_t> m_errors{0};
+
+public:
+  DirWalker() = default;
+  DirWalker(const DirWalker&) = delete;
+  DirWalker(DirWalker&&) = delete;
+
+  /*
+   * Blocks until whole tree under root is walked. onFile(worker, entry)
+   * is called concurrently from threadCount threads, worker is in [0, threadCount).
+   */
+  template<typename OnFile>
+  WalkStats walk(std::string_view root, unsigned threadCount, OnFile &&onFile)
+  {
+    return walk(std::vector<std::string>{ std::string{root} }, threadCount, std::forward<OnFile>(onFile));
+  }
+
+  /*
+   * Same for many roots, they start spread over workers' queues. Roots
+   * are not deduplicated, overlapping roots report same files twice.
+   */
+  template<typename OnFile>
+  WalkStats walk(const std::vector<std::string> &roots, unsigned threadCount, OnFile &&onFile)
+  {
+    threadCount = std::max(threadCount, 1u);
+    m_queues.clear();
+    for(unsigned i = 0; i < threadCount; ++i)
+      m_queues.push_back(std::make_unique<WorkerQueue>());
+
+    for(size_t i = 0; i < roots.size(); ++i)
+      pushJob(static_cast<unsigned>(i % threadCount), DirJob{ .path = roots[i], .fd = -1 });
+
+    {
+      std::vector<std::jthread> threads;
+      threads.reserve(threadCount);
+      for(unsigned i = 0; i < threadCount; ++i)
+        threads.emplace_back([this, i, &onFile] { worker(i, onFile); });
+    }
+
+    return WalkStats{
+      .dirs = m_dirs.load(),
+      .entries = m_entries.load(),
+      .files = m_files.load(),
+      .stats = m_stats.load(),
+      .steals = m_steals.load(),
+      .errors = m_errors.load()
+    };
+  }
+
+private:
+  void pushJob(unsigned self, DirJob &&job)
+  {
+    m_pending.fetch_add(1, std::memory_order_relaxed);
+    {
+      std::lock_guard lock(m_queues[self]->mutex);
+      m_queues[self]->jobs.push_back(std::move(job));
+    }
+
+    if(m_idle.load(std::memory_order_seq_cst))
+    {
+      m_workSeq.fetch_add(1, std::memory_order_seq_cst);
+      m_workSeq.notify_one();
+    }
+  }
+
+  bool popJob(unsigned self, DirJob &job)
+  {
+    {
+      WorkerQueue &own = *m_queues[self];
+      std::lock_guard lock(own.mutex);
+      if(!own.jobs.empty())
+      {
+        job = std::move(own.jobs.back());
+        own.jobs.pop_back();
+        return true;
+      }
+    }
+
+    for(size_t i = 1; i < m_queues.size(); ++i)
+    {
+      WorkerQueue &victim = *m_queues[(self + i) % m_queues.size()];
+      std::lock_guard lock(victim.mutex);
+      if(!victim.jobs.empty())
+      {
+        job = std::move(victim.jobs.front());
+        victim.jobs.pop_front();
+        m_steals.fetch_add(1, std::memory_order_relaxed);
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  void jobDone()
+  {
+    if(m_pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+      // last one, wake everybody so they can leave
+      m_workSeq.fetch_add(1, std::memory_order_seq_cst);
+      m_workSeq.notify_all();
+    }
+  }
+
+  template<typename OnFile>
+  void worker(unsigned self, OnFile &onFile)
+  {
+    std::unique_ptr<uint8_t[]> dents{ new uint8_t[DENTS_BUFFER_SIZE] };
+    DirJob job;
+    while(true)
+    {
+      if(popJob(self, job))
+      {
+        readDir(self, job, dents.get(), onFile);
+        jobDone();
+        continue;
+      }
+
+      const uint32_t seq = m_workSeq.load(std::memory_order_seq_cst);
+      if(m_pending.load(std::memory_order_seq_cst) == 0)
+        return;
+
+      // recheck after announcing idleness, otherwise push could miss us
+      m_idle.fetch_add(1, std::memory_order_seq_cst);
+      if(!anyQueued())
+        m_workSeq.wait(seq, std::memory_order_seq_cst);
+      m_idle.fetch_sub(1, std::memory_order_relaxed);
+    }
+  }
+
+  bool anyQueued()
+  {
+    for(const auto &queue : m_queues)
+    {
+      std::lock_guard lock(queue->mutex);
+      if(!queue->jobs.empty())
+        return true;
+    }
+
+    return false;
+  }
+
+  template<typename OnFile>
+  void readDir(unsigned self, DirJob &job, uint8_t *dents, OnFile &onFile)
+  {
+    int dirFd = job.fd;
+    if(dirFd >= 0)
+      m_pendingFds.fetch_sub(1, std::memory_order_relaxed);
+    else
+      dirFd = ::open(job.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if(dirFd < 0)
+    {
+      m_errors.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+
+    m_dirs.fetch_add(1, std::memory_order_relaxed);
+
+    std::string path = std::move(job.path);
+    if(!path.ends_with('/'))
+      path.push_back('/');
+    const size_t prefixLen = path.size();
+
+    uint64_t entries = 0;
+    uint64_t files = 0;
+    uint64_t stats = 0;
+    while(true)
+    {
+      const long read = ::syscall(SYS_getdents64, dirFd, dents, DENTS_BUFFER_SIZE);
+      if(read <= 0)
+      {
+        if(read < 0)
+          m_errors.fetch_add(1, std::memory_order_relaxed);
+        break;
+      }
+
+      for(long pos = 0; pos < read;)
+      {
+        const auto *dent = reinterpret_cast<const LinuxDirent64*>(dents + pos);
+        pos += dent->d_reclen;
+
+        const char *name = dent->d_name;
+        if(name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+          continue;
+
+        ++entries;
+        unsigned char type = dent->d_type;
+        if(type == DT_UNKNOWN || type == DT_LNK)
+        {
+          ++stats;
+          struct stat st;
+          // symlinks are followed for files only, same as recursive_directory_iterator
+          const bool follow = type == DT_LNK;
+          if(::fstatat(dirFd, name, &st, follow ? 0 : AT_SYMLINK_NOFOLLOW) != 0)
+            continue;
+
+          if(S_ISREG(st.st_mode))
+            type = DT_REG;
+          else if(S_ISDIR(st.st_mode) && !follow)
+            type = DT_DIR;
+          else
+            continue;
+        }
+
+        const std::string_view nameView{name};
+        path.resize(prefixLen);
+        path.append(nameView);
+
+        if(type == DT_DIR)
+        {
+          DirJob child{ .path = path, .fd = -1 };
+          if(m_pendingFds.fetch_add(1, std::memory_order_relaxed) < MAX_PENDING_FDS)
+            child.fd = ::openat(dirFd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+          // out of budget or openat failed, child opens by path later
+          if(child.fd < 0)
+            m_pendingFds.fetch_sub(1, std::memory_order_relaxed);
+
+          pushJob(self, std::move(child));
+        }
+        else if(type == DT_REG)
+        {
+          ++files;
+          onFile(self, WalkEntry{ .path = path, .name = nameView, .dirFd = dirFd });
+        }
+      }
+    }
+
+    ::close(dirFd);
+
+    m_entries.fetch_add(entries, std::memory_order_relaxed);
+    m_files.fetch_add(files, std::memory_order_relaxed);
+    m_stats.fetch_add(stats, std::memory_order_relaxed);
+  }
+};
+
+#endif
@@ -0,0 +1,290 @@
+/*
+*  MIT License
+*
+*  Copyright (c) 2025 Pawel Drzycimski
+*
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+*
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+*
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*
+*/
+
+#ifndef LOG_MERGER_DIRECT_IO_HPP_
+#define LOG_MERGER_DIRECT_IO_HPP_
+
+#include "chunk_pool.hpp"
+#include "mpmc_queue.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// offsets, lengths and buffer addresses of O_DIRECT transfers are multiples of it,
+// covers 512 byte and 4K logical block devices alike
+inline constexpr size_t DIRECT_IO_ALIGN = 4096;
+
+struct DirectIoStats
+{
+  std::atomic<uint64_t> directReads {0};
+  std::atomic<uint64_t> bufferedReads {0};
+  // payload only, not block head written again nor padding of last block
+  std::atomic<uint64_t> bytesWritten {0};
+  std::atomic<uint64_t> writes {0};
+  std::atomic<uint64_t> outputStalls {0};
+};
+
+/*
+ * Input read around page cache. Filesystems refusing O_DIRECT get plain
+ * reads followed by dropping what was read from cache.
+ */
+class DirectInput final
+{
+  int m_fd {-1};
+  bool m_direct {false};
+  uint64_t m_offset {0};
+  uint64_t m_size {0};
+
+public:
+  DirectInput() = default;
+  DirectInput(const DirectInput&) = delete;
+  DirectInput(DirectInput&&) = delete;
+
+  ~DirectInput()
+  {
+    if(m_fd >= 0)
+      ::close(m_fd);
+  }
+
+  bool open(const char *path)
+  {
+    m_fd = ::open(path, O_RDONLY | O_CLOEXEC | O_DIRECT);
+    m_direct = m_fd >= 0;
+    if(m_fd < 0)
+      m_fd = ::open(path, O_RDONLY | O_CLOEXEC);
+
+    struct stat st;
+    if(m_fd >= 0 && ::fstat(m_fd, &st) == 0)
+      m_size = static_cast<uint64_t>(st.st_size);
+    return m_fd >= 0;
+  }
+
+  bool direct() const { return m_direct; }
+
+  /*
+   * At or past size file had at open, short read before that isn't end of file
+   */
+  bool atEnd() const { return m_offset >= m_size; }
+
+  /*
+   * buffer and size aligned to DIRECT_IO_ALIGN, 0 at end of file
+   */
+  ssize_t read(uint8_t *buffer, size_t size)
+  {
+    // short read left offset unaligned, the rest goes through page cache
+    if(m_direct && m_offset % DIRECT_IO_ALIGN)
+    {
+      ::fcntl(m_fd, F_SETFL, ::fcntl(m_fd, F_GETFL) & ~O_DIRECT);
+      m_direct = false;
+    }
+
+    while(true)
+    {
+      const ssize_t ret = ::pread(m_fd, buffer, size, static_cast<off_t>(m_offset));
+      if(ret < 0 && errno == EINTR)
+        continue;
+      if(ret < 0 && errno == EINVAL && m_direct)
+      {
+        // accepted at open, refused at read (some network and fuse filesystems)
+        ::fcntl(m_fd, F_SETFL, ::fcntl(m_fd, F_GETFL) & ~O_DIRECT);
+        m_direct = false;
+        continue;
+      }
+      if(ret > 0)
+      {
+        if(!m_direct)
+          ::posix_fadvise(m_fd, static_cast<off_t>(m_offset), ret, POSIX_FADV_DONTNEED);
+        m_offset += static_cast<uint64_t>(ret);
+      }
+      return ret;
+    }
+  }
+};
+
+/*
+ * Sequential output through O_DIRECT. Callers append bytes (one at a time,
+ * it's a stream) into aligned pool chunks, full chunks go to output thread,
+ * so next chunk is filled while previous one is written. Stream start is
+ * rounded down to alignment, the bytes already there are read back first,
+ * and the last chunk is padded and file cut to real size afterwards.
+ */
+class DirectOutput final
+{
+  ChunkPool m_pool;
+  MpmcQueue<Chunk*> m_full;
+  DirectIoStats &m_stats;
+
+  int m_fd {-1};
+  uint64_t m_offset {0};
+  uint64_t m_start {0};
+  uint64_t m_end {0};
+  // end of what writer got into file before first error
+  uint64_t m_writtenEnd {0};
+  Chunk *m_current {nullptr};
+  std::atomic<int> m_error {0};
+  std::jthread m_thread;
+
+public:
+  DirectOutput(size_t chunkSize, size_t chunkCount, DirectIoStats &stats)
+    : m_pool{chunkCount, (chunkSize + DIRECT_IO_ALIGN - 1) / DIRECT_IO_ALIGN * DIRECT_IO_ALIGN, 1},
+      m_full{chunkCount},
+      m_stats{stats}
+  {}
+
+  DirectOutput(const DirectOutput&) = delete;
+  DirectOutput(DirectOutput&&) = delete;
+
+  ~DirectOutput()
+  {
+    m_full.close();
+    if(m_thread.joinable())
+      m_thread.join();
+    if(m_fd >= 0)
+      ::close(m_fd);
+  }
+
+  /*
+   * Output continues at offset of path. Returns 0 or errno, EINVAL when
+   * filesystem doesn't do O_DIRECT.
+   */
+  int open(const char *path, uint64_t offset)
+  {
+    if(const int err = m_pool.init(false))
+      return err;
+
+    m_fd = ::open(path, O_RDWR | O_CLOEXEC | O_DIRECT);
+    if(m_fd < 0)
+      return errno;
+
+    m_start = m_end = offset;
+    m_offset = m_writtenEnd = offset / DIRECT_IO_ALIGN * DIRECT_IO_ALIGN;
+    m_current = m_pool.acquire(0);
+    if(const size_t head = static_cast<size_t>(offset - m_offset))
+    {
+      // partial block already in file, written again along with what follows
+      if(::pread(m_fd, m_current->data, DIRECT_IO_ALIGN, static_cast<off_t>(m_offset)) < static_cast<ssize_t>(head))
+        return errno ? errno : EIO;
+      m_current->size = head;
+    }
+
+    m_thread = std::jthread([this] { writer(); });
+    return 0;
+  }
+
+  void append(const uint8_t *data, size_t size)
+  {
+    while(size)
+    {
+      const size_t take = std::min(size, m_pool.chunkSize() - m_current->size);
+      std::memcpy(m_current->data + m_current->size, data, take);
+      m_current->size += take;
+      m_end += take;
+      data += take;
+      size -= take;
+
+      if(m_current->size == m_pool.chunkSize())
+      {
+        m_full.push(m_current);
+        m_current = m_pool.tryAcquire(0);
+        if(!m_current)
+        {
+          ++m_stats.outputStalls;
+          m_current = m_pool.acquire(0);
+        }
+      }
+    }
+  }
+
+  uint64_t end() const { return m_end; }
+
+  /*
+   * Writes what's left and cuts padding off, returns 0 or errno of first failure
+   */
+  int finish()
+  {
+    if(m_current && m_current->size)
+    {
+      const size_t padded = (m_current->size + DIRECT_IO_ALIGN - 1) / DIRECT_IO_ALIGN * DIRECT_IO_ALIGN;
+      std::memset(m_current->data + m_current->size, 0, padded - m_current->size);
+      m_current->size = padded;
+      m_full.push(m_current);
+    }
+    else if(m_current)
+    {
+      m_pool.release(m_current);
+    }
+    m_current = nullptr;
+
+    m_full.close();
+    if(m_thread.joinable())
+      m_thread.join();
+
+    const uint64_t written = std::min(m_writtenEnd, m_end);
+    m_stats.bytesWritten += written > m_start ? written - m_start : 0;
+
+    if(::ftruncate(m_fd, static_cast<off_t>(m_end)) != 0 && !m_error)
+      m_error = errno;
+    return m_error;
+  }
+
+private:
+  void writer()
+  {
+    Chunk *chunk = nullptr;
+    while(m_full.pop(chunk))
+    {
+      const bool failed = m_error != 0;
+      size_t done = 0;
+      while(done < chunk->size && !m_error)
+      {
+        const ssize_t ret = ::pwrite(m_fd, chunk->data + done, chunk->size - done, static_cast<off_t>(m_offset + done));
+        if(ret < 0 && errno == EINTR)
+          continue;
+        if(ret <= 0)
+        {
+          m_error = ret < 0 ? errno : EIO;
+          break;
+        }
+        done += static_cast<size_t>(ret);
+        ++m_stats.writes;
+      }
+
+      if(!failed)
+        m_writtenEnd = m_offset + done;
+      m_offset += chunk->size;
+      m_pool.release(chunk);
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,503 @@
+/*
+*  MIT License
+*
+*  Copyright (c) 2025 Pawel Drzycimski
+*
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+*
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+*
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*
+*/
+
+#ifndef LOG_MERGER_FOLLOW_HPP_
+#define LOG_MERGER_FOLLOW_HPP_
+
+#include "metrics.hpp"
+#include "path_matcher.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * How far into every input the merge got, filled concurrently by hashers
+ * (duplicates) and writers (copied bytes), then handed over to follower.
+ */
+class FileOffsets final
+{
+  std::mutex m_mutex;
+  std::unordered_map<std::string, uint64_t> m_offsets;
+
+public:
+  void record(std::string_view path, uint64_t offset)
+  {
+    std::lock_guard lock(m_mutex);
+    auto [it, inserted] = m_offsets.try_emplace(std::string{path}, offset);
+    if(!inserted)
+      it->second = std::max(it->second, offset);
+  }
+
+  std::unordered_map<std::string, uint64_t> take()
+  {
+    std::lock_guard lock(m_mutex);
+    return std::move(m_offsets);
+  }
+};
+
+struct FollowStats
+{
+  uint64_t events {0};
+  uint64_t batches {0};
+  uint64_t files {0};
+  uint64_t newFiles {0};
+  uint64_t bytes {0};
+  uint64_t writes {0};
+  uint64_t truncations {0};
+  uint64_t renames {0};
+  uint64_t overflows {0};
+  uint64_t errors {0};
+};
+
+/*
+ * Appends whatever gets written to inputs after the merge. Directories under
+ * roots are watched with inotify from before the merge starts, so nothing
+ * written meanwhile is missed, and every file has an offset it was copied up
+ * to, so nothing is copied twice. Modified files are collected for batch
+ * window and their new bytes go out together in as few writes as possible.
+ *
+ * Only whole lines are taken while following, what's after last newline
+ * waits for the rest of its line (or for stop). Truncated file is copied from
+ * start again (copytruncate rotation), renamed one keeps its offset.
+ * New files are appended as they are, without checking content for duplicates.
+ */
+class LogFollower final
+{
+  static constexpr size_t BUFFER_SIZE = 1024 * 1024;
+  static constexpr uint32_t DIR_EVENTS = IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO
+                                       | IN_DELETE | IN_DELETE_SELF | IN_ONLYDIR;
+
+  const PathMatcher &m_matcher;
+  const std::string m_outName;
+  const int m_outFd;
+
+  int m_inotifyFd {-1};
+  std::unordered_map<int, std::string> m_watches;
+  std::unordered_map<std::string, uint64_t> m_offsets;
+  // files with bytes after last newline not copied yet
+  std::unordered_set<std::string> m_partial;
+  std::unordered_set<std::string> m_dirty;
+  // cookie of last IN_MOVED_FROM, pairs with IN_MOVED_TO which follows it
+  uint32_t m_moveCookie {0};
+  std::string m_movedFrom;
+
+  std::unique_ptr<uint8_t[]> m_buffer;
+  size_t m_filled {0};
+  FollowStats m_stats;
+
+public:
+  LogFollower(const PathMatcher &matcher, std::string outName, int outFd)
+    : m_matcher{matcher}, m_outName{std::move(outName)}, m_outFd{outFd}, m_buffer{new uint8_t[BUFFER_SIZE]}
+  {}
+
+  LogFollower(const LogFollower&) = delete;
+  LogFollower(LogFollower&&) = delete;
+
+  ~LogFollower()
+  {
+    if(m_inotifyFd >= 0)
+      ::close(m_inotifyFd);
+  }
+
+  /*
+   * Watches every directory under roots, has to be called before merge starts.
+   * Returns 0 or errno, failing to watch some subdirectory only counts an error.
+   */
+  int init(const std::vector<std::string> &roots)
+  {
+    m_inotifyFd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(m_inotifyFd < 0)
+      return errno;
+
+    for(const std::string &root : roots)
+    {
+      if(const int err = watchTree(root, false))
+        return err;
+    }
+
+    return 0;
+  }
+
+  size_t watchCount() const { return m_watches.size(); }
+  const FollowStats &stats() const { return m_stats; }
+
+  /*
+   * Runs until stop is set, offsets are what merge copied of each input
+   */
+  void run(std::unordered_map<std::string, uint64_t> offsets, std::chrono::milliseconds batchWindow,
+           const std::atomic<bool> &stop, Metrics &metrics)
+  {
+    m_offsets = std::move(offsets);
+    if(::lseek(m_outFd, 0, SEEK_END) < 0)
+      ++m_stats.errors;
+
+    // events queued during merge are there already
+    auto batchStart = std::chrono::steady_clock::now();
+    while(!stop.load(std::memory_order_relaxed))
+    {
+      pollfd pfd{ .fd = m_inotifyFd, .events = POLLIN, .revents = 0 };
+      const auto elapsed = std::chrono::steady_clock::now() - batchStart;
+      const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(batchWindow - elapsed).count();
+      const int timeout = m_dirty.empty() ? 100 : static_cast<int>(std::clamp<long long>(left, 0, 100));
+      const int ready = ::poll(&pfd, 1, timeout);
+      if(ready < 0 && errno != EINTR)
+      {
+        ++m_stats.errors;
+        break;
+      }
+
+      const bool wasClean = m_dirty.empty();
+      if(ready > 0)
+        readEvents();
+      if(wasClean && !m_dirty.empty())
+        batchStart = std::chrono::steady_clock::now();
+
+      if(!m_dirty.empty() && std::chrono::steady_clock::now() - batchStart >= batchWindow)
+        flushDirty(true, metrics);
+    }
+
+    // last look, then partial lines go out as they are
+    readEvents();
+    m_dirty.insert(m_partial.begin(), m_partial.end());
+    flushDirty(false, metrics);
+  }
+
+private:
+  static std::string childPath(const std::string &dir, std::string_view name)
+  {
+    std::string ret = dir;
+    if(!ret.ends_with('/'))
+      ret.push_back('/');
+    ret.append(name);
+    return ret;
+  }
+
+  bool selected(std::string_view name, const std::string &path) const
+  {
+    return name != m_outName && m_matcher.matches(name, path);
+  }
+
+  /*
+   * Watches dir and everything below it, with markFiles matching files found
+   * are marked dirty, they may have been written before watch was in place.
+   * Returns errno when root itself can't be watched.
+   */
+  int watchTree(const std::string &root, bool markFiles)
+  {
+    std::vector<std::string> dirs{ root };
+    int ret = 0;
+    while(!dirs.empty())
+    {
+      const std::string dir = std::move(dirs.back());
+      dirs.pop_back();
+
+      const int wd = ::inotify_add_watch(m_inotifyFd, dir.c_str(), DIR_EVENTS);
+      if(wd < 0)
+      {
+        if(dir == root)
+          ret = errno;
+        ++m_stats.errors;
+        continue;
+      }
+      m_watches[wd] = dir;
+
+      DIR *handle = ::opendir(dir.c_str());
+      if(!handle)
+        continue;
+
+      while(const dirent *entry = ::readdir(handle))
+      {
+        const std::string_view name{entry->d_name};
+        if(name == "." || name == "..")
+          continue;
+
+        std::string path = childPath(dir, name);
+        unsigned char type = entry->d_type;
+        if(type == DT_UNKNOWN || type == DT_LNK)
+        {
+          struct stat st;
+          if(::stat(path.c_str(), &st) != 0)
+            continue;
+          // same as walker, symlinked directories are not entered
+          type = S_ISREG(st.st_mode) ? DT_REG : (S_ISDIR(st.st_mode) && entry->d_type != DT_LNK ? DT_DIR : DT_UNKNOWN);
+        }
+
+        if(type == DT_DIR)
+          dirs.push_back(std::move(path));
+        else if(type == DT_REG && markFiles && selected(name, path))
+          m_dirty.insert(std::move(path));
+      }
+      ::closedir(handle);
+    }
+
+    return ret;
+  }
+
+  void readEvents()
+  {
+    alignas(inotify_event) char buffer[64 * 1024];
+    while(true)
+    {
+      const ssize_t got = ::read(m_inotifyFd, buffer, sizeof(buffer));
+      if(got <= 0)
+        break;
+
+      for(ssize_t pos = 0; pos < got;)
+      {
+        const auto *event = reinterpret_cast<const inotify_event*>(buffer + pos);
+        pos += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+        ++m_stats.events;
+        onEvent(*event);
+      }
+    }
+  }
+
+  void onEvent(const inotify_event &event)
+  {
+    if(event.mask & IN_Q_OVERFLOW)
+    {
+      // events are lost, every watched file is looked at, offsets keep it exact
+      ++m_stats.overflows;
+      std::vector<std::string> dirs;
+      for(const auto &[wd, dir] : m_watches)
+        dirs.push_back(dir);
+      for(const std::string &dir : dirs)
+        markDirectory(dir);
+      return;
+    }
+
+    if(event.mask & IN_IGNORED)
+    {
+      m_watches.erase(event.wd);
+      return;
+    }
+
+    const auto dirIt = m_watches.find(event.wd);
+    if(dirIt == m_watches.end() || !event.len)
+      return;
+
+    const std::string_view name{event.name};
+    std::string path = childPath(dirIt->second, name);
+    if(event.mask & IN_ISDIR)
+    {
+      if(event.mask & (IN_CREATE | IN_MOVED_TO))
+        watchTree(path, true);
+      return;
+    }
+
+    if(event.mask & IN_MOVED_FROM)
+    {
+      m_moveCookie = event.cookie;
+      m_movedFrom = path;
+      return;
+    }
+
+    if(event.mask & IN_DELETE)
+    {
+      m_offsets.erase(path);
+      m_partial.erase(path);
+      m_dirty.erase(path);
+      return;
+    }
+
+    if(event.mask & IN_MOVED_TO && event.cookie == m_moveCookie && !m_movedFrom.empty())
+    {
+      // rotation by rename, content already merged under old name
+      const auto it = m_offsets.find(m_movedFrom);
+      if(it != m_offsets.end())
+      {
+        // kept under any name, file may come back to selected one later
+        ++m_stats.renames;
+        const uint64_t offset = it->second;
+        m_offsets.erase(it);
+        m_offsets[path] = offset;
+      }
+      if(m_partial.erase(m_movedFrom) && selected(name, path))
+        m_partial.insert(path);
+      m_dirty.erase(m_movedFrom);
+      m_movedFrom.clear();
+    }
+
+    if(selected(name, path))
+      m_dirty.insert(std::move(path));
+  }
+
+  void markDirectory(const std::string &dir)
+  {
+    DIR *handle = ::opendir(dir.c_str());
+    if(!handle)
+      return;
+
+    while(const dirent *entry = ::readdir(handle))
+    {
+      const std::string_view name{entry->d_name};
+      if(entry->d_type == DT_DIR)
+        continue;
+
+      std::string path = childPath(dir, name);
+      if(selected(name, path))
+        m_dirty.insert(std::move(path));
+    }
+    ::closedir(handle);
+  }
+
+  void flushDirty(bool wholeLines, Metrics &metrics)
+  {
+    if(m_dirty.empty())
+      return;
+
+    ++m_stats.batches;
+    const uint64_t bytesBefore = m_stats.bytes;
+    uint64_t files = 0;
+    for(const std::string &path : m_dirty)
+    {
+      if(copyTail(path, wholeLines))
+        ++files;
+    }
+    m_dirty.clear();
+    flushBuffer();
+
+    m_stats.files += files;
+    metrics.add(Metric::FilesWritten, files);
+    metrics.add(Metric::BytesWritten, m_stats.bytes - bytesBefore);
+  }
+
+  /*
+   * New bytes of path into buffer, with wholeLines only up to last newline.
+   * True when anything was taken.
+   */
+  bool copyTail(const std::string &path, bool wholeLines)
+  {
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+      return false;
+
+    struct stat st;
+    if(::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+      ::close(fd);
+      return false;
+    }
+
+    auto [it, isNew] = m_offsets.try_emplace(path, 0);
+    if(isNew)
+      ++m_stats.newFiles;
+    uint64_t &offset = it->second;
+    const auto size = static_cast<uint64_t>(st.st_size);
+    if(size < offset)
+    {
+      ++m_stats.truncations;
+      offset = 0;
+    }
+
+    size_t fileStart = m_filled;
+    bool flushedPart = false;
+    uint64_t pos = offset;
+    while(pos < size)
+    {
+      if(m_filled == BUFFER_SIZE)
+      {
+        flushBuffer();
+        fileStart = 0;
+        flushedPart = true;
+      }
+
+      const size_t toRead = static_cast<size_t>(std::min<uint64_t>(BUFFER_SIZE - m_filled, size - pos));
+      const ssize_t got = ::pread(fd, m_buffer.get() + m_filled, toRead, static_cast<off_t>(pos));
+      if(got < 0 && errno == EINTR)
+        continue;
+      if(got <= 0)
+        break;
+
+      m_filled += static_cast<size_t>(got);
+      pos += static_cast<uint64_t>(got);
+    }
+    ::close(fd);
+
+    if(wholeLines && pos > offset)
+    {
+      const uint8_t *begin = m_buffer.get() + fileStart;
+      const uint8_t *end = m_buffer.get() + m_filled;
+      const auto last = std::find(std::make_reverse_iterator(end), std::make_reverse_iterator(begin), '\n');
+      const size_t keep = static_cast<size_t>(last.base() - begin);
+      // line longer than buffer went out in part already, rest goes with it
+      if(keep || !flushedPart)
+      {
+        pos -= static_cast<uint64_t>(m_filled - fileStart - keep);
+        m_filled = fileStart + keep;
+      }
+    }
+
+    if(pos < size)
+      m_partial.insert(path);
+    else
+      m_partial.erase(path);
+
+    const bool took = pos > offset;
+    m_stats.bytes += pos - offset;
+    offset = pos;
+    return took;
+  }
+
+  void flushBuffer()
+  {
+    size_t written = 0;
+    while(written < m_filled)
+    {
+      const ssize_t ret = ::write(m_outFd, m_buffer.get() + written, m_filled - written);
+      if(ret < 0 && errno == EINTR)
+        continue;
+      if(ret <= 0)
+      {
+        ++m_stats.errors;
+        break;
+      }
+      ++m_stats.writes;
+      written += static_cast<size_t>(ret);
+    }
+    m_filled = 0;
+  }
+};
+
+#endif
@@ -0,0 +1,224 @@
+/*
+*  MIT License
+*
+*  Copyright (c) 2025 Pawel Drzycimski
+*
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+*
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+*
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*
+*/
+
+#ifndef LOG_MERGER_HASH_INDEX_HPP_
+#define LOG_MERGER_HASH_INDEX_HPP_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * On disk: IndexHeader followed by IndexRecord[count] sorted by (dev, ino).
+ * Every digest in the index is content that made it into the output.
+ * treeHashMin is size from which files got tree digest instead of BLAKE2b
+ * (0 when none did), digests of runs with other threshold don't compare.
+ * contentSize is what the file decodes to when record is decoded, its size
+ * otherwise, so output ranges don't need the file decoded once more.
+ */
+struct IndexHeader
+{
+  char magic[8];
+  uint64_t count;
+  uint64_t treeHashMin;
+};
+
+struct IndexRecord
+{
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  int64_t mtimeNs;
+  uint64_t contentSize;
+  uint8_t digestLen;
+  uint8_t decoded;
+  uint8_t digest[64];
+  uint8_t pad[6];
+
+  bool operator<(const IndexRecord &other) const
+  {
+    return dev < other.dev || (dev == other.dev && ino < other.ino);
+  }
+};
+
+static_assert(sizeof(IndexRecord) == 112, "Index record layout changed, bump magic");
+
+class HashIndex final
+{
+  static constexpr char MAGIC[8] = {'L', 'M', 'I', 'D', 'X', '0', '0', '3'};
+
+  // digest kind of this run, see IndexHeader
+  const uint64_t m_treeHashMin;
+  // records of runs which decoded inputs (or didn't, when this one does) don't compare
+  const bool m_decode;
+
+  // previous run, read only
+  void *m_map {MAP_FAILED};
+  size_t m_mapSize {0};
+  const IndexRecord *m_records {nullptr};
+  size_t m_count {0};
+
+  // this run
+  std::vector<IndexRecord> m_newRecords;
+  std::mutex m_newRecordsMutex;
+
+public:
+  explicit HashIndex(uint64_t treeHashMin = 0, bool decode = false)
+    : m_treeHashMin{treeHashMin}, m_decode{decode}
+  {}
+
+  HashIndex(const HashIndex&) = delete;
+  HashIndex(HashIndex&&) = delete;
+
+  ~HashIndex()
+  {
+    if(m_map != MAP_FAILED)
+      ::munmap(m_map, m_mapSize);
+  }
+
+  static IndexRecord makeKey(const struct stat &st)
+  {
+    IndexRecord rec;
+    std::memset(&rec, 0x00, sizeof(rec));
+    rec.dev = static_cast<uint64_t>(st.st_dev);
+    rec.ino = static_cast<uint64_t>(st.st_ino);
+    rec.size = static_cast<uint64_t>(st.st_size);
+    rec.mtimeNs = static_cast<int64_t>(st.st_mtim.tv_sec) * 1'000'000'000 + st.st_mtim.tv_nsec;
+    return rec;
+  }
+
+  /*
+   * Missing file is fine, it's the first run. Returns false for broken index,
+   * or one made with other tree hash threshold.
+   */
+  bool load(const std::string &path)
+  {
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+      return errno == ENOENT;
+
+    struct stat st;
+    if(::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(IndexHeader))
+    {
+      ::close(fd);
+      return false;
+    }
+
+    m_mapSize = static_cast<size_t>(st.st_size);
+    m_map = ::mmap(nullptr, m_mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if(m_map == MAP_FAILED)
+      return false;
+
+    const auto *header = static_cast<const IndexHeader*>(m_map);
+    if(std::memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0
+        || sizeof(IndexHeader) + header->count * sizeof(IndexRecord) != m_mapSize
+        || header->treeHashMin != m_treeHashMin)
+      return false;
+
+    m_records = reinterpret_cast<const IndexRecord*>(static_cast<const uint8_t*>(m_map) + sizeof(IndexHeader));
+    m_count = header->count;
+    ::madvise(m_map, m_mapSize, MADV_RANDOM);
+
+    return true;
+  }
+
+  size_t size() const { return m_count; }
+  const IndexRecord *begin() const { return m_records; }
+  const IndexRecord *end() const { return m_records + m_count; }
+
+  /*
+   * Previous digest of unchanged file, nullptr when file is new or was modified
+   */
+  const IndexRecord *find(const struct stat &st) const
+  {
+    const IndexRecord key = makeKey(st);
+    const IndexRecord *it = std::lower_bound(begin(), end(), key);
+    if(it == end() || it->dev != key.dev || it->ino != key.ino)
+      return nullptr;
+
+    if(it->size != key.size || it->mtimeNs != key.mtimeNs || it->decoded != m_decode)
+      return nullptr;
+
+    return it;
+  }
+
+  void record(const struct stat &st, const uint8_t *digest, size_t digestLen, uint64_t contentSize)
+  {
+    IndexRecord rec = makeKey(st);
+    rec.contentSize = contentSize;
+    rec.decoded = m_decode;
+    rec.digestLen = static_cast<uint8_t>(std::min(digestLen, sizeof(rec.digest)));
+    std::memcpy(rec.digest, digest, rec.digestLen);
+
+    std::lock_guard lock(m_newRecordsMutex);
+    m_newRecords.push_back(rec);
+  }
+
+  /*
+   * Writes records of this run, plus previous ones when keepPrevious,
+   * so append-only runs still know about everything already in output.
+   */
+  bool save(const std::string &path, bool keepPrevious)
+  {
+    std::vector<IndexRecord> records = std::move(m_newRecords);
+    if(keepPrevious)
+      records.insert(records.end(), begin(), end());
+
+    // newer records come first, stable sort + unique keeps them
+    std::stable_sort(records.begin(), records.end());
+    records.erase(std::unique(records.begin(), records.end(), [](const auto &lhs, const auto &rhs) {
+      return lhs.dev == rhs.dev && lhs.ino == rhs.ino;
+    }), records.end());
+
+    const std::string tmpPath = path + ".tmp";
+    std::FILE *file = std::fopen(tmpPath.c_str(), "wb");
+    if(!file)
+      return false;
+
+    IndexHeader header;
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.count = records.size();
+    header.treeHashMin = m_treeHashMin;
+
+    bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+    if(ok && !records.empty())
+      ok = std::fwrite(records.data(), sizeof(IndexRecord), records.size(), file) == records.size();
+    ok = std::fclose(file) == 0 && ok;
+
+    return ok && std::rename(tmpPath.c_str(), path.c_str()) == 0;
+  }
+};
+
+#endif
@@ -0,0 +1,70 @@
+/*
+*  MIT License
+*
+*  Copyright (c) 2025 Pawel Drzycimski
+*
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+*
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+*
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*
+*/
+
+#ifndef LOG_MERGER_INPUT_HASH_HPP_
+#define LOG_MERGER_INPUT_HASH_HPP_
+
+#include "input_reader.hpp"
+
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <vector>
+
+#include <openssl/evp.h>
+
+/*
+ * Digest of what input reads (decoded content, if it decodes), size gets number of bytes read.
+ * Works on whatever descriptor input has, opened by path or adopted from caller.
+ */
+inline std::vector<uint8_t> hashInput(InputReader &input, const EVP_MD *evpMd, uint64_t &size)
+{
+  std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx{ EVP_MD_CTX_new(), &EVP_MD_CTX_free };
+  if(!ctx || !EVP_DigestInit_ex(ctx.get(), evpMd, nullptr))
+    return {};
+
+  uint8_t buf[64 * 1024];
+  size = 0;
+  while(true)
+  {
+    const ssize_t got = input.read(buf, sizeof(buf));
+    if(got < 0)
+      return {};
+    if(got == 0)
+      break;
+
+    EVP_DigestUpdate(ctx.get(), buf, static_cast<size_t>(got));
+    size += static_cast<uint64_t>(got);
+  }
+
+  uint8_t mdbuf[EVP_MAX_MD_SIZE];
+  unsigned mdlen = 0;
+  if(!EVP_DigestFinal_ex(ctx.get(), mdbuf, &mdlen))
+    return {};
+
+  return std::vector<uint8_t>(std::begin(mdbuf), std::next(std::begin(mdbuf), mdlen));
+}
+
+#endif
@@ -0,0 +1,384 @@
+/*
+*  MIT License
+*
+*  Copyright (c) 2025 Pawel Drzycimski
+*
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+*
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+*
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*
+*/
+
+#ifndef LOG_MERGER_INPUT_READER_HPP_
+#define LOG_MERGER_INPUT_READER_HPP_
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#ifdef LOG_MERGER_ZSTD
+  #include <zstd.h>
+#endif
+
+enum class InputFormat
+{
+  Plain,
+  Gzip,
+  Zstd
+};
+
+inline InputFormat detectFormat(const uint8_t *head, size_t size)
+{
+  static constexpr uint8_t GZIP_MAGIC[] = {0x1f, 0x8b};
+  static constexpr uint8_t ZSTD_MAGIC[] = {0x28, 0xb5, 0x2f, 0xfd};
+
+  if(size >= sizeof(GZIP_MAGIC) && std::memcmp(head, GZIP_MAGIC, sizeof(GZIP_MAGIC)) == 0)
+    return InputFormat::Gzip;
+  if(size >= sizeof(ZSTD_MAGIC) && std::memcmp(head, ZSTD_MAGIC, sizeof(ZSTD_MAGIC)) == 0)
+    return InputFormat::Zstd;
+
+  return InputFormat::Plain;
+}
+
+/*
+ * Format of already opened file, looks at first bytes without moving file position
+ */
+inline InputFormat sniffFormat(int fd)
+{
+  uint8_t head[4];
+  const ssize_t got = ::pread(fd, head, sizeof(head), 0);
+  return got > 0 ? detectFormat(head, static_cast<size_t>(got)) : InputFormat::Plain;
+}
+
+/*
+ * Sequential reader which decompresses gzip and zstd inputs on the fly,
+ * format is detected by magic bytes, not by name. Plain files are read
+ * straight into caller's buffer.
+ *
+ * Concatenated gzip members and zstd frames are read as one stream.
+ * Without zstd support built in, zstd input fails to open.
+ */
+class InputReader final
+{
+  static constexpr size_t IN_BUFFER_SIZE = 256 * 1024;
+
+  int m_fd {-1};
+  InputFormat m_format {InputFormat::Plain};
+
+  // compressed input, for plain files only sniffed head
+  std::unique_ptr<uint8_t[]> m_in;
+  size_t m_inPos {0};
+  size_t m_inEnd {0};
+  bool m_inEof {false};
+  bool m_streamEnd {false};
+
+  z_stream m_zs {};
+  bool m_zsInit {false};
+#ifdef LOG_MERGER_ZSTD
+  ZSTD_DCtx *m_dctx {nullptr};
+  // last ZSTD_decompressStream call left frame unfinished
+  bool m_inFrame {false};
+#endif
+
+public:
+  InputReader() = default;
+  InputReader(const InputReader&) = delete;
+  InputReader(InputReader&&) = delete;
+
+  ~InputReader()
+  {
+    close();
+  }
+
+  /*
+   * decode = false reads every file as plain
+   */
+  bool open(const char *path, bool decode)
+  {
+    const int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+    {
+      close();
+      return false;
+    }
+
+    return adopt(fd, decode);
+  }
+
+  /*
+   * Like open, on descriptor caller already has, reader owns it from now on
+   * and reads from its current position
+   */
+  bool adopt(int fd, bool decode)
+  {
+    close();
+
+    m_fd = fd;
+    if(!decode)
+      return true;
+
+    m_in.reset(new uint8_t[IN_BUFFER_SIZE]);
+    if(!fill())
+      return false;
+
+    m_format = detectFormat(m_in.get(), m_inEnd);
+    switch(m_format)
+    {
+      case InputFormat::Plain:
+        return true;
+      case InputFormat::Gzip:
+        // 15 + 32, zlib or gzip header detected automatically
+        m_zsInit = inflateInit2(&m_zs, 15 + 32) == Z_OK;
+        return m_zsInit;
+      case InputFormat::Zstd:
+#ifdef LOG_MERGER_ZSTD
+        m_dctx = ZSTD_createDCtx();
+        return m_dctx != nullptr;
+#else
+        return false;
+#endif
+    }
+
+    return false;
+  }
+
+  void close()
+  {
+    if(m_zsInit)
+      inflateEnd(&m_zs);
+    m_zsInit = false;
+#ifdef LOG_MERGER_ZSTD
+    ZSTD_freeDCtx(m_dctx);
+    m_dctx = nullptr;
+    m_inFrame = false;
+#endif
+    if(m_fd >= 0)
+      ::close(m_fd);
+    m_fd = -1;
+    m_format = InputFormat::Plain;
+    m_inPos = m_inEnd = 0;
+    m_inEof = m_streamEnd = false;
+  }
+
+  int fd() const { return m_fd; }
+  InputFormat format() const { return m_format; }
+  bool compressed() const { return m_format != InputFormat::Plain; }
+
+  /*
+   * Like read(2): bytes produced, 0 at the end, -1 on read or decode error
+   */
+  ssize_t read(uint8_t *out, size_t size)
+  {
+    switch(m_format)
+    {
+      case InputFormat::Plain:
+        return readPlain(out, size);
+      case InputFormat::Gzip:
+        return readGzip(out, size);
+      case InputFormat::Zstd:
+        return readZstd(out, size);
+    }
+
+    return -1;
+  }
+
+  /*
+   * Size of content after decoding, plain files are just stat'ed, compressed ones
+   * have to be decoded, gzip ISIZE is modulo 4GB and covers only last member.
+   * Last resort, callers which hashed the file already know its size from that pass.
+   */
+  static bool contentSize(const char *path, bool decode, uint64_t &size)
+  {
+    {
+      const int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+      if(fd < 0)
+        return false;
+
+      struct stat st;
+      const bool statOk = ::fstat(fd, &st) == 0;
+      const bool plain = !decode || sniffFormat(fd) == InputFormat::Plain;
+      ::close(fd);
+      if(!statOk)
+        return false;
+
+      if(plain)
+      {
+        size = static_cast<uint64_t>(st.st_size);
+        return true;
+      }
+    }
+
+    InputReader reader;
+    if(!reader.open(path, true))
+      return false;
+
+    std::unique_ptr<uint8_t[]> buffer{ new uint8_t[IN_BUFFER_SIZE] };
+    size = 0;
+    while(true)
+    {
+      const ssize_t got = reader.read(buffer.get(), IN_BUFFER_SIZE);
+      if(got < 0)
+        return false;
+      if(got == 0)
+        return true;
+      size += static_cast<uint64_t>(got);
+    }
+  }
+
+private:
+  bool fill()
+  {
+    if(m_inPos < m_inEnd)
+      return true;
+
+    while(true)
+    {
+      const ssize_t got = ::read(m_fd, m_in.get(), IN_BUFFER_SIZE);
+      if(got < 0 && errno == EINTR)
+        continue;
+      if(got < 0)
+        return false;
+
+      m_inPos = 0;
+      m_inEnd = static_cast<size_t>(got);
+      m_inEof = got == 0;
+      return true;
+    }
+  }
+
+  ssize_t readPlain(uint8_t *out, size_t size)
+  {
+    // sniffed head goes first
+    if(m_inPos < m_inEnd)
+    {
+      const size_t chunk = std::min(size, m_inEnd - m_inPos);
+      std::memcpy(out, m_in.get() + m_inPos, chunk);
+      m_inPos += chunk;
+      return static_cast<ssize_t>(chunk);
+    }
+
+    while(true)
+    {
+      const ssize_t got = ::read(m_fd, out, size);
+      if(got < 0 && errno == EINTR)
+        continue;
+      return got;
+    }
+  }
+
+  ssize_t readGzip(uint8_t *out, size_t size)
+  {
+    m_zs.next_out = out;
+    m_zs.avail_out = static_cast<uInt>(std::min<size_t>(size, UINT32_MAX));
+    while(m_zs.avail_out && !m_streamEnd)
+    {
+      if(m_zs.avail_in == 0)
+      {
+        if(!fill())
+          return -1;
+        if(m_inEof)
+        {
+          // truncated member
+          if(m_zs.total_in)
+            return -1;
+          m_streamEnd = true;
+          break;
+        }
+
+        m_zs.next_in = m_in.get() + m_inPos;
+        m_zs.avail_in = static_cast<uInt>(m_inEnd - m_inPos);
+        m_inPos = m_inEnd;
+      }
+
+      const int ret = inflate(&m_zs, Z_NO_FLUSH);
+      if(ret == Z_STREAM_END)
+      {
+        // next member, unless there's nothing or just padding left
+        if(m_zs.avail_in == 0)
+        {
+          if(!fill())
+            return -1;
+          if(m_inEof)
+          {
+            m_streamEnd = true;
+            break;
+          }
+          m_zs.next_in = m_in.get() + m_inPos;
+          m_zs.avail_in = static_cast<uInt>(m_inEnd - m_inPos);
+          m_inPos = m_inEnd;
+        }
+
+        if(m_zs.next_in[0] != 0x1f)
+        {
+          m_streamEnd = true;
+          break;
+        }
+        inflateReset(&m_zs);
+      }
+      else if(ret != Z_OK && ret != Z_BUF_ERROR)
+      {
+        return -1;
+      }
+    }
+
+    return static_cast<ssize_t>(size - m_zs.avail_out);
+  }
+
+  ssize_t readZstd([[maybe_unused]] uint8_t *out, [[maybe_unused]] size_t size)
+  {
+#ifdef LOG_MERGER_ZSTD
+    ZSTD_outBuffer output{ out, size, 0 };
+    while(output.pos < output.size && !m_streamEnd)
+    {
+      if(m_inPos == m_inEnd)
+      {
+        if(!fill())
+          return -1;
+        if(m_inEof)
+        {
+          // truncated frame, like gzip's truncated member
+          if(m_inFrame)
+            return -1;
+          m_streamEnd = true;
+          break;
+        }
+      }
+
+      ZSTD_inBuffer input{ m_in.get(), m_inEnd, m_inPos };
+      const size_t ret = ZSTD_decompressStream(m_dctx, &output, &input);
+      m_inPos = input.pos;
+      if(ZSTD_isError(ret))
+        return -1;
+      // 0 only once frame is fully decoded and flushed
+      m_inFrame = ret != 0;
+    }
+
+    return static_cast<ssize_t>(output.pos);
+#else
+    return -1;
+#endif
+  }
+};
+
+#endif
@@ -0,0 +1,108 @@
+/*
+*  MIT License
+*
+*  Copyright (c) 2025 Pawel Drzycimski
+*
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+*
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+*
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*
+*/
+
+#ifndef LOG_MERGER_KERNEL_COPY_HPP_
+#define LOG_MERGER_KERNEL_COPY_HPP_
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+
+#include <sys/sendfile.h>
+#include <unistd.h>
+
+struct KernelCopyStats
+{
+  std::atomic<uint64_t> bytes{0};
+  std::atomic<uint64_t> syscalls{0};
+  std::atomic<uint64_t> sendfileFallbacks{0};
+  std::atomic<uint64_t> userspaceFallbacks{0};
+
+  uint64_t bytesPerSyscall() const
+  {
+    const uint64_t calls = syscalls;
+    return calls ? bytes / calls : 0;
+  }
+};
+
+/*
+ * Filesystem simply can't do it for this pair of descriptors,
+ * the next method in chain should be tried.
+ */
+inline bool kernelCopyRefused(int error)
+{
+  return error == EXDEV || error == EINVAL || error == ENOSYS
+    || error == EOPNOTSUPP || error == EBADF || error == EPERM;
+}
+
+/*
+ * Appends everything from the current position of inFd up to EOF
+ * at the current position of outFd.
+ *
+ * Tries copy_file_range first, then sendfile. Both use and advance
+ * descriptor positions, so when false is returned caller can simply
+ * continue with read/write from where kernel stopped.
+ *
+ * Returns true when whole input was moved by the kernel.
+ */
+inline bool kernelCopy(int inFd, int outFd, KernelCopyStats &stats)
+{
+  // single call can't move more than ~2GB anyway
+  static constexpr size_t CHUNK = static_cast<size_t>(1) << 30;
+
+  bool useCopyRange = true;
+  while(true)
+  {
+    const ssize_t moved = useCopyRange
+      ? ::copy_file_range(inFd, nullptr, outFd, nullptr, CHUNK, 0)
+      : ::sendfile(outFd, inFd, nullptr, CHUNK);
+
+    if(moved > 0)
+    {
+      stats.bytes += static_cast<uint64_t>(moved);
+      ++stats.syscalls;
+      continue;
+    }
+
+    if(moved == 0)
+      return true;
+
+    if(errno == EINTR)
+      continue;
+
+    if(useCopyRange && kernelCopyRefused(errno))
+    {
+      ++stats.sendfileFallbacks;
+      useCopyRange = false;
+      continue;
+    }
+
+    ++stats.userspaceFallbacks;
+    return false;
+  }
+}
+
+#endif
@@ -0,0 +1,306 @@
+/*
+*  MIT License
+*
+*  Copyright (c) 2025 Pawel Drzycimski
+*
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+*
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+*
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*
+*/
+
+#ifndef LOG_MERGER_LINE_DEDUP_HPP_
+#define LOG_MERGER_LINE_DEDUP_HPP_
+
+#include "xxhash.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string_view>
+
+#if defined(__x86_64__) || defined(__i386__)
+  #include <immintrin.h>
+  #define LOG_MERGER_X86_SIMD 1
+#endif
+
+#ifdef LOG_MERGER_X86_SIMD
+
+inline const char *findNewlineSse2(const char *begin, const char *end)
+{
+  const __m128i newline = _mm_set1_epi8('\n');
+  for(; begin + 16 <= end; begin += 16)
+  {
+    const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+    const unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline)));
+    if(mask)
+      return begin + __builtin_ctz(mask);
+  }
+
+  for(; begin < end; ++begin)
+  {
+    if(*begin == '\n')
+      return begin;
+  }
+
+  return nullptr;
+}
+
+__attribute__((target("avx2")))
+inline const char *findNewlineAvx2(const char *begin, const char *end)
+{
+  const __m256i newline = _mm256_set1_epi8('\n');
+  for(; begin + 32 <= end; begin += 32)
+  {
+    const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin));
+    const unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, newline)));
+    if(mask)
+      return begin + __builtin_ctz(mask);
+  }
+
+  return findNewlineSse2(begin, end);
+}
+
+using FindNewlineFn = const char *(*)(const char*, const char*);
+
+inline FindNewlineFn selectFindNewline()
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") ? &findNewlineAvx2 : &findNewlineSse2;
+}
+
+#endif
+
+/*
+ * First '\n' in [begin, end) or nullptr, AVX2 when CPU has it, SSE2 otherwise
+ */
+inline const char *findNewline(const char *begin, const char *end)
+{
+#ifdef LOG_MERGER_X86_SIMD
+  static const FindNewlineFn impl = selectFindNewline();
+  return impl(begin, end);
+#else
+  return static_cast<const char*>(std::memchr(begin, '\n', static_cast<size_t>(end - begin)));
+#endif
+}
+
+/*
+ * Open addressing set of 64 bit hashes, linear probing, 0 marks empty slot.
+ * Grows up to maxBytes, after that insert reports it's full.
+ */
+class LineHashSet final
+{
+  static constexpr size_t INITIAL_SLOTS = 64 * 1024;
+  // 7/10 load
+  static constexpr size_t LOAD_NUM = 7;
+  static constexpr size_t LOAD_DEN = 10;
+
+  std::unique_ptr<uint64_t[]> m_slots;
+  size_t m_mask {0};
+  size_t m_size {0};
+  size_t m_maxBytes;
+
+public:
+  enum class Insert
+  {
+    Added,
+    Present,
+    Full
+  };
+
+  explicit LineHashSet(size_t maxBytes)
+    : m_maxBytes{maxBytes}
+  {}
+
+  Insert insert(uint64_t hash)
+  {
+    hash = hash ? hash : 1;
+    if(!m_slots && !grow())
+      return Insert::Full;
+
+    size_t idx = hash & m_mask;
+    while(m_slots[idx])
+    {
+      if(m_slots[idx] == hash)
+        return Insert::Present;
+      idx = (idx + 1) & m_mask;
+    }
+
+    if((m_size + 1) * LOAD_DEN > (m_mask + 1) * LOAD_NUM)
+    {
+      if(!grow())
+        return Insert::Full;
+      return insert(hash);
+    }
+
+    m_slots[idx] = hash;
+    ++m_size;
+    return Insert::Added;
+  }
+
+  size_t size() const { return m_size; }
+  size_t bytes() const { return m_slots ? (m_mask + 1) * sizeof(uint64_t) : 0; }
+
+private:
+  bool grow()
+  {
+    const size_t slots = m_slots ? (m_mask + 1) * 2 : INITIAL_SLOTS;
+    if(slots * sizeof(uint64_t) > m_maxBytes)
+      return false;
+
+    std::unique_ptr<uint64_t[]> fresh{ new (std::nothrow) uint64_t[slots]() };
+    if(!fresh)
+      return false;
+
+    const size_t mask = slots - 1;
+    for(size_t i = 0; m_slots && i <= m_mask; ++i)
+    {
+      const uint64_t hash = m_slots[i];
+      if(!hash)
+        continue;
+
+      size_t idx = hash & mask;
+      while(fresh[idx])
+        idx = (idx + 1) & mask;
+      fresh[idx] = hash;
+    }
+
+    m_slots = std::move(fresh);
+    m_mask = mask;
+    return true;
+  }
+};
+
+/*
+ * Plain Bloom filter, k probes derived from single 64 bit hash (double hashing)
+ */
+class LineBloomFilter final
+{
+  static constexpr unsigned PROBES = 7;
+
+  std::unique_ptr<uint64_t[]> m_bits;
+  uint64_t m_bitCount {0};
+
+public:
+  bool init(size_t bytes)
+  {
+    const size_t words = std::max<size_t>(bytes / sizeof(uint64_t), 1);
+    m_bits.reset(new (std::nothrow) uint64_t[words]());
+    m_bitCount = m_bits ? words * 64 : 0;
+    return m_bits != nullptr;
+  }
+
+  bool active() const { return m_bitCount != 0; }
+  size_t bytes() const { return m_bitCount / 8; }
+
+  /*
+   * Returns true when hash was (probably) there already
+   */
+  bool testAndSet(uint64_t hash)
+  {
+    const uint64_t h1 = hash & 0xFFFFFFFF;
+    const uint64_t h2 = (hash >> 32) | 1;
+    bool present = true;
+    for(unsigned i = 0; i < PROBES; ++i)
+    {
+      const uint64_t bit = (h1 + i * h2) % m_bitCount;
+      const uint64_t word = uint64_t{1} << (bit % 64);
+      present = present && (m_bits[bit / 64] & word);
+      m_bits[bit / 64] |= word;
+    }
+
+    return present;
+  }
+};
+
+struct LineDedupStats
+{
+  uint64_t lines {0};
+  uint64_t duplicates {0};
+  uint64_t bloomDuplicates {0};
+  uint64_t spilled {0};
+  uint64_t setBytes {0};
+  uint64_t bloomBytes {0};
+};
+
+/*
+ * Tells whether line was seen before. Exact until set reaches half of memory cap,
+ * then new lines go to Bloom filter taking the other half. Filter may report
+ * false positive, so after spill rare unique line can be dropped.
+ *
+ * Empty lines are never treated as duplicates.
+ */
+class LineDedup final
+{
+  const size_t m_capBytes;
+  LineHashSet m_set;
+  LineBloomFilter m_bloom;
+  LineDedupStats m_stats;
+
+public:
+  explicit LineDedup(size_t capBytes)
+    : m_capBytes{capBytes},
+      m_set{capBytes / 2}
+  {}
+
+  LineDedup(const LineDedup&) = delete;
+  LineDedup(LineDedup&&) = delete;
+
+  bool firstSeen(std::string_view line)
+  {
+    if(line.empty())
+      return true;
+
+    ++m_stats.lines;
+    const uint64_t hash = xxh::xxhash<64>(line.data(), line.size());
+    switch(m_set.insert(hash))
+    {
+      case LineHashSet::Insert::Added:
+        return true;
+      case LineHashSet::Insert::Present:
+        ++m_stats.duplicates;
+        return false;
+      case LineHashSet::Insert::Full:
+        break;
+    }
+
+    if(!m_bloom.active() && !m_bloom.init(m_capBytes - m_set.bytes()))
+      return true;
+
+    if(m_bloom.testAndSet(hash))
+    {
+      ++m_stats.duplicates;
+      ++m_stats.bloomDuplicates;
+      return false;
+    }
+
+    ++m_stats.spilled;
+    return true;
+  }
+
+  LineDedupStats stats() const
+  {
+    LineDedupStats ret = m_stats;
+    ret.setBytes = m_set.bytes();
+    ret.bloomBytes = m_bloom.bytes();
+    return ret;
+  }
+};
+
+#endif
@@ -0,0 +1,422 @@
+/*
+*  MIT License
+*
+*  Copyright (c) 2025 Pawel Drzycimski
+*
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+*
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+*
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*
+*/
+
+#ifndef LOG_MERGER_LINE_MERGE_HPP_
+#define LOG_MERGER_LINE_MERGE_HPP_
+
+#include "line_dedup.hpp"
+#include "input_reader.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+struct LineMergeStats
+{
+  uint64_t files {0};
+  uint64_t lines {0};
+  uint64_t linesWithoutTimestamp {0};
+  uint64_t bytes {0};
+  uint64_t passes {0};
+  uint64_t unreadable {0};
+  uint64_t droppedDuplicates {0};
+};
+
+/*
+ * Leading "YYYY-MM-DD[T ]HH:MM:SS[.,fraction]" with optional '[' and spaces before it,
+ * as nanoseconds comparable key. Time zone is ignored, inputs are expected to share one.
+ */
+inline std::optional<uint64_t> parseTimestamp(std::string_view line)
+{
+  size_t pos = 0;
+  while(pos < line.size() && (line[pos] == ' ' || line[pos] == '\t' || line[pos] == '['))
+    ++pos;
+
+  const auto number = [&](size_t digits, uint64_t &out) {
+    if(pos + digits > line.size())
+      return false;
+
+    out = 0;
+    for(size_t i = 0; i < digits; ++i)
+    {
+      const char ch = line[pos + i];
+      if(ch < '0' || ch > '9')
+        return false;
+      out = out * 10 + static_cast<uint64_t>(ch - '0');
+    }
+    pos += digits;
+    return true;
+  };
+
+  const auto separator = [&](std::string_view allowed) {
+    if(pos >= line.size() || allowed.find(line[pos]) == std::string_view::npos)
+      return false;
+    ++pos;
+    return true;
+  };
+
+  uint64_t year, month, day, hour, minute, second;
+  if(!number(4, year) || !separator("-") || !number(2, month) || !separator("-") || !number(2, day)
+      || !separator("T ") || !number(2, hour) || !separator(":") || !number(2, minute)
+      || !separator(":") || !number(2, second))
+    return std::nullopt;
+
+  uint64_t nanos = 0;
+  if(separator(".,"))
+  {
+    uint64_t scale = 100'000'000;
+    while(pos < line.size() && line[pos] >= '0' && line[pos] <= '9')
+    {
+      nanos += static_cast<uint64_t>(line[pos] - '0') * scale;
+      scale /= 10;
+      ++pos;
+    }
+  }
+
+  // not a real calendar, only has to keep the order
+  const uint64_t seconds = ((((year * 12 + month) * 31 + day) * 24 + hour) * 60 + minute) * 60 + second;
+  return seconds * 1'000'000'000 + nanos;
+}
+
+/*
+ * Streams lines of one file through fixed read-ahead buffer,
+ * buffer grows only when single line doesn't fit.
+ * Compressed files are decoded when decode is set.
+ */
+class LineSource final
+{
+  InputReader m_input;
+  bool m_open;
+  std::unique_ptr<char[]> m_buffer;
+  size_t m_capacity;
+  size_t m_begin {0};
+  size_t m_end {0};
+  bool m_eof {false};
+  bool m_parseTimestamps;
+
+  std::string_view m_line;
+  uint64_t m_key {0};
+  bool m_hasTimestamp {false};
+
+public:
+  LineSource(const std::string &path, size_t readAhead, bool parseTimestamps = true, bool decode = false)
+    : m_open{m_input.open(path.c_str(), decode)},
+      m_buffer{new char[readAhead]},
+      m_capacity{readAhead},
+      m_parseTimestamps{parseTimestamps}
+  {
+    if(m_open)
+      ::posix_fadvise(m_input.fd(), 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+
+  LineSource(const LineSource&) = delete;
+  LineSource(LineSource&&) = delete;
+
+  bool isOpen() const { return m_open; }
+  std::string_view line() const { return m_line; }
+
+  /*
+   * Key of the last line with timestamp, lines without one (stack traces,
+   * wrapped messages) stay glued to the line they follow.
+   */
+  uint64_t key() const { return m_key; }
+  bool hasTimestamp() const { return m_hasTimestamp; }
+
+  /*
+   * Moves to next line, returns false at end of file
+   */
+  bool next()
+  {
+    while(true)
+    {
+      const char *data = m_buffer.get() + m_begin;
+      const size_t avail = m_end - m_begin;
+      const char *newline = findNewline(data, data + avail);
+      if(newline || (m_eof && avail))
+      {
+        const size_t len = newline ? static_cast<size_t>(newline - data) : avail;
+        m_line = std::string_view{data, len};
+        m_begin += newline ? len + 1 : len;
+
+        if(!m_parseTimestamps)
+          return true;
+
+        const auto ts = parseTimestamp(m_line);
+        m_hasTimestamp = ts.has_value();
+        if(ts)
+          m_key = *ts;
+        return true;
+      }
+
+      if(m_eof)
+        return false;
+
+      fill();
+    }
+  }
+
+private:
+  void fill()
+  {
+    if(m_begin > 0)
+    {
+      std::memmove(m_buffer.get(), m_buffer.get() + m_begin, m_end - m_begin);
+      m_end -= m_begin;
+      m_begin = 0;
+    }
+
+    if(m_end == m_capacity)
+    {
+      std::unique_ptr<char[]> bigger{ new char[m_capacity * 2] };
+      std::memcpy(bigger.get(), m_buffer.get(), m_end);
+      m_buffer = std::move(bigger);
+      m_capacity *= 2;
+    }
+
+    const ssize_t got = m_input.read(reinterpret_cast<uint8_t*>(m_buffer.get()) + m_end, m_capacity - m_end);
+    if(got <= 0)
+      m_eof = true;
+    else
+      m_end += static_cast<size_t>(got);
+  }
+};
+
+inline bool writeLine(std::string_view line, std::FILE &out)
+{
+  return std::fwrite(line.data(), 1, line.size(), &out) == line.size() && std::fputc('\n', &out) != EOF;
+}
+
+/*
+ * k-way heap merge of files ordered by leading timestamp of their lines.
+ * Ties go to file earlier in the list, lines of single file keep their order,
+ * so output depends only on inputs.
+ *
+ * At most fanIn files are open at once, with more inputs groups of them are
+ * merged into temporary files first (tmpPrefix + number), then those get merged.
+ * Memory is fanIn * readAhead plus longest lines, not total size.
+ */
+class LineMerger final
+{
+  size_t m_readAhead;
+  size_t m_fanIn;
+  std::string m_tmpPrefix;
+  size_t m_tmpCounter {0};
+  LineDedup *m_dedup {nullptr};
+  bool m_decode {false};
+  LineMergeStats m_stats;
+
+public:
+  LineMerger(size_t readAhead, size_t fanIn, std::string tmpPrefix)
+    : m_readAhead{std::max<size_t>(readAhead, 256)},
+      m_fanIn{std::max<size_t>(fanIn, 2)},
+      m_tmpPrefix{std::move(tmpPrefix)}
+  {}
+
+  bool merge(std::vector<std::string> paths, std::FILE &out)
+  {
+    m_stats.files = paths.size();
+    bool ok = true;
+    while(paths.size() > m_fanIn)
+    {
+      std::vector<std::string> merged;
+      for(size_t first = 0; first < paths.size() && ok; first += m_fanIn)
+      {
+        const size_t last = std::min(first + m_fanIn, paths.size());
+        if(last - first == 1)
+        {
+          merged.push_back(std::move(paths[first]));
+          continue;
+        }
+
+        std::string tmpPath = m_tmpPrefix + std::to_string(m_tmpCounter++);
+        std::FILE *tmp = std::fopen(tmpPath.c_str(), "wb");
+        if(!tmp)
+        {
+          ok = false;
+          break;
+        }
+
+        ok = mergePass(paths.data() + first, last - first, *tmp, false);
+        ok = std::fclose(tmp) == 0 && ok;
+        removeTemporary(paths.data() + first, last - first);
+        merged.push_back(std::move(tmpPath));
+      }
+
+      paths = std::move(merged);
+      if(!ok)
+      {
+        removeTemporary(paths.data(), paths.size());
+        return false;
+      }
+    }
+
+    ok = mergePass(paths.data(), paths.size(), out, true);
+    removeTemporary(paths.data(), paths.size());
+    return ok;
+  }
+
+  /*
+   * Lines seen before are dropped from final output, intermediate passes keep everything
+   */
+  void setDedup(LineDedup *dedup) { m_dedup = dedup; }
+
+  /*
+   * Compressed inputs are decoded, temporary files are always plain
+   */
+  void decodeInputs() { m_decode = true; }
+
+  const LineMergeStats &stats() const { return m_stats; }
+
+private:
+  bool isTemporary(const std::string &path) const
+  {
+    return path.starts_with(m_tmpPrefix) && path.size() > m_tmpPrefix.size()
+        && std::all_of(path.begin() + static_cast<ptrdiff_t>(m_tmpPrefix.size()), path.end(), [](char ch) { return ch >= '0' && ch <= '9'; });
+  }
+
+  void removeTemporary(const std::string *paths, size_t count) const
+  {
+    for(size_t i = 0; i < count; ++i)
+    {
+      if(isTemporary(paths[i]))
+        std::remove(paths[i].c_str());
+    }
+  }
+
+  bool mergePass(const std::string *paths, size_t count, std::FILE &out, bool final)
+  {
+    ++m_stats.passes;
+
+    std::vector<std::unique_ptr<LineSource>> sources;
+    sources.reserve(count);
+    for(size_t i = 0; i < count; ++i)
+      sources.push_back(std::make_unique<LineSource>(paths[i], m_readAhead, true, m_decode && !isTemporary(paths[i])));
+
+    using HeapItem = std::pair<uint64_t, size_t>; // key, source index
+    std::priority_queue<HeapItem, std::vector<HeapItem>, std::greater<HeapItem>> heap;
+
+    for(size_t i = 0; i < count; ++i)
+    {
+      if(!sources[i]->isOpen())
+      {
+        ++m_stats.unreadable;
+        continue;
+      }
+
+      if(sources[i]->next())
+        heap.emplace(sources[i]->key(), i);
+    }
+
+    bool ok = true;
+    while(!heap.empty())
+    {
+      const size_t idx = heap.top().second;
+      heap.pop();
+
+      LineSource &src = *sources[idx];
+      // lines without timestamp go out together with the one they follow
+      while(true)
+      {
+        const std::string_view line = src.line();
+        if(final && m_dedup && !m_dedup->firstSeen(line))
+        {
+          ++m_stats.droppedDuplicates;
+        }
+        else
+        {
+          ok = writeLine(line, out) && ok;
+          if(final)
+          {
+            ++m_stats.lines;
+            m_stats.bytes += line.size() + 1;
+            if(!src.hasTimestamp())
+              ++m_stats.linesWithoutTimestamp;
+          }
+        }
+
+        if(!src.next())
+          break;
+
+        if(src.hasTimestamp())
+        {
+          heap.emplace(src.key(), idx);
+          break;
+        }
+      }
+    }
+
+    return ok;
+  }
+};
+
+/*
+ * Concatenates files in given order dropping lines seen before, no ordering by time
+ */
+inline bool copyUniqueLines(const std::vector<std::string> &paths, std::FILE &out, LineDedup &dedup, LineMergeStats &stats, bool decode)
+{
+  static constexpr size_t READ_AHEAD = 1024 * 1024;
+
+  bool ok = true;
+  stats.files = paths.size();
+  stats.passes = 1;
+  for(const std::string &path : paths)
+  {
+    LineSource src(path, READ_AHEAD, false, decode);
+    if(!src.isOpen())
+    {
+      ++stats.unreadable;
+      continue;
+    }
+
+    while(src.next())
+    {
+      const std::string_view line = src.line();
+      if(!dedup.firstSeen(line))
+      {
+        ++stats.droppedDuplicates;
+        continue;
+      }
+
+      ok = writeLine(line, out) && ok;
+      ++stats.lines;
+      stats.bytes += line.size() + 1;
+    }
+  }
+
+  return ok;
+}
+
+#endif
@@ -25,23 +25,49 @@
 
 #include "simplelog/simplelog.hpp"
 #include "xxhash.hpp"
-
+#include "kernel_copy.hpp"
+#include "uring.hpp"
+#include "size_prefilter.hpp"
+#include "hash_index.hpp"
+#include "mpmc_queue.hpp"
+#include "path_arena.hpp"
+#include "dir_walker.hpp"
+#include "line_merge.hpp"
+#include "compressed_output.hpp"
+#include "input_reader.hpp"
+#include "input_hash.hpp"
+#include "mapped_hash.hpp"
+#include "metrics.hpp"
+#include "chunk_pool.hpp"
+#include "digest_set.hpp"
+#include "tree_hash.hpp"
+#include "chunk_dedup.hpp"
+#include "direct_io.hpp"
+#include "path_matcher.hpp"
+#include "follow.hpp"
+
+#include <algorithm>
 #include <cstdint>
+#include <cstdlib>
 #include <functional>
+#include <iterator>
 #include <new>
-#include <queue>
+#include <optional>
 #include <thread>
 #include <atomic>
 #include <cassert>
-#include <condition_variable>
+#include <csignal>
 #include <cstring>
+#include <deque>
 #include <filesystem>
 #include <memory>
 #include <mutex>
 
-#include <openssl/bio.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <openssl/evp.h>
-#include <unordered_set>
 #include <vector>
 
 #define KB (static_cast<size_t>(1024))
@@ -60,17 +86,120 @@ using thread_count_t = std::invoke_result_t<decltype(std::thread::hardware_concu
 namespace fs = std::filesystem;
 using namespace std::chrono_literals;
 
+enum class CopyMode
+{
+  Stdio,
+  Kernel,
+  Pwrite,
+  Uring,
+  Direct
+};
+
 struct AppArgs
 {
   std::string_view filename;
-  std::string_view searchExtension;
+  std::vector<std::string_view> roots;
+  std::vector<std::string_view> extensions;
+  // pattern and whether it excludes
+  std::vector<std::pair<std::string_view, bool>> globs;
+  std::vector<std::pair<std::string_view, bool>> regexes;
+  CopyMode copyMode {CopyMode::Stdio};
+  thread_count_t writeThreads {2};
+  thread_count_t walkThreads {4};
+  unsigned queueDepth {32};
+  bool prefilter {false};
+  bool sizeAware {false};
+  std::string_view indexPath;
+  bool appendOnly {false};
+  bool mergeLines {false};
+  size_t lineDedupMb {0};
+  CompressionArgs compression;
+  bool decompress {false};
+  size_t readOnceKb {64};
+  unsigned progressSeconds {0};
+  std::string_view metricsPath;
+  std::optional<unsigned> followMs;
+  size_t treeHashMb {0};
+  size_t chunkDedupKb {0};
+  bool valid {true};
 };
 
 static void usage()
 {
-  LOG << "log_merger_2 -f <file name> -e <extension>";
+  LOG << "log_merger_2 -f <file name> -e <extension>... [-D <dir>...] [-g|-G <glob>...] [-x|-X <regex>...] [-c <copy mode>] [-w <threads>] [-t <threads>] [-q <depth>] [-p] [-S] [-m] [-l <MB>] [-z <format>] [-d] [-i <index file> [-a]] [-s <KB>] [-r <seconds>] [-M <path>] [-F <ms>] [-T <MB>] [-C <KB>]";
   LOG << "  -f <file name> - file name to output merged logs";
-  LOG << "  -e <extension> - case sensitive with dot ex. .txt, .log";
+  LOG << "  -e <extension> - case sensitive with dot ex. .txt, .log, may repeat";
+  LOG << "  -D <dir>       - directory to merge from, may repeat, default current one";
+  LOG << "  -g <glob>      - include files matching shell pattern, -G excludes, may repeat";
+  LOG << "  -x <regex>     - include files containing regex match, -X excludes, may repeat";
+  LOG << "                   patterns with '/' match path from -D on, others file name only;";
+  LOG << "                   file needs one of -e (if any), one include (if any) and no exclude";
+  LOG << "  -c <copy mode> - how files are appended to output:";
+  LOG << "       stdio  - fread/fwrite through user space buffer (default)";
+  LOG << "       kernel - copy_file_range/sendfile, falls back to stdio when refused";
+  LOG << "       pwrite - output ranges reserved up front, writers pwrite concurrently";
+  LOG << "       uring  - io_uring read/hash/write, every file read once, falls back to pwrite;";
+  LOG << "                hashing runs on the ring thread, files over depth/2 MB, tree hashed";
+  LOG << "                or compressed ones go to hash threads and pwrite writers";
+  LOG << "       direct - O_DIRECT reads and writes around page cache, falls back to stdio";
+  LOG << "  -w <threads>   - number of writer threads, default 2";
+  LOG << "  -t <threads>   - number of directory traversal threads, default 4";
+  LOG << "  -q <depth>     - io_uring queue depth and number of 1 MB buffers, default 32";
+  LOG << "  -p             - size and xxh3 prefilter, only colliding files get full digest";
+  LOG << "  -S             - hash largest files first and small ones in batches, hashing waits";
+  LOG << "                   for traversal to finish";
+  LOG << "  -m             - merge lines of unique files ordered by leading timestamp (YYYY-MM-DD HH:MM:SS),";
+  LOG << "                   output is deterministic, -c and -w are ignored";
+  LOG << "  -l <MB>        - drop lines already written, exact up to half of MB then Bloom filter,";
+  LOG << "                   files are concatenated in path order unless -m, -c and -w are ignored";
+  LOG << "  -z <format>    - compress output in independent frames, gzip[:0-9]"
+#ifdef LOG_MERGER_ZSTD
+      << " or zstd[:1-" << ZSTD_maxCLevel() << "]"
+#endif
+      << ", -c is ignored";
+  LOG << "  -d             - decompress gzip"
+#ifdef LOG_MERGER_ZSTD
+      << " and zstd"
+#endif
+      << " inputs (by magic bytes), rotated names like app<ext>.1.gz match too";
+  LOG << "  -i <index file> - digests and decoded sizes of previous run, unchanged files are not";
+  LOG << "                   hashed or decoded again, records of runs with other -d are not used";
+  LOG << "  -a             - append only, merge just files which are not in output yet, requires -i";
+  LOG << "  -s <KB>        - files up to KB are read once, hashed bytes are handed to writers,";
+  LOG << "                   0 disables it, default 64, at most 1024";
+  LOG << "  -r <seconds>   - progress line interval, off unless given, 0 disables it";
+  LOG << "  -M <path>      - Prometheus text metrics, written at the end and every -r seconds if given,";
+  LOG << "                   unix:<path> serves them on UNIX socket instead";
+  LOG << "  -F <ms>        - after merge keep appending new files and new lines of inputs until";
+  LOG << "                   SIGINT/SIGTERM, changes are batched for ms, not with -m, -l, -C, -z, -d";
+  LOG << "  -T <MB>        - files from MB on get xxh3 Merkle tree digest, their chunks are hashed";
+  LOG << "                   by all cores, not with -d, index made with other -T (or none) is not used";
+  LOG << "  -C <KB>        - drop content-defined chunks (average KB, cut at line ends) already written,";
+  LOG << "                   files are concatenated in path order, -c, -w, -m and -l are ignored";
+}
+
+// set from signal handler, ends follow mode
+static std::atomic<bool> g_stopFollow{false};
+
+static void stopFollowing(int)
+{
+  g_stopFollow = true;
+}
+
+static std::optional<CopyMode> parseCopyMode(std::string_view mode)
+{
+  if(mode == "stdio")
+    return CopyMode::Stdio;
+  if(mode == "kernel")
+    return CopyMode::Kernel;
+  if(mode == "pwrite")
+    return CopyMode::Pwrite;
+  if(mode == "uring")
+    return CopyMode::Uring;
+  if(mode == "direct")
+    return CopyMode::Direct;
+
+  return std::nullopt;
 }
 
 struct FileGuardDeleter
@@ -83,187 +212,131 @@ struct FileGuardDeleter
 
 using FileGuard = std::unique_ptr<std::FILE, FileGuardDeleter>;
 
-struct BioGuardDeleter
-{
-  void operator()(BIO *bio) const
-  {
-    BIO_free_all(bio);
-  }
-};
-
-using BIO_uptr = std::unique_ptr<BIO, BioGuardDeleter>;
-
-struct FnamesMemory
+struct FdGuard
 {
-  std::unique_ptr<char[]> memory {nullptr};
-  size_t count {0};
-
-  const size_t maxCount {0};
-  const size_t regionSize {0};
-
-  explicit operator bool() const { return memory != nullptr; }
-
-  char *data() const { return memory.get(); }
-  bool empty() const { return count == 0; }
-
-  bool append(std::string_view str)
-  {
-    if(count == maxCount)
-      return false;
-
-    char *ptr = data() + regionSize * count;
-    std::memset(ptr, 0x00, regionSize);
-    std::memcpy(ptr, str.data(), str.size());
-    ++count;
-
-    return true;
-  }
+  int fd {-1};
 
-  /*
-   * Requires valid idx
-   */
-  std::string_view get(size_t idx) const
+  explicit FdGuard(int desc) : fd{desc} {}
+  FdGuard(const FdGuard&) = delete;
+  ~FdGuard()
   {
-    assert(idx < count && "Buffer overflow");
-    return data() + idx * regionSize;
+    if(fd >= 0)
+      ::close(fd);
   }
 
-  /*
-   * Requirest non empty
-   */
-  std::string_view last() const
-  {
-    return data() + (count - 1) * regionSize;
-  }
+  explicit operator bool() const { return fd >= 0; }
 
-  /*
-   * Requires non empty
-   */
-  void pop_last()
+  int release()
   {
-    const size_t idx = (count - 1) * regionSize;
-    std::memset(data() + idx, 0x00, regionSize);
-    --count;
+    const int ret = fd;
+    fd = -1;
+    return ret;
   }
-
 };
 
-static FnamesMemory initFnamesMem(size_t count, size_t regionSize)
+/*
+ * Region of output file reserved for single input file
+ */
+struct OutputRange
 {
-  std::unique_ptr<char[]> data{ new(std::nothrow) char[count * regionSize] };
-  if(!data)
-    return FnamesMemory{};
-
-  return FnamesMemory{
-    .memory = std::move(data),
-    .count = 0,
-    .maxCount = count,
-    .regionSize = regionSize
-  };
-}
+  uint64_t offset {0};
+  uint64_t size {0};
+};
 
-static std::vector<uint8_t> hashFile(const std::string &path, const EVP_MD *evpMd)
+static std::vector<uint8_t> hashBuffer(const uint8_t *data, size_t size, const EVP_MD *evpMd)
 {
-  BIO_uptr bioRaw{ BIO_new_file(path.c_str(), "rb") };
-  if(!bioRaw)
+  uint8_t mdbuf[EVP_MAX_MD_SIZE];
+  unsigned mdlen = 0;
+  if(!EVP_Digest(data, size, mdbuf, &mdlen, evpMd, nullptr))
     return {};
 
-  // mdtmp will be freed with bio
-  BIO *mdtmp = BIO_new(BIO_f_md());
-  if(!mdtmp)
-    return {};
+  return std::vector<uint8_t>(std::begin(mdbuf), std::next(std::begin(mdbuf), mdlen));
+}
 
-  // WTF OpenSSL?
-  // Every EVP_<digest>() function returns const pointer, but
-  // BIO_set_md which supposed to consume this pointer takes.... non const!
-  // WTF OpenSSL?
-  BIO_set_md(mdtmp, const_cast<EVP_MD*>(evpMd));
-  BIO_uptr bio{ BIO_push(mdtmp, bioRaw.release()) };
-  if(!bio)
-    return {};
+/*
+ * Bytes a writer put into output, ok is false when file couldn't be opened
+ * or its copy stopped early
+ */
+struct CopyResult
+{
+  uint64_t written {0};
+  bool ok {false};
+};
 
-  {
-    char buf[10240];
-    int rdlen;
-    do {
-      char *bufFirstPos = buf;
-      rdlen = BIO_read(bio.get(), bufFirstPos, sizeof(buf));
-    } while (rdlen > 0);
-  }
+/*
+ * Unique file on its way to writers, path itself stays in arena.
+ * Small files come with bytes hasher already read, writer releases them.
+ */
+struct WriteItem
+{
+  PathHandle path {PathArena::INVALID_HANDLE};
+  OutputRange range;
+  Chunk *content {nullptr};
+};
 
-  uint8_t mdbuf[EVP_MAX_MD_SIZE];
-  const int mdlen = BIO_gets(mdtmp, reinterpret_cast<char*>(mdbuf), EVP_MAX_MD_SIZE);
+using WriteQueue = MpmcQueue<WriteItem>;
 
-  return std::vector<uint8_t>(std::begin(mdbuf), std::next(std::begin(mdbuf), mdlen));
-}
+/*
+ * Single path, or count paths of a batch of small files
+ */
+struct HashItem
+{
+  PathHandle path {PathArena::INVALID_HANDLE};
+  const PathHandle *batch {nullptr};
+  uint32_t count {0};
+};
 
-struct FileHash
+class FileHashThreadPool final
 {
-  std::vector<uint8_t> hash;
+  static constexpr size_t QUEUE_SIZE = 64 * 1024;
+  static constexpr size_t POP_BATCH = 16;
 
-  FileHash(std::vector<uint8_t> &&other) noexcept
-    : hash{std::move(other)}
-  {}
+  // size aware scheduling, files below it go in batches of up to SMALL_BATCH_FILES
+  // or SMALL_BATCH_BYTES, whichever comes first
+  static constexpr uint64_t SMALL_FILE_SIZE = 64 * KB;
+  static constexpr size_t SMALL_BATCH_FILES = 64;
+  static constexpr uint64_t SMALL_BATCH_BYTES = 1 * MB;
 
-  FileHash() = default;
+  // state for output file names
+  WriteQueue &m_writeQueue;
 
-  FileHash(const FileHash &other) noexcept
-    : hash{other.hash}
-  {}
+  // end of output reserved so far, only when writers use ranges
+  std::atomic<uint64_t> *m_outputOffset {nullptr};
 
-  FileHash(FileHash &&other) noexcept
-    : hash{std::move(other.hash)}
-  {}
+  // couldn't be hashed or sized, never reach digest set
+  std::atomic<uint64_t> m_unreadable{0};
 
-  bool operator==(const FileHash &other) const { return hash == other.hash; }
-  bool operator!=(const FileHash &other) const { return !(*this == other); }
+  // digests from previous run
+  HashIndex *m_index {nullptr};
+  std::atomic<uint64_t> m_indexHits{0};
 
-  FileHash& operator=(std::vector<uint8_t> bt)
-  {
-    hash = std::move(bt);
-    return *this;
-  }
+  // compressed inputs are hashed and sized by decoded content
+  bool m_decode {false};
 
-  FileHash& operator=(FileHash other) noexcept
-  {
-    swap(*this, other);
-    return *this;
-  }
+  // large files are hashed through mmap
+  MappedHashStats m_mappedStats;
 
-  friend void swap(FileHash &lhs, FileHash &rhs) noexcept
-  {
-    using std::swap;
-    swap(lhs.hash, rhs.hash);
-  }
-};
+  // or, from its threshold on, in chunks by every tree hasher thread
+  TreeHasher *m_treeHasher {nullptr};
 
-struct HashFileHash
-{
-  std::uint64_t operator()(const FileHash &filehash) const
-  {
-    return xxh::xxhash<64>(filehash.hash);
-  }
-};
+  // small files are read once, bytes go to writers along with path
+  ChunkPool *m_readOnce {nullptr};
+  std::atomic<uint64_t> m_readOnceFiles{0};
 
-using FileHashCache = std::unordered_set<FileHash, HashFileHash>;
+  // follow mode needs to know how much of duplicates is merged already
+  FileOffsets *m_offsets {nullptr};
 
-class FileHashThreadPool final
-{
-  // state for output file names
-  FnamesMemory &m_outBuff;
-  std::mutex &m_outBuffMutex;
-  std::condition_variable &m_signalFileAdded;
-  std::atomic_bool &m_pathTraversalFinished;
+  Metrics &m_metrics;
 
-  // state for hash caching
-  FileHashCache m_hashCache;
-  std::mutex m_hashCacheMutex;
+  // digests of files accepted so far
+  DigestSet m_digests;
 
   // state for threading
   thread_count_t m_threadCount{0};
-  std::queue <std::string> m_filePaths = {};
-  std::mutex m_filePathsMutex = {};
-  std::condition_variable m_pathAvailable = {};
+  PathArena &m_paths;
+  MpmcQueue<HashItem> m_queue{QUEUE_SIZE};
+  // batches live until pool is gone, deque keeps them in place while it grows
+  std::deque<std::vector<PathHandle>> m_batches;
   std::atomic_bool m_running{false};
   std::unique_ptr<std::jthread[]> m_threads = nullptr;
 
@@ -272,8 +345,8 @@ public:
   FileHashThreadPool(const FileHashThreadPool&) = delete;
   FileHashThreadPool(FileHashThreadPool&&) = delete;
 
-  FileHashThreadPool(FnamesMemory &outbuff, std::mutex &outbuffMutex, std::condition_variable &signalFileAdded, std::atomic_bool &pathTraversalFinished)
-    : m_outBuff{outbuff}, m_outBuffMutex{outbuffMutex}, m_signalFileAdded{signalFileAdded}, m_pathTraversalFinished{pathTraversalFinished}
+  FileHashThreadPool(PathArena &paths, WriteQueue &writeQueue, Metrics &metrics)
+    : m_writeQueue{writeQueue}, m_metrics{metrics}, m_paths{paths}
   {}
 
   ~FileHashThreadPool()
@@ -281,18 +354,62 @@ public:
     stop();
   }
 
-  bool reserve(size_t count)
+  /*
+   * Every accepted file gets its own region of output file
+   * starting at offset->fetch_add(file size)
+   */
+  void reserveOutputRanges(std::atomic<uint64_t> &offset)
   {
-    try{
-      m_hashCache.reserve(count);
-    }catch(const std::bad_alloc&)
-    {
-      return false;
-    }
+    m_outputOffset = &offset;
+  }
 
-    return true;
+  void useIndex(HashIndex &index)
+  {
+    m_index = &index;
+  }
+
+  uint64_t indexHits() const { return m_indexHits; }
+  uint64_t unreadable() const { return m_unreadable; }
+  const MappedHashStats &mappedStats() const { return m_mappedStats; }
+
+  /*
+   * Files from tree hasher's threshold on get its digest instead of BLAKE2b,
+   * it depends on size only, so same content always gets same kind of digest
+   */
+  void treeHash(TreeHasher &treeHasher)
+  {
+    m_treeHasher = &treeHasher;
+  }
+
+  void decodeInputs()
+  {
+    m_decode = true;
+  }
+
+  /*
+   * Files fitting a chunk are hashed from it and the chunk is handed to writers,
+   * when pool is drained files are read twice as usual
+   */
+  void readOnce(ChunkPool &pool)
+  {
+    m_readOnce = &pool;
+  }
+
+  uint64_t readOnceFiles() const { return m_readOnceFiles; }
+
+  void trackOffsets(FileOffsets &offsets)
+  {
+    m_offsets = &offsets;
+  }
+
+  bool reserve(size_t count)
+  {
+    return m_digests.reserve(count);
   }
 
+  size_t digestCount() { return m_digests.size(); }
+  size_t digestBytes() { return m_digests.bytes(); }
+
   void start(thread_count_t threadCount = 3)
   {
     stop();
@@ -304,7 +421,7 @@ public:
     if(m_running)
     {
       m_running = false;
-      m_pathAvailable.notify_all();
+      m_queue.close();
       joinThreads();
     }
   }
@@ -323,60 +440,324 @@ public:
   }
 
 
-  void schedule(std::string filepath)
+  void schedule(std::string_view filepath)
+  {
+    const PathHandle handle = m_paths.append(filepath);
+    if(handle == PathArena::INVALID_HANDLE)
+    {
+      LOG << "  Path too long or path memory exhausted, omitting " << filepath;
+      return;
+    }
+
+    m_queue.push(HashItem{ .path = handle });
+  }
+
+  /*
+   * Largest files first, so the longest jobs don't start last and keep one
+   * worker busy after others are done (LPT). Small files left at the end go
+   * in batches, one queue operation per batch instead of per file.
+   * Returns number of batches.
+   */
+  size_t scheduleLargestFirst(std::vector<DedupCandidate> &candidates)
+  {
+    std::sort(candidates.begin(), candidates.end(), [](const auto &lhs, const auto &rhs) { return lhs.size > rhs.size; });
+
+    const size_t batchesBefore = m_batches.size();
+    std::vector<PathHandle> batch;
+    uint64_t batchBytes = 0;
+    const auto flush = [&] {
+      if(batch.empty())
+        return;
+      const auto &stored = m_batches.emplace_back(std::move(batch));
+      m_queue.push(HashItem{ .batch = stored.data(), .count = static_cast<uint32_t>(stored.size()) });
+      batch = {};
+      batchBytes = 0;
+    };
+
+    for(const DedupCandidate &candidate : candidates)
+    {
+      const PathHandle handle = m_paths.append(candidate.path);
+      if(handle == PathArena::INVALID_HANDLE)
+      {
+        LOG << "  Path too long or path memory exhausted, omitting " << candidate.path;
+        continue;
+      }
+
+      if(candidate.size >= SMALL_FILE_SIZE)
+      {
+        m_queue.push(HashItem{ .path = handle });
+        continue;
+      }
+
+      batch.push_back(handle);
+      batchBytes += candidate.size;
+      if(batch.size() == SMALL_BATCH_FILES || batchBytes >= SMALL_BATCH_BYTES)
+        flush();
+    }
+    flush();
+
+    return m_batches.size() - batchesBefore;
+  }
+
+  /*
+   * Nothing more will be scheduled, workers leave once queue is drained
+   */
+  void closeInput()
+  {
+    m_queue.close();
+  }
+
+  /*
+   * Path already in arena
+   */
+  void schedule(PathHandle handle)
+  {
+    m_queue.push(HashItem{ .path = handle });
+  }
+
+  QueueStats queueStats() const { return m_queue.stats(); }
+  size_t queueDepth() const { return m_queue.depth(); }
+
+  /*
+   * Hands file already known to be unique over to writers,
+   * contentSize saves stat (or decoding) when caller knows it already
+   */
+  void acceptUnique(PathHandle path, std::optional<uint64_t> contentSize = std::nullopt, Chunk *content = nullptr)
+  {
+    const std::string_view file = m_paths.get(path);
+    OutputRange range;
+    if(m_outputOffset)
+    {
+      uint64_t size = 0;
+      if(contentSize)
+      {
+        size = *contentSize;
+      }
+      else if(!InputReader::contentSize(file.data(), m_decode, size))
+      {
+        LOG << "  Can't stat " << file;
+        if(content)
+          m_readOnce->release(content);
+        return;
+      }
+
+      range.size = size;
+      range.offset = m_outputOffset->fetch_add(range.size);
+    }
+
+    m_metrics.add(Metric::FilesUnique);
+    m_writeQueue.push(WriteItem{ .path = path, .range = range, .content = content });
+  }
+
+  void acceptUnique(std::string_view file)
   {
+    const PathHandle handle = m_paths.append(file);
+    if(handle == PathArena::INVALID_HANDLE)
     {
-      std::lock_guard lock(m_filePathsMutex);
-      m_filePaths.push(std::move(filepath));
+      LOG << "  Path too long or path memory exhausted, omitting " << file;
+      return;
     }
-    m_pathAvailable.notify_one();
+
+    acceptUnique(handle);
+  }
+
+  bool insertUnique(const std::vector<uint8_t> &digest)
+  {
+    return m_digests.insert(digest);
   }
 
-  void notify()
+  bool insertUnique(const uint8_t *digest, size_t len)
   {
-    m_pathAvailable.notify_all();
+    return m_digests.insert(digest, len);
   }
 
 private:
   void fileHashWorker()
   {
     const auto start = NOW();
+    Metrics::Counters &counters = m_metrics.local();
+    HashItem batch[POP_BATCH];
     while(m_running)
     {
-      std::unique_lock lock(m_filePathsMutex);
-      m_pathAvailable.wait(lock, [this] { return !m_filePaths.empty() || !m_running || m_pathTraversalFinished; });
-      
-      if(m_pathTraversalFinished && m_filePaths.empty())
+      const auto waitStart = NOW();
+      const size_t count = m_queue.popBatch(batch, POP_BATCH);
+      counters.add(Metric::HashWaitNs, elapsedNs(waitStart));
+      if(count == 0)
         break;
 
-      if(m_running)
+      for(size_t i = 0; i < count && m_running; ++i)
       {
-        const auto file = std::move(m_filePaths.front());
-        m_filePaths.pop();
-        lock.unlock();
-
-        auto fileHash = hashFile(file, EVP_blake2b512());
-//        LOG << "  " << file << ' ' << bin2Hex(fileHash);
-
-        bool inserted = false;
+        if(!batch[i].batch)
         {
-          std::lock_guard lock(m_hashCacheMutex);
-          const auto [iter, ins] = m_hashCache.insert(std::move(fileHash));
-          inserted = ins;
+          hashOne(batch[i].path, counters);
+          continue;
         }
 
-        if(inserted)
+        for(uint32_t j = 0; j < batch[i].count && m_running; ++j)
+          hashOne(batch[i].batch[j], counters);
+      }
+    }
+    LOG << "Hash worker finished " << DURATION_S(start).count() << "s"; //std::this_thread::get_id()
+  }
+
+  void hashOne(PathHandle path, Metrics::Counters &counters)
+  {
+    const auto hashStart = NOW();
+    const std::string file{ m_paths.get(path) };
+    std::optional<uint64_t> contentSize;
+    Chunk *content = nullptr;
+    auto fileHash = m_index ? indexedHash(file, contentSize, content) : digest(file, contentSize, content);
+//    LOG << "  " << file << ' ' << bin2Hex(fileHash);
+    counters.add(Metric::HashNs, elapsedNs(hashStart));
+    counters.add(Metric::FilesHashed);
+
+    // size of output range has to be known before digest is taken, a file
+    // which can't be sized after insert would block its duplicates for nothing
+    if(fileHash.empty() || (m_outputOffset && !contentSize))
+    {
+      LOG << "  Can't read " << file;
+      ++m_unreadable;
+      if(content)
+        m_readOnce->release(content);
+      return;
+    }
+
+    if(insertUnique(fileHash))
+    {
+      acceptUnique(path, contentSize, content);
+    }
+    else
+    {
+      counters.add(Metric::FilesDuplicate);
+      if(content)
+        m_readOnce->release(content);
+      if(m_offsets)
+      {
+        uint64_t size = 0;
+        if(contentSize || InputReader::contentSize(file.c_str(), false, size))
+          m_offsets->record(file, contentSize ? *contentSize : size);
+      }
+    }
+  }
+
+  /*
+   * content gets bytes of small file when there's a free chunk for them
+   */
+  std::vector<uint8_t> digest(const std::string &file, std::optional<uint64_t> &contentSize, Chunk *&content)
+  {
+    // below that plain reads are as good and mapping costs more than it saves
+    static constexpr uint64_t MAPPED_HASH_MIN_SIZE = 4 * MB;
+
+    // every way of hashing below works on this descriptor, file is opened once
+    FdGuard fd{ ::open(file.c_str(), O_RDONLY | O_CLOEXEC) };
+    struct stat st;
+    if(!fd || ::fstat(fd.fd, &st) != 0)
+      return {};
+
+    const bool plain = !m_decode || sniffFormat(fd.fd) == InputFormat::Plain;
+    if(plain && m_treeHasher && static_cast<uint64_t>(st.st_size) >= m_treeHasher->minSize())
+    {
+      // no BLAKE2b fallback, same content must always get the same kind of digest
+      const auto size = static_cast<uint64_t>(st.st_size);
+      auto ret = m_treeHasher->hash(fd.fd, size);
+      if(!ret)
+        return {};
+
+      m_metrics.add(Metric::BytesHashed, size);
+      contentSize = size;
+      return std::move(*ret);
+    }
+
+    // read once attempt moves file position
+    bool rewind = false;
+    if(plain && m_readOnce && static_cast<uint64_t>(st.st_size) <= m_readOnce->chunkSize())
+    {
+      if(Chunk *chunk = m_readOnce->tryAcquire(0))
+      {
+        if(readWhole(fd.fd, *chunk))
         {
-          {
-            std::lock_guard lock(m_outBuffMutex);
-            m_outBuff.append(file);
-          }
-          LOG << "  Added unique " << file;
-          m_signalFileAdded.notify_one();
+          ++m_readOnceFiles;
+          m_metrics.add(Metric::BytesHashed, chunk->size);
+          contentSize = chunk->size;
+          content = chunk;
+          return hashBuffer(chunk->data, chunk->size, EVP_blake2b512());
         }
+        m_readOnce->release(chunk);
+        rewind = true;
+      }
+    }
+
+    if(plain && static_cast<uint64_t>(st.st_size) >= MAPPED_HASH_MIN_SIZE)
+    {
+      const auto size = static_cast<uint64_t>(st.st_size);
+      if(auto ret = hashMapped(fd.fd, size, EVP_blake2b512(), m_mappedStats))
+      {
+        m_metrics.add(Metric::BytesHashed, size);
+        contentSize = size;
+        return std::move(*ret);
+      }
+    }
+
+    if(rewind && ::lseek(fd.fd, 0, SEEK_SET) != 0)
+      return {};
+
+    InputReader input;
+    if(!input.adopt(fd.release(), m_decode))
+      return {};
+
+    uint64_t size = 0;
+    auto ret = hashInput(input, EVP_blake2b512(), size);
+    m_metrics.add(Metric::BytesHashed, size);
+    if(!ret.empty())
+      contentSize = size;
+    return ret;
+  }
+
+  std::vector<uint8_t> indexedHash(const std::string &file, std::optional<uint64_t> &contentSize, Chunk *&content)
+  {
+    struct stat st;
+    if(::stat(file.c_str(), &st) != 0)
+      return digest(file, contentSize, content);
+
+    // decoded size comes from index as well, compressed file isn't decoded just to size its range
+    if(const IndexRecord *rec = m_index->find(st))
+    {
+      ++m_indexHits;
+      m_index->record(st, rec->digest, rec->digestLen, rec->contentSize);
+      contentSize = rec->contentSize;
+      return std::vector<uint8_t>(rec->digest, rec->digest + rec->digestLen);
+    }
+
+    auto ret = digest(file, contentSize, content);
+    if(!ret.empty() && contentSize)
+      m_index->record(st, ret.data(), ret.size(), *contentSize);
+
+    return ret;
+  }
+
+  /*
+   * Whole file into chunk, false when it doesn't fit (file grew since fstat) or on read error
+   */
+  bool readWhole(int fd, Chunk &chunk) const
+  {
+    const size_t capacity = m_readOnce->chunkSize();
+    while(true)
+    {
+      const ssize_t got = ::read(fd, chunk.data + chunk.size, capacity - chunk.size);
+      if(got < 0 && errno == EINTR)
+        continue;
+      if(got < 0)
+        return false;
+      if(got == 0)
+        return true;
+
+      chunk.size += static_cast<size_t>(got);
+      if(chunk.size == capacity)
+      {
+        uint8_t probe;
+        return ::read(fd, &probe, 1) == 0;
       }
     }
-    LOG << "Hash worker finished " << DURATION_S(start).count() << "s"; //std::this_thread::get_id()
   }
 
   std::string bin2Hex(const std::vector<uint8_t> &buff)
@@ -406,29 +787,37 @@ class FileWriteThreadPool
   // state for writing
   std::mutex m_fileMutex;
   std::FILE &m_outputFile;
-
-  // state for input buffer
-  FnamesMemory &m_fnamesArray;
-  std::mutex &m_fnamesMutex;
-  std::condition_variable &m_fnamesSignal;
-  std::atomic_bool &m_finishedHashing;
+  const CopyMode m_copyMode;
+  KernelCopyStats m_kernelStats;
+  std::atomic<uint64_t> m_shortRanges{0};
+  bool m_decode {false};
+  ChunkPool *m_readOnce {nullptr};
+  FileOffsets *m_offsets {nullptr};
+  Metrics &m_metrics;
+
+  // direct mode, output stream and aligned read buffers, one per writer
+  DirectOutput *m_direct {nullptr};
+  ChunkPool *m_directReads {nullptr};
+  DirectIoStats *m_directStats {nullptr};
+
+  // paths arrive as arena handles, arena is append only and its chunks never move,
+  // bytes behind a handle are written before handle is queued so get() needs no lock
+  const PathArena &m_paths;
+  WriteQueue &m_queue;
 
   // state for threading
   thread_count_t m_threadCount{0};
-  std::queue <std::string> m_filePaths = {};
-  std::mutex m_filePathsMutex = {};
-  std::condition_variable m_pathAvailable = {};
   std::atomic_bool m_running{false};
   std::unique_ptr<std::jthread[]> m_threads = nullptr;
 
 
 public:
-  FileWriteThreadPool(std::FILE &outputFile, FnamesMemory &fnamesArray, std::mutex &fnamesMutex, std::condition_variable &fnamesSignal, std::atomic_bool &finishedHashing)
+  FileWriteThreadPool(std::FILE &outputFile, CopyMode copyMode, const PathArena &paths, WriteQueue &queue, Metrics &metrics)
     : m_outputFile{outputFile},
-      m_fnamesArray{fnamesArray},
-      m_fnamesMutex{fnamesMutex},
-      m_fnamesSignal{fnamesSignal},
-      m_finishedHashing{finishedHashing}
+      m_copyMode{copyMode},
+      m_metrics{metrics},
+      m_paths{paths},
+      m_queue{queue}
   {}
 
   void start(thread_count_t threadCount = 2)
@@ -437,12 +826,46 @@ public:
     createThreads(threadCount);
   }
 
+  /*
+   * Pool chunks of items which carry content go back to
+   */
+  void readOnce(ChunkPool &pool)
+  {
+    m_readOnce = &pool;
+  }
+
+  /*
+   * Compressed inputs are written decoded, they always take user space path
+   */
+  void decodeInputs()
+  {
+    m_decode = true;
+  }
+
+  /*
+   * Files are read with O_DIRECT into buffers from readBuffers and appended to output
+   */
+  void directIo(DirectOutput &output, ChunkPool &readBuffers, DirectIoStats &stats)
+  {
+    m_direct = &output;
+    m_directReads = &readBuffers;
+    m_directStats = &stats;
+  }
+
+  /*
+   * Bytes copied of every file are recorded, follow mode goes on from there
+   */
+  void trackOffsets(FileOffsets &offsets)
+  {
+    m_offsets = &offsets;
+  }
+
   void stop()
   {
     if(m_running)
     {
       m_running = false;
-      m_pathAvailable.notify_all();
+      m_queue.close();
       joinThreads();
     }
   }
@@ -460,40 +883,285 @@ public:
     m_threadCount = 0;
   }
 
-private:
-
-  void worker()
+  void logStats() const
   {
-    const auto start = NOW();
+    if(m_copyMode == CopyMode::Pwrite && m_shortRanges)
+      LOG << "Files shrunk after reserving output range " << m_shortRanges.load() << ", gaps are zero filled";
 
-    while(m_running)
+    if(m_direct)
     {
-      std::unique_lock lock(m_fnamesMutex);
-      m_fnamesSignal.wait(lock, [&] { return !m_fnamesArray.empty() || !m_running || m_finishedHashing; });
-
-      if(!m_running || (m_fnamesArray.empty() && m_finishedHashing))
-        break;
+      LOG << "Direct I/O wrote " << m_directStats->bytesWritten.load() << " bytes in " << m_directStats->writes.load()
+          << " writes, inputs read direct " << m_directStats->directReads.load() << ", buffered "
+          << m_directStats->bufferedReads.load() << ", output stalls " << m_directStats->outputStalls.load();
+      return;
+    }
 
-      const std::string fileName{ m_fnamesArray.last() };
-      m_fnamesArray.pop_last();
+    if(m_copyMode != CopyMode::Kernel)
+      return;
 
-      lock.unlock();
+    LOG << "Kernel copy moved " << m_kernelStats.bytes.load() << " bytes in "
+        << m_kernelStats.syscalls.load() << " syscalls, "
+        << m_kernelStats.bytesPerSyscall() << " bytes per syscall";
+    LOG << "  sendfile fallbacks " << m_kernelStats.sendfileFallbacks.load()
+        << ", stdio fallbacks " << m_kernelStats.userspaceFallbacks.load();
+  }
 
-      std::FILE *inFile = std::fopen(fileName.c_str(), "rb");
-      if(inFile)
-      {
-        FileGuard guard{inFile};
-        uint8_t buffer[BUFSIZ];
+private:
 
-        std::lock_guard lock(m_fileMutex);
-        const auto start = NOW();
-        while(const size_t bytesRead = std::fread(buffer, 1, BUFSIZ, inFile))
-          std::fwrite(buffer, 1, bytesRead, &m_outputFile);
+  /*
+   * No locking here, every file owns its region of output
+   */
+  CopyResult writeRange(const std::string &fileName, OutputRange range, uint8_t *buffer, size_t bufferSize)
+  {
+    InputReader input;
+    if(!input.open(fileName.c_str(), m_decode))
+    {
+      LOG << "  Can't open file " << fileName;
+      ++m_shortRanges;
+      return {};
+    }
 
-        LOG << "  File read/write " << DURATION_MS(start).count() << "ms";
+    const int outFd = fileno(&m_outputFile);
+    if(range.size)
+    {
+      // extent allocation for disjoint regions can go in parallel too,
+      // not every filesystem supports it and it's only an optimization
+      ::posix_fallocate(outFd, static_cast<off_t>(range.offset), static_cast<off_t>(range.size));
+    }
+
+    uint64_t written = 0;
+    while(written < range.size)
+    {
+      const size_t toRead = static_cast<size_t>(std::min<uint64_t>(bufferSize, range.size - written));
+      const ssize_t bytesRead = input.read(buffer, toRead);
+      if(bytesRead <= 0)
+        break;
+
+      size_t pos = 0;
+      while(pos < static_cast<size_t>(bytesRead))
+      {
+        const ssize_t ret = ::pwrite(outFd, buffer + pos, static_cast<size_t>(bytesRead) - pos, static_cast<off_t>(range.offset + written + pos));
+        if(ret < 0 && errno == EINTR)
+          continue;
+        if(ret <= 0)
+        {
+          LOG << "  Write error " << std::strerror(errno) << " for " << fileName;
+          ++m_shortRanges;
+          return { .written = written + pos };
+        }
+        pos += static_cast<size_t>(ret);
       }
+
+      written += static_cast<uint64_t>(bytesRead);
     }
 
+    if(written != range.size)
+      ++m_shortRanges;
+    return { .written = written, .ok = written == range.size };
+  }
+
+  /*
+   * Bytes hasher already read, nothing to open
+   */
+  CopyResult writeContent(const std::string &fileName, const WriteItem &item, Metrics::Counters &counters)
+  {
+    const Chunk &chunk = *item.content;
+    uint64_t written = 0;
+    if(m_copyMode == CopyMode::Pwrite)
+    {
+      const int outFd = fileno(&m_outputFile);
+      while(written < chunk.size)
+      {
+        const ssize_t ret = ::pwrite(outFd, chunk.data + written, chunk.size - written, static_cast<off_t>(item.range.offset + written));
+        if(ret < 0 && errno == EINTR)
+          continue;
+        if(ret <= 0)
+        {
+          LOG << "  Write error " << std::strerror(errno) << " for " << fileName;
+          ++m_shortRanges;
+          break;
+        }
+        written += static_cast<uint64_t>(ret);
+      }
+    }
+    else
+    {
+      const auto lockStart = NOW();
+      std::lock_guard lock(m_fileMutex);
+      counters.add(Metric::WriteLockWaitNs, elapsedNs(lockStart));
+      if(m_direct)
+      {
+        m_direct->append(chunk.data, chunk.size);
+        written = chunk.size;
+      }
+      else
+      {
+        written = std::fwrite(chunk.data, 1, chunk.size, &m_outputFile);
+      }
+    }
+
+    m_readOnce->release(item.content);
+    return { .written = written, .ok = written == chunk.size };
+  }
+
+  CopyResult copyFile(const std::string &fileName, OutputRange range, uint8_t *rangeBuffer, size_t rangeBufferSize, Metrics::Counters &counters)
+  {
+    if(m_copyMode == CopyMode::Pwrite)
+      return writeRange(fileName, range, rangeBuffer, rangeBufferSize);
+    if(m_direct)
+      return copyDirect(fileName, rangeBuffer, rangeBufferSize, counters);
+
+    std::FILE *inFile = std::fopen(fileName.c_str(), "rb");
+    if(!inFile)
+    {
+      LOG << "  Can't open file " << fileName;
+      return {};
+    }
+
+    FileGuard guard{inFile};
+    if(m_decode && sniffFormat(fileno(inFile)) != InputFormat::Plain)
+      return copyDecoded(fileName, counters);
+
+    uint8_t buffer[BUFSIZ];
+
+    const auto lockStart = NOW();
+    std::lock_guard lock(m_fileMutex);
+    counters.add(Metric::WriteLockWaitNs, elapsedNs(lockStart));
+
+    if(m_copyMode == CopyMode::Kernel)
+    {
+      // kernel writes straight to fd, so anything stdio still holds has to go first
+      std::fflush(&m_outputFile);
+      // copies are serialized by the lock, so the difference is this file
+      const uint64_t before = m_kernelStats.bytes;
+      if(kernelCopy(fileno(inFile), fileno(&m_outputFile), m_kernelStats))
+        return { .written = m_kernelStats.bytes - before, .ok = true };
+    }
+
+    uint64_t written = 0;
+    bool ok = true;
+    while(const size_t bytesRead = std::fread(buffer, 1, BUFSIZ, inFile))
+    {
+      const size_t ret = std::fwrite(buffer, 1, bytesRead, &m_outputFile);
+      written += ret;
+      ok = ok && ret == bytesRead;
+    }
+
+    return { .written = written, .ok = ok && !std::ferror(inFile) };
+  }
+
+  /*
+   * buffer is aligned, output thread writes previous chunk while this one is read.
+   * First buffer is read before taking the lock, files which fit in it never read under it.
+   */
+  CopyResult copyDirect(const std::string &fileName, uint8_t *buffer, size_t bufferSize, Metrics::Counters &counters)
+  {
+    DirectInput input;
+    if(!input.open(fileName.c_str()))
+    {
+      LOG << "  Can't open file " << fileName;
+      return {};
+    }
+
+    // short read before end of file continues, DirectInput falls back to buffered reads for the rest
+    size_t filled = 0;
+    ssize_t got = 1;
+    while(filled < bufferSize && !(filled && input.atEnd()) && (got = input.read(buffer + filled, bufferSize - filled)) > 0)
+      filled += static_cast<size_t>(got);
+
+    const auto lockStart = NOW();
+    std::lock_guard lock(m_fileMutex);
+    counters.add(Metric::WriteLockWaitNs, elapsedNs(lockStart));
+
+    m_direct->append(buffer, filled);
+    uint64_t written = filled;
+    while(got > 0 && !input.atEnd())
+    {
+      got = input.read(buffer, bufferSize);
+      if(got <= 0)
+        break;
+
+      m_direct->append(buffer, static_cast<size_t>(got));
+      written += static_cast<uint64_t>(got);
+    }
+
+    ++(input.direct() ? m_directStats->directReads : m_directStats->bufferedReads);
+    return { .written = written, .ok = got >= 0 };
+  }
+
+  CopyResult copyDecoded(const std::string &fileName, Metrics::Counters &counters)
+  {
+    InputReader input;
+    if(!input.open(fileName.c_str(), true))
+    {
+      LOG << "  Can't decode file " << fileName;
+      return {};
+    }
+
+    // decoding is the slow part, first chunk is decoded before taking the lock
+    static constexpr size_t DECODE_BUFF_SIZE = 1 * MB;
+    std::unique_ptr<uint8_t[]> buffer{ new uint8_t[DECODE_BUFF_SIZE] };
+    size_t filled = 0;
+    ssize_t got = 1;
+    while(filled < DECODE_BUFF_SIZE && (got = input.read(buffer.get() + filled, DECODE_BUFF_SIZE - filled)) > 0)
+      filled += static_cast<size_t>(got);
+
+    const auto lockStart = NOW();
+    std::lock_guard lock(m_fileMutex);
+    counters.add(Metric::WriteLockWaitNs, elapsedNs(lockStart));
+
+    uint64_t written = std::fwrite(buffer.get(), 1, filled, &m_outputFile);
+    while(got > 0 && (got = input.read(buffer.get(), DECODE_BUFF_SIZE)) > 0)
+      written += std::fwrite(buffer.get(), 1, static_cast<size_t>(got), &m_outputFile);
+
+    if(got < 0)
+      LOG << "  Decode error in " << fileName;
+    return { .written = written, .ok = got == 0 };
+  }
+
+  void worker()
+  {
+    const auto start = NOW();
+
+    static constexpr size_t RANGE_BUFF_SIZE = 1 * MB;
+    std::unique_ptr<uint8_t[]> rangeBuffer;
+    if(m_copyMode == CopyMode::Pwrite)
+      rangeBuffer.reset(new uint8_t[RANGE_BUFF_SIZE]);
+
+    // direct reads go to aligned pool chunk instead
+    Chunk *directBuffer = m_directReads ? m_directReads->acquire(0) : nullptr;
+
+    Metrics::Counters &counters = m_metrics.local();
+    static constexpr size_t POP_BATCH = 16;
+    WriteItem batch[POP_BATCH];
+    while(m_running)
+    {
+      const auto waitStart = NOW();
+      const size_t count = m_queue.popBatch(batch, POP_BATCH);
+      counters.add(Metric::WriteWaitNs, elapsedNs(waitStart));
+      if(count == 0)
+        break;
+
+      for(size_t i = 0; i < count && m_running; ++i)
+      {
+        const auto writeStart = NOW();
+        const std::string fileName{ m_paths.get(batch[i].path) };
+        const CopyResult result = batch[i].content
+          ? writeContent(fileName, batch[i], counters)
+          : directBuffer
+            ? copyFile(fileName, batch[i].range, directBuffer->data, m_directReads->chunkSize(), counters)
+            : copyFile(fileName, batch[i].range, rangeBuffer.get(), RANGE_BUFF_SIZE, counters);
+        if(m_offsets)
+          m_offsets->record(fileName, result.written);
+        counters.add(Metric::WriteNs, elapsedNs(writeStart));
+        if(result.ok)
+          counters.add(Metric::FilesWritten);
+        counters.add(Metric::BytesWritten, result.written);
+      }
+    }
+
+    if(directBuffer)
+      m_directReads->release(directBuffer);
     LOG << "Write worker finised " << DURATION_S(start).count() << "s";
   }
 
@@ -510,59 +1178,802 @@ private:
 
 };
 
+/*
+ * Every file is read once into registered buffers, hashed straight from them
+ * and if unique, the same buffers are written to its reserved output range.
+ *
+ * File larger than a slot is streamed through several of them. Files which
+ * would take more than half of the slots, tree hashed or compressed ones are
+ * handed over to the regular hasher. Hashing runs on the ring thread.
+ */
+class UringPipeline final
+{
+  static constexpr size_t SLOT_SIZE = 1 * MB;
+  static constexpr uint64_t WRITE_FLAG = static_cast<uint64_t>(1) << 63;
+
+  /*
+   * File in flight, kept under index of its first slot. Its bytes fill
+   * slots in order, one read or write of it is submitted at a time.
+   */
+  struct Job
+  {
+    PathHandle path {PathArena::INVALID_HANDLE};
+    int fd {-1};
+    uint64_t size {0};
+    uint64_t done {0};
+    uint64_t outOffset {0};
+    struct stat st {};
+    bool digestKnown {false};
+    bool writing {false};
+    std::vector<unsigned> slots;
+  };
+
+  IoUring m_ring;
+  FileHashThreadPool &m_hasher;
+  const int m_outFd;
+  std::atomic<uint64_t> &m_outputOffset;
+  HashIndex *m_index {nullptr};
+  bool m_decode {false};
+  uint64_t m_treeHashMin {0};
+  Metrics &m_metrics;
+
+  unsigned m_depth {0};
+  unsigned m_maxFileSlots {1};
+  std::unique_ptr<uint8_t[]> m_buffers;
+  std::unique_ptr<Job[]> m_jobs;
+  std::vector<unsigned> m_freeSlots;
+  unsigned m_jobCount {0};
+
+  // opened file waiting for enough free slots, it goes before anything new
+  Job m_waiting;
+  // jobs whose next read or write found submission queue full
+  std::vector<unsigned> m_deferred;
+  // reads and writes prepared or submitted and not completed yet
+  unsigned m_pending {0};
+
+  // stats
+  uint64_t m_filesRead {0};
+  uint64_t m_filesWritten {0};
+  uint64_t m_bytesWritten {0};
+  uint64_t m_forwarded {0};
+  uint64_t m_indexHits {0};
+
+  // state for threading
+  PathArena &m_paths;
+  MpmcQueue<PathHandle> m_queue{64 * 1024};
+  std::jthread m_thread;
+
+public:
+  UringPipeline(PathArena &paths, FileHashThreadPool &hasher, int outFd, std::atomic<uint64_t> &outputOffset, Metrics &metrics)
+    : m_hasher{hasher}, m_outFd{outFd}, m_outputOffset{outputOffset}, m_metrics{metrics}, m_paths{paths}
+  {}
+
+  /*
+   * Returns 0 or errno
+   */
+  int init(unsigned depth)
+  {
+    if(const int err = m_ring.init(depth))
+      return err;
+
+    m_depth = depth;
+    m_maxFileSlots = std::max(1u, depth / 2);
+    m_buffers.reset(new(std::nothrow) uint8_t[depth * SLOT_SIZE]);
+    m_jobs.reset(new(std::nothrow) Job[depth]);
+    if(!m_buffers || !m_jobs)
+      return ENOMEM;
+
+    std::vector<iovec> iovecs(depth);
+    for(unsigned i = 0; i < depth; ++i)
+    {
+      iovecs[i].iov_base = slotBuffer(i);
+      iovecs[i].iov_len = SLOT_SIZE;
+      m_freeSlots.push_back(depth - 1 - i);
+    }
+
+    // not fatal, RLIMIT_MEMLOCK might be too low, plain reads/writes will do
+    if(!m_ring.registerBuffers(iovecs.data(), depth))
+      LOG << "Couldn't register io_uring buffers, using unregistered ones";
+
+    return 0;
+  }
+
+  /*
+   * Largest file read through the ring, bigger ones go to hasher
+   */
+  uint64_t maxFileSize() const
+  {
+    return static_cast<uint64_t>(m_maxFileSlots) * SLOT_SIZE;
+  }
+
+  void useIndex(HashIndex &index)
+  {
+    m_index = &index;
+  }
+
+  /*
+   * Compressed inputs are forwarded to hasher, which decodes them
+   */
+  void decodeInputs()
+  {
+    m_decode = true;
+  }
+
+  /*
+   * Files from minSize on are forwarded to hasher, they get tree digest there
+   */
+  void treeHashFrom(uint64_t minSize)
+  {
+    m_treeHashMin = minSize;
+  }
+
+  void start()
+  {
+    m_thread = std::jthread([this]{ loop(); });
+  }
+
+  void schedule(std::string_view filepath)
+  {
+    const PathHandle handle = m_paths.append(filepath);
+    if(handle == PathArena::INVALID_HANDLE)
+    {
+      LOG << "  Path too long or path memory exhausted, omitting " << filepath;
+      return;
+    }
+
+    m_queue.push(handle);
+  }
+
+  /*
+   * Blocks until every scheduled file is done or forwarded to hasher
+   */
+  void finish()
+  {
+    m_queue.close();
+
+    if(m_thread.joinable())
+      m_thread.join();
+  }
+
+  QueueStats queueStats() const { return m_queue.stats(); }
+  size_t queueDepth() const { return m_queue.depth(); }
+
+  void logStats() const
+  {
+    LOG << "io_uring read " << m_filesRead << " files, wrote " << m_filesWritten
+        << " files (" << m_bytesWritten << " bytes), " << m_forwarded << " large, tree hashed or compressed files forwarded to hasher, "
+        << m_indexHits << " digests from index";
+  }
+
+private:
+  uint8_t *slotBuffer(unsigned idx) const
+  {
+    return m_buffers.get() + static_cast<size_t>(idx) * SLOT_SIZE;
+  }
+
+  static unsigned slotsFor(uint64_t size)
+  {
+    return std::max(1u, static_cast<unsigned>((size + SLOT_SIZE - 1) / SLOT_SIZE));
+  }
+
+  void loop()
+  {
+    const auto start = NOW();
+    while(true)
+    {
+      PathHandle handle;
+      if(m_jobCount == 0 && m_waiting.fd < 0)
+      {
+        // nothing to reap, safe to park until there's a path
+        if(!m_queue.pop(handle))
+          break;
+
+        openFile(handle);
+      }
+
+      while(startWaiting() && !m_freeSlots.empty() && m_queue.tryPop(handle))
+        openFile(handle);
+
+      resubmitDeferred();
+      if(m_jobCount == 0)
+        continue;
+
+      // EAGAIN and EBUSY are kernel short of memory or completion queue full,
+      // whatever wasn't consumed is submitted again on the next call
+      const int ret = m_ring.submitAndWait(m_pending ? 1 : 0);
+      if(ret < 0 && ret != -EAGAIN && ret != -EBUSY)
+      {
+        LOG << "io_uring_enter failed " << std::strerror(-ret) << ", handing remaining files over to hasher";
+        abandon();
+        break;
+      }
+
+      reap();
+    }
+
+    LOG << "io_uring worker finished " << DURATION_S(start).count() << "s";
+  }
+
+  void reap()
+  {
+    while(io_uring_cqe *cqe = m_ring.peekCqe())
+    {
+      const uint64_t userData = cqe->user_data;
+      const int res = cqe->res;
+      m_ring.seen();
+      --m_pending;
+
+      const auto idx = static_cast<unsigned>(userData & ~WRITE_FLAG);
+      if(userData & WRITE_FLAG)
+        onWrite(idx, res);
+      else
+        onRead(idx, res);
+    }
+  }
+
+  void forward(PathHandle path)
+  {
+    ++m_forwarded;
+    m_hasher.schedule(path);
+  }
+
+  void release(unsigned idx)
+  {
+    Job &job = m_jobs[idx];
+    if(job.fd >= 0)
+      ::close(job.fd);
+
+    m_freeSlots.insert(m_freeSlots.end(), job.slots.rbegin(), job.slots.rend());
+    job = Job{};
+    --m_jobCount;
+  }
+
+  void openFile(PathHandle path)
+  {
+    const std::string_view pathView = m_paths.get(path);
+    const int fd = ::open(pathView.data(), O_RDONLY);
+    if(fd < 0)
+    {
+      LOG << "  Can't open file " << pathView;
+      return;
+    }
+
+    struct stat st;
+    if(::fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) > maxFileSize()
+        || (m_treeHashMin && static_cast<uint64_t>(st.st_size) >= m_treeHashMin)
+        || (m_decode && sniffFormat(fd) != InputFormat::Plain))
+    {
+      ::close(fd);
+      forward(path);
+      return;
+    }
+
+    m_waiting.path = path;
+    m_waiting.fd = fd;
+    m_waiting.size = static_cast<uint64_t>(st.st_size);
+    m_waiting.st = st;
+  }
+
+  /*
+   * Starts waiting file when there are enough free slots for it,
+   * returns false when it still has to wait
+   */
+  bool startWaiting()
+  {
+    if(m_waiting.fd < 0)
+      return true;
+
+    const unsigned needed = slotsFor(m_waiting.size);
+    if(needed > m_freeSlots.size())
+      return false;
+
+    std::vector<unsigned> slots(needed);
+    for(unsigned &slot : slots)
+    {
+      slot = m_freeSlots.back();
+      m_freeSlots.pop_back();
+    }
+
+    const unsigned idx = slots.front();
+    Job &job = m_jobs[idx];
+    job = std::move(m_waiting);
+    job.slots = std::move(slots);
+    m_waiting = Job{};
+    ++m_jobCount;
+
+    if(const IndexRecord *rec = m_index ? m_index->find(job.st) : nullptr)
+    {
+      ++m_indexHits;
+      m_index->record(job.st, rec->digest, rec->digestLen, rec->contentSize);
+      if(!m_hasher.insertUnique(rec->digest, rec->digestLen))
+      {
+        m_metrics.add(Metric::FilesHashed);
+        m_metrics.add(Metric::FilesDuplicate);
+        release(idx);
+        return true;
+      }
+      job.digestKnown = true;
+    }
+
+    if(job.size == 0)
+      readFinished(idx);
+    else
+      submit(idx);
+
+    return true;
+  }
+
+  /*
+   * Next read or write of job, up to the end of slot its position falls into
+   */
+  void submit(unsigned idx)
+  {
+    Job &job = m_jobs[idx];
+    const unsigned slot = job.slots[job.done / SLOT_SIZE];
+    const size_t inSlot = job.done % SLOT_SIZE;
+    const auto len = static_cast<unsigned>(std::min<uint64_t>(SLOT_SIZE - inSlot, job.size - job.done));
+    const bool queued = job.writing
+      ? m_ring.prepRw(true, m_outFd, slotBuffer(slot) + inSlot, len, job.outOffset + job.done, slot, idx | WRITE_FLAG)
+      : m_ring.prepRw(false, job.fd, slotBuffer(slot) + inSlot, len, job.done, slot, idx);
+
+    if(queued)
+      ++m_pending;
+    else
+      m_deferred.push_back(idx);
+  }
+
+  void resubmitDeferred()
+  {
+    std::vector<unsigned> deferred;
+    deferred.swap(m_deferred);
+    for(const unsigned idx : deferred)
+      submit(idx);
+  }
+
+  void onRead(unsigned idx, int res)
+  {
+    Job &job = m_jobs[idx];
+    if(res < 0)
+    {
+      LOG << "  Read error " << std::strerror(-res) << " for " << m_paths.get(job.path);
+      release(idx);
+      return;
+    }
+
+    // file shrunk since fstat, take what's there
+    if(res == 0)
+      job.size = job.done;
+
+    job.done += static_cast<uint64_t>(res);
+    if(job.done < job.size)
+      submit(idx);
+    else
+      readFinished(idx);
+  }
+
+  std::vector<uint8_t> hashJob(const Job &job) const
+  {
+    std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx{ EVP_MD_CTX_new(), &EVP_MD_CTX_free };
+    if(!ctx || !EVP_DigestInit_ex(ctx.get(), EVP_blake2b512(), nullptr))
+      return {};
+
+    for(uint64_t pos = 0; pos < job.size; pos += SLOT_SIZE)
+      EVP_DigestUpdate(ctx.get(), slotBuffer(job.slots[pos / SLOT_SIZE]), std::min<uint64_t>(SLOT_SIZE, job.size - pos));
+
+    uint8_t mdbuf[EVP_MAX_MD_SIZE];
+    unsigned mdlen = 0;
+    if(!EVP_DigestFinal_ex(ctx.get(), mdbuf, &mdlen))
+      return {};
+
+    return std::vector<uint8_t>(std::begin(mdbuf), std::next(std::begin(mdbuf), mdlen));
+  }
+
+  void readFinished(unsigned idx)
+  {
+    Job &job = m_jobs[idx];
+    ++m_filesRead;
+    ::close(job.fd);
+    job.fd = -1;
+
+    Metrics::Counters &counters = m_metrics.local();
+    counters.add(Metric::FilesHashed);
+    if(!job.digestKnown)
+    {
+      const auto hashStart = NOW();
+      auto fileHash = hashJob(job);
+      counters.add(Metric::HashNs, elapsedNs(hashStart));
+      counters.add(Metric::BytesHashed, job.size);
+      if(m_index && !fileHash.empty())
+        m_index->record(job.st, fileHash.data(), fileHash.size(), job.size);
+
+      if(!m_hasher.insertUnique(fileHash))
+      {
+        counters.add(Metric::FilesDuplicate);
+        release(idx);
+        return;
+      }
+    }
+
+    counters.add(Metric::FilesUnique);
+    job.outOffset = m_outputOffset.fetch_add(job.size);
+    job.done = 0;
+    job.writing = true;
+    if(job.size == 0)
+    {
+      ++m_filesWritten;
+      counters.add(Metric::FilesWritten);
+      release(idx);
+      return;
+    }
+
+    submit(idx);
+  }
+
+  void onWrite(unsigned idx, int res)
+  {
+    Job &job = m_jobs[idx];
+    if(res <= 0)
+    {
+      LOG << "  Write error " << std::strerror(res < 0 ? -res : EIO) << " for " << m_paths.get(job.path);
+      release(idx);
+      return;
+    }
+
+    job.done += static_cast<uint64_t>(res);
+    m_bytesWritten += static_cast<uint64_t>(res);
+    m_metrics.add(Metric::BytesWritten, static_cast<uint64_t>(res));
+    if(job.done < job.size)
+    {
+      submit(idx);
+      return;
+    }
+
+    ++m_filesWritten;
+    m_metrics.add(Metric::FilesWritten);
+    release(idx);
+  }
+
+  /*
+   * Ring can't be entered any more. Files being read go to hasher (or straight
+   * to writers when their digest is in already), files being written are finished
+   * with pwrite from their slots, anything still queued goes to hasher.
+   */
+  void abandon()
+  {
+    reap();
+    for(unsigned idx = 0; idx < m_depth; ++idx)
+    {
+      Job &job = m_jobs[idx];
+      if(job.slots.empty())
+        continue;
+
+      if(!job.writing)
+      {
+        if(job.digestKnown)
+          m_hasher.acceptUnique(job.path, job.size);
+        else
+          forward(job.path);
+      }
+      else
+      {
+        writeRest(job);
+      }
+      release(idx);
+    }
+
+    if(m_waiting.fd >= 0)
+    {
+      ::close(m_waiting.fd);
+      forward(m_waiting.path);
+      m_waiting = Job{};
+    }
+
+    PathHandle handle;
+    while(m_queue.pop(handle))
+      forward(handle);
+  }
+
+  void writeRest(Job &job)
+  {
+    while(job.done < job.size)
+    {
+      const size_t inSlot = job.done % SLOT_SIZE;
+      const size_t len = std::min<uint64_t>(SLOT_SIZE - inSlot, job.size - job.done);
+      const ssize_t ret = ::pwrite(m_outFd, slotBuffer(job.slots[job.done / SLOT_SIZE]) + inSlot, len, static_cast<off_t>(job.outOffset + job.done));
+      if(ret < 0 && errno == EINTR)
+        continue;
+      if(ret <= 0)
+      {
+        LOG << "  Write error " << std::strerror(ret < 0 ? errno : EIO) << " for " << m_paths.get(job.path);
+        return;
+      }
+
+      job.done += static_cast<uint64_t>(ret);
+      m_bytesWritten += static_cast<uint64_t>(ret);
+      m_metrics.add(Metric::BytesWritten, static_cast<uint64_t>(ret));
+    }
+
+    ++m_filesWritten;
+    m_metrics.add(Metric::FilesWritten);
+  }
+};
+
 int main(int argc, char *argv[])
 {
-  static constexpr size_t FILE_COUNT_LIMIT = 1'048'576;
-  static constexpr size_t FNAME_MAX_SIZE = 451; // arbitrary value
+  static constexpr size_t HASH_CACHE_RESERVE = 65'536; // only a hint, not a limit, digests are stored inline
 //  static constexpr size_t READ_BUFF_SIZE = 2 * GB + 10; // +10 just in case
-//  static constexpr size_t FNAME_POOL_SIZE = FNAME_MAX_SIZE * FILE_COUNT_LIMIT;
 
-  if(argc != 5)
+  if(argc < 5)
   {
     LOG << "Missing input parameters!";
     usage();
     return 0;
   }
 
-  const auto [filename, extension] = [argc, argv] {
+  auto [filename, roots, extensions, globs, regexes, copyMode, writeThreads, walkThreads, queueDepth, prefilter, sizeAware, indexPath, appendOnly, mergeLines, lineDedupMb, compression, decompress, readOnceKb, progressSeconds, metricsPath, followMs, treeHashMb, chunkDedupKb, validArgs] = [argc, argv] {
     AppArgs ret;
     for(size_t i = 1; i < static_cast<size_t>(argc); ++i)
     {
-      if(std::strcmp("-f", argv[i]) == 0)
-        ret.filename = argv[i + 1];
+      if(std::strcmp("-p", argv[i]) == 0)
+        ret.prefilter = true;
+      else if(std::strcmp("-S", argv[i]) == 0)
+        ret.sizeAware = true;
+      else if(std::strcmp("-a", argv[i]) == 0)
+        ret.appendOnly = true;
+      else if(std::strcmp("-m", argv[i]) == 0)
+        ret.mergeLines = true;
+      else if(std::strcmp("-d", argv[i]) == 0)
+        ret.decompress = true;
+      else if(i + 1 == static_cast<size_t>(argc))
+        ret.valid = false;
+      else if(std::strcmp("-f", argv[i]) == 0)
+        ret.filename = argv[++i];
       else if(std::strcmp("-e", argv[i]) == 0)
-        ret.searchExtension = argv[i + 1];
+        ret.extensions.push_back(argv[++i]);
+      else if(std::strcmp("-D", argv[i]) == 0)
+        ret.roots.push_back(argv[++i]);
+      else if(std::strcmp("-g", argv[i]) == 0 || std::strcmp("-G", argv[i]) == 0)
+      {
+        const bool exclude = argv[i][1] == 'G';
+        ret.globs.emplace_back(argv[++i], exclude);
+      }
+      else if(std::strcmp("-x", argv[i]) == 0 || std::strcmp("-X", argv[i]) == 0)
+      {
+        const bool exclude = argv[i][1] == 'X';
+        ret.regexes.emplace_back(argv[++i], exclude);
+      }
+      else if(std::strcmp("-i", argv[i]) == 0)
+        ret.indexPath = argv[++i];
+      else if(std::strcmp("-M", argv[i]) == 0)
+        ret.metricsPath = argv[++i];
+      else if(std::strcmp("-s", argv[i]) == 0)
+      {
+        const int kilobytes = std::atoi(argv[++i]);
+        if(kilobytes < 0 || kilobytes > 1024 || (kilobytes == 0 && std::strcmp("0", argv[i]) != 0))
+          ret.valid = false;
+        else
+          ret.readOnceKb = static_cast<size_t>(kilobytes);
+      }
+      else if(std::strcmp("-C", argv[i]) == 0)
+      {
+        const int kilobytes = std::atoi(argv[++i]);
+        if(kilobytes <= 0 || kilobytes > 16 * 1024)
+          ret.valid = false;
+        else
+          ret.chunkDedupKb = static_cast<size_t>(kilobytes);
+      }
+      else if(std::strcmp("-T", argv[i]) == 0)
+      {
+        const int megabytes = std::atoi(argv[++i]);
+        if(megabytes <= 0)
+          ret.valid = false;
+        else
+          ret.treeHashMb = static_cast<size_t>(megabytes);
+      }
+      else if(std::strcmp("-F", argv[i]) == 0)
+      {
+        const int ms = std::atoi(argv[++i]);
+        if(ms < 0 || (ms == 0 && std::strcmp("0", argv[i]) != 0))
+          ret.valid = false;
+        else
+          ret.followMs = static_cast<unsigned>(ms);
+      }
+      else if(std::strcmp("-r", argv[i]) == 0)
+      {
+        const int seconds = std::atoi(argv[++i]);
+        if(seconds < 0 || (seconds == 0 && std::strcmp("0", argv[i]) != 0))
+          ret.valid = false;
+        else
+          ret.progressSeconds = static_cast<unsigned>(seconds);
+      }
+      else if(std::strcmp("-w", argv[i]) == 0)
+      {
+        const int threads = std::atoi(argv[++i]);
+        if(threads <= 0)
+          ret.valid = false;
+        else
+          ret.writeThreads = static_cast<thread_count_t>(threads);
+      }
+      else if(std::strcmp("-t", argv[i]) == 0)
+      {
+        const int threads = std::atoi(argv[++i]);
+        if(threads <= 0)
+          ret.valid = false;
+        else
+          ret.walkThreads = static_cast<thread_count_t>(threads);
+      }
+      else if(std::strcmp("-q", argv[i]) == 0)
+      {
+        const int depth = std::atoi(argv[++i]);
+        if(depth <= 0 || depth > 4096)
+          ret.valid = false;
+        else
+          ret.queueDepth = static_cast<unsigned>(depth);
+      }
+      else if(std::strcmp("-l", argv[i]) == 0)
+      {
+        const int megabytes = std::atoi(argv[++i]);
+        if(megabytes <= 0)
+          ret.valid = false;
+        else
+          ret.lineDedupMb = static_cast<size_t>(megabytes);
+      }
+      else if(std::strcmp("-z", argv[i]) == 0)
+      {
+        const auto args = parseCompression(argv[++i]);
+        if(!args)
+          ret.valid = false;
+        else
+          ret.compression = *args;
+      }
+      else if(std::strcmp("-c", argv[i]) == 0)
+      {
+        const auto mode = parseCopyMode(argv[++i]);
+        if(!mode)
+          ret.valid = false;
+        else
+          ret.copyMode = *mode;
+      }
     }
     return ret;
   }();
 
+  if(!validArgs)
+  {
+    LOG << "Invalid parameters!";
+    usage();
+    return 0;
+  }
+
   if(filename.empty())
   {
     LOG << "Missing -f parameter!";
     usage();
     return 0;
   }
-  if(extension.empty())
+  PathMatcher matcher;
+  matcher.matchRotated(decompress);
+  for(const auto ext : extensions)
+  {
+    if(!ext.starts_with('.') || ext.size() < 2)
+    {
+      LOG << "Extension need to start wth a dot!";
+      usage();
+      return 0;
+    }
+    matcher.addExtension(ext);
+  }
+  for(const auto &[pattern, exclude] : globs)
+    matcher.addGlob(pattern, exclude);
+  for(const auto &[pattern, exclude] : regexes)
+  {
+    if(!matcher.addRegex(pattern, exclude))
+    {
+      LOG << "Invalid regex " << pattern;
+      usage();
+      return 0;
+    }
+  }
+  if(matcher.empty())
+  {
+    LOG << "Missing -e, -g or -x parameter!";
+    usage();
+    return 0;
+  }
+  if(roots.empty())
+    roots.push_back("./");
+  if(appendOnly && indexPath.empty())
   {
-    LOG << "Missing -e parameter!";
+    LOG << "Append only mode requires -i parameter!";
     usage();
     return 0;
   }
-  if(!extension.starts_with('.'))
+  if(decompress && prefilter)
+  {
+    // compressed size says nothing about content
+    LOG << "Prefilter is disabled when decompressing inputs";
+    prefilter = false;
+  }
+  if(appendOnly && prefilter)
+  {
+    // files unique by size never get a digest, next append run couldn't recognize them
+    LOG << "Prefilter is disabled in append only mode";
+    prefilter = false;
+  }
+  if(decompress && treeHashMb)
+  {
+    // decoded size isn't known up front, digest kind would depend on compression
+    LOG << "Tree hash is disabled when decompressing inputs";
+    treeHashMb = 0;
+  }
+
+  // digest kind depends on content size only, index records which threshold it was
+  static constexpr size_t TREE_HASH_CHUNK_SIZE = 4 * MB;
+  const uint64_t treeHashMin = treeHashMb ? std::max<uint64_t>(treeHashMb * MB, TREE_HASH_CHUNK_SIZE) : 0;
+
+  if(chunkDedupKb && (mergeLines || lineDedupMb))
+  {
+    LOG << "Line modes are ignored with chunk dedup";
+    mergeLines = false;
+    lineDedupMb = 0;
+  }
+
+  // lines (or chunks) are written by single thread after hashing, no ranges to reserve
+  const bool lineMode = mergeLines || lineDedupMb || chunkDedupKb;
+  if(lineMode && copyMode != CopyMode::Stdio)
+  {
+    LOG << "Copy mode is ignored in line modes";
+    copyMode = CopyMode::Stdio;
+  }
+  // frames are cut from sequential stream
+  if(compression.format != Compression::None && copyMode != CopyMode::Stdio)
+  {
+    LOG << "Copy mode is ignored with compressed output";
+    copyMode = CopyMode::Stdio;
+  }
+  // decoded sizes are not known before writing, they go through stdio
+  if(decompress && copyMode == CopyMode::Direct)
+  {
+    LOG << "Copy mode direct is replaced with stdio when decompressing";
+    copyMode = CopyMode::Stdio;
+  }
+
+  if(followMs && (lineMode || compression.format != Compression::None || decompress))
   {
-    LOG << "Extension need to start wth a dot!";
+    LOG << "Follow mode can't be used with -m, -l, -C, -z or -d!";
     usage();
     return 0;
   }
+  // only writer threads know how much of every file they copied
+  if(followMs && copyMode == CopyMode::Uring)
+  {
+    LOG << "Copy mode uring is replaced with pwrite in follow mode";
+    copyMode = CopyMode::Pwrite;
+  }
 
-  FnamesMemory fnamesArray = initFnamesMem(FILE_COUNT_LIMIT, FNAME_MAX_SIZE);
-  if(!fnamesArray)
+  HashIndex index(treeHashMin, decompress);
+  if(!indexPath.empty() && !index.load(std::string{indexPath}))
   {
-    LOG << "Cant initizalize memory to hold file names";
-    return 1;
+    if(appendOnly)
+    {
+      // without it everything already in output would be appended again
+      LOG << "Index " << indexPath << " is broken or made with other -T, can't append";
+      return 1;
+    }
+    LOG << "Index " << indexPath << " is broken or made with other -T, all files will be hashed";
   }
 
-  std::FILE *outputFile = std::fopen(std::string{filename}.c_str(), "wb");
+  std::FILE *outputFile = [&]() -> std::FILE* {
+    if(!appendOnly)
+      return std::fopen(std::string{filename}.c_str(), "wb");
+
+    // not O_APPEND, pwrite ignores offsets on such descriptors
+    const int fd = ::open(std::string{filename}.c_str(), O_WRONLY | O_CREAT, 0644);
+    if(fd < 0 || ::lseek(fd, 0, SEEK_END) < 0)
+      return nullptr;
+
+    return ::fdopen(fd, "wb");
+  }();
   if(!outputFile)
   {
     LOG << "Couldn't open merged.log for writing";
@@ -570,54 +1981,435 @@ int main(int argc, char *argv[])
   }
   
   FileGuard writeFileGuard{outputFile};
+
+  // everything below writes through outStream, which may compress on the way
+  static constexpr size_t COMPRESSION_FRAME_SIZE = 4 * MB;
+  std::unique_ptr<CompressedOutput> compressed;
+  std::FILE *outStream = outputFile;
+  if(compression.format != Compression::None)
+  {
+    const unsigned compressThreads = std::max(2u, std::thread::hardware_concurrency() / 2);
+    compressed = std::make_unique<CompressedOutput>(fileno(outputFile), compression, COMPRESSION_FRAME_SIZE,
+                                                    compressThreads, std::string{filename} + ".frames");
+    outStream = compressed->openStream();
+    if(!outStream)
+    {
+      LOG << "Couldn't open compressed stream";
+      return 1;
+    }
+    LOG << "Compressing output with " << compressThreads << " threads";
+  }
 //  char wbuf[32 * KB];
 //  std::setvbuf(mergedLog, wbuf, _IOFBF, 32 * KB);
 
 
-  std::mutex fnamesMutex;
-  std::condition_variable fnamesSignal;
-  std::atomic_bool finishedPathTraversal{false};
-  std::atomic_bool finishedHashing{false};
+  static constexpr size_t WRITE_QUEUE_SIZE = 16 * 1024;
 
-  FileHashThreadPool hasher(fnamesArray, fnamesMutex, fnamesSignal, finishedPathTraversal);
-  if(!hasher.reserve(FILE_COUNT_LIMIT))
+  Metrics metrics;
+  PathArena paths;
+  WriteQueue writeQueue{WRITE_QUEUE_SIZE};
+
+  FileHashThreadPool hasher(paths, writeQueue, metrics);
+  if(!hasher.reserve(HASH_CACHE_RESERVE))
   {
     LOG << "Couldn't initialize enough memory for hash cache";
     return 1;
   }
+  // io_uring pipeline writes to reserved ranges as well, large files go through pwrite writers
+  const bool useRanges = copyMode == CopyMode::Pwrite || copyMode == CopyMode::Uring;
+  std::atomic<uint64_t> outputOffset{ static_cast<uint64_t>(std::max<off_t>(0, ::lseek(fileno(outputFile), 0, SEEK_CUR))) };
+  if(useRanges)
+    hasher.reserveOutputRanges(outputOffset);
+
+  if(decompress)
+    hasher.decodeInputs();
+
+  // line modes read inputs on their own, there's no writer to hand bytes to
+  static constexpr size_t READ_ONCE_POOL_SIZE = 32 * MB;
+  std::unique_ptr<ChunkPool> readOncePool;
+  if(readOnceKb && !lineMode)
+  {
+    const size_t chunkSize = readOnceKb * KB;
+    readOncePool = std::make_unique<ChunkPool>(std::max<size_t>(READ_ONCE_POOL_SIZE / chunkSize, 16), chunkSize, 1);
+    if(const int err = readOncePool->init(false))
+    {
+      LOG << "Read once pool unavailable (" << std::strerror(err) << "), small files are read twice";
+      readOncePool.reset();
+    }
+    else
+    {
+      hasher.readOnce(*readOncePool);
+    }
+  }
+
+  if(!indexPath.empty())
+  {
+    hasher.useIndex(index);
+
+    // whatever previous run merged is already in output
+    if(appendOnly)
+    {
+      for(const IndexRecord &rec : index)
+        hasher.insertUnique(rec.digest, rec.digestLen);
+
+      LOG << "Appending to " << filename << ", " << index.size() << " files known from index";
+    }
+  }
+
+  FileOffsets followOffsets;
+  if(followMs)
+    hasher.trackOffsets(followOffsets);
+
+  std::unique_ptr<TreeHasher> treeHasher;
+  if(treeHashMin)
+  {
+    const unsigned helpers = std::max(1u, std::thread::hardware_concurrency());
+    treeHasher = std::make_unique<TreeHasher>(treeHashMin, TREE_HASH_CHUNK_SIZE, helpers);
+    hasher.treeHash(*treeHasher);
+    LOG << "Tree hashing files from " << treeHasher->minSize() << " bytes with " << helpers << " threads";
+  }
+
+  static constexpr size_t DIRECT_CHUNK_SIZE = 1 * MB;
+  static constexpr size_t DIRECT_CHUNK_COUNT = 8;
+  DirectIoStats directStats;
+  std::unique_ptr<DirectOutput> directOutput;
+  std::unique_ptr<ChunkPool> directReads;
+  if(copyMode == CopyMode::Direct)
+  {
+    directOutput = std::make_unique<DirectOutput>(DIRECT_CHUNK_SIZE, DIRECT_CHUNK_COUNT, directStats);
+    directReads = std::make_unique<ChunkPool>(writeThreads, DIRECT_CHUNK_SIZE, 1);
+    const off_t start = ::lseek(fileno(outputFile), 0, SEEK_CUR);
+    int err = directReads->init(false);
+    if(!err)
+      err = directOutput->open(std::string{filename}.c_str(), static_cast<uint64_t>(std::max<off_t>(0, start)));
+    if(err)
+    {
+      LOG << "O_DIRECT unavailable (" << std::strerror(err) << "), falling back to stdio";
+      directOutput.reset();
+      directReads.reset();
+      copyMode = CopyMode::Stdio;
+    }
+  }
+
   hasher.start(5);
 
-  FileWriteThreadPool writer(*outputFile, fnamesArray, fnamesMutex, fnamesSignal, finishedHashing);
-  writer.start(2);
-  LOG << "Writer threads started";
+  FileWriteThreadPool writer(*outStream, useRanges ? CopyMode::Pwrite : copyMode, paths, writeQueue, metrics);
+  std::vector<PathHandle> mergeInputs;
+  std::jthread mergeCollector;
+  if(lineMode)
+  {
+    // nothing can be written before every unique file is known
+    mergeCollector = std::jthread([&] {
+      WriteItem batch[64];
+      while(const size_t count = writeQueue.popBatch(batch, std::size(batch)))
+      {
+        for(size_t i = 0; i < count; ++i)
+          mergeInputs.push_back(batch[i].path);
+      }
+    });
+  }
+  else
+  {
+    if(decompress)
+      writer.decodeInputs();
+    if(readOncePool)
+      writer.readOnce(*readOncePool);
+    if(followMs)
+      writer.trackOffsets(followOffsets);
+    if(directOutput)
+      writer.directIo(*directOutput, *directReads, directStats);
+    writer.start(writeThreads);
+    LOG << "Writer threads started";
+  }
+
+  std::unique_ptr<UringPipeline> uring;
+  if(copyMode == CopyMode::Uring)
+  {
+    uring = std::make_unique<UringPipeline>(paths, hasher, fileno(outputFile), outputOffset, metrics);
+    if(const int err = uring->init(queueDepth))
+    {
+      LOG << "io_uring unavailable (" << std::strerror(err) << "), falling back to thread pools";
+      uring.reset();
+    }
+    else
+    {
+      if(!indexPath.empty())
+        uring->useIndex(index);
+      if(decompress)
+        uring->decodeInputs();
+      if(treeHashMin)
+        uring->treeHashFrom(treeHashMin);
+      uring->start();
+      LOG << "io_uring reads files up to " << uring->maxFileSize() << " bytes, larger ones go to hasher";
+    }
+  }
+
+  metrics.addGauge("log_merger_hash_queue_depth", "Paths waiting for hash workers", [&hasher] { return hasher.queueDepth(); });
+  metrics.addGauge("log_merger_write_queue_depth", "Unique files waiting for writers", [&writeQueue] { return writeQueue.depth(); });
+  metrics.addGauge("log_merger_uring_queue_depth", "Paths waiting for io_uring pipeline", [&uring] { return uring ? uring->queueDepth() : 0; });
+  metrics.addGauge("log_merger_path_arena_bytes", "Bytes of paths stored", [&paths] { return paths.bytesUsed(); });
 
-  const fs::path fsExtension{extension};
-  const fs::path fsOutFilename{filename};
-  for(auto itEntry = fs::recursive_directory_iterator("./");
-      itEntry != fs::recursive_directory_iterator();
-      ++itEntry)
+  // stopped explicitly before anything its gauges look at goes away
+  std::unique_ptr<MetricsReporter> reporter;
+  if(progressSeconds || !metricsPath.empty())
   {
-    const auto &path = itEntry->path();
-    if(path.filename() == fsOutFilename || fs::is_directory(path) || path.extension() != fsExtension)
+    reporter = std::make_unique<MetricsReporter>(metrics, std::chrono::seconds{progressSeconds},
+                                                 [](const std::string &line) { LOG << line; }, std::string{metricsPath});
+    if(const int err = reporter->start())
     {
-      //LOG << "Ommiting " << path.filename().string();
-      continue;
+      LOG << "Metrics reporter unavailable (" << std::strerror(err) << ")";
+      reporter.reset();
     }
+  }
 
-    hasher.schedule(path.string());
+  const std::string outName = fs::path{filename}.filename().string();
+  const std::vector<std::string> rootPaths(roots.begin(), roots.end());
+
+  // watches go first, whatever is written during merge is caught up on afterwards
+  std::unique_ptr<LogFollower> follower;
+  if(followMs)
+  {
+    follower = std::make_unique<LogFollower>(matcher, outName, fileno(outputFile));
+    if(const int err = follower->init(rootPaths))
+    {
+      LOG << "Can't watch inputs (" << std::strerror(err) << ")";
+      return 1;
+    }
+    LOG << "Watching " << follower->watchCount() << " directories";
+  }
+  const auto scheduleFullHash = [&](std::string_view path) {
+    if(uring)
+      uring->schedule(path);
+    else
+      hasher.schedule(path);
+  };
+
+  // prefilter and size aware scheduling need every size first, one list per walker thread
+  const bool collectSizes = prefilter || sizeAware;
+  std::vector<std::vector<DedupCandidate>> walkerCandidates(collectSizes ? walkThreads : 0);
+  DirWalker walker;
+  const auto walkStart = NOW();
+  const WalkStats walkStats = walker.walk(rootPaths, walkThreads, [&](unsigned worker, const WalkEntry &entry) {
+    if(entry.name == outName || !matcher.matches(entry.name, entry.path))
+      return;
+
+    metrics.add(Metric::FilesScanned);
+
+    if(collectSizes)
+    {
+      struct stat st;
+      const uint64_t size = ::fstatat(entry.dirFd, entry.name.data(), &st, 0) == 0 ? static_cast<uint64_t>(st.st_size) : 0;
+      walkerCandidates[worker].push_back(DedupCandidate{ .path = std::string{entry.path}, .size = size });
+    }
+    else
+    {
+      scheduleFullHash(entry.path);
+    }
+  });
+
+  LOG << "Traversal " << DURATION_MS(walkStart).count() << "ms: " << walkStats.dirs << " dirs, "
+      << walkStats.entries << " entries, " << walkStats.files << " files, " << walkStats.stats << " stat calls, "
+      << walkStats.steals << " steals, " << walkStats.errors << " errors";
+
+  std::vector<DedupCandidate> candidates;
+  for(auto &list : walkerCandidates)
+    std::move(list.begin(), list.end(), std::back_inserter(candidates));
+  walkerCandidates.clear();
+
+  if(prefilter)
+  {
+    const auto start = NOW();
+    std::vector<DedupCandidate> fullHash;
+    const auto stats = sizePrefilter(candidates, 5,
+        [&](DedupCandidate &candidate) { hasher.acceptUnique(std::string_view{candidate.path}); },
+        [&](DedupCandidate &candidate) {
+          if(sizeAware)
+            fullHash.push_back(std::move(candidate));
+          else
+            scheduleFullHash(candidate.path);
+        },
+        sizeAware);
+    candidates = std::move(fullHash);
+
+    LOG << "Prefilter " << DURATION_MS(start).count() << "ms: " << stats.files << " files, "
+        << stats.uniqueBySize << " unique by size, " << stats.uniqueBySample << " unique by xxh3 sample, "
+        << stats.fullHashFiles << " to full digest (" << stats.fullHashBytes << " of " << stats.bytes << " bytes)";
+  }
+
+  if(sizeAware)
+  {
+    if(uring)
+    {
+      // pipeline keeps its own slots busy, order is all it takes
+      std::sort(candidates.begin(), candidates.end(), [](const auto &lhs, const auto &rhs) { return lhs.size > rhs.size; });
+      for(const DedupCandidate &candidate : candidates)
+        uring->schedule(candidate.path);
+    }
+    else
+    {
+      const size_t batches = hasher.scheduleLargestFirst(candidates);
+      LOG << "Scheduled " << candidates.size() << " files largest first, small ones in " << batches << " batches";
+    }
+  }
+
+  // pipeline may still forward large files to hasher
+  if(uring)
+  {
+    uring->finish();
+    uring->logStats();
   }
 
-  finishedPathTraversal = true; 
   LOG << "Finished path traversal";
 
-  hasher.notify();
+  hasher.closeInput();
   hasher.joinThreads();
-  finishedHashing = true;
-  fnamesSignal.notify_all();
+  writeQueue.close();
   LOG << "Finished hashing";
 
-  writer.joinThreads();
+  if(lineMode)
+  {
+    static constexpr size_t MERGE_READ_AHEAD = 64 * KB;
+    static constexpr size_t MERGE_FAN_IN = 256;
+
+    mergeCollector.join();
+
+    // hashing order is random, path order is not
+    std::vector<std::string> inputs;
+    inputs.reserve(mergeInputs.size());
+    for(const PathHandle path : mergeInputs)
+      inputs.emplace_back(paths.get(path));
+    std::sort(inputs.begin(), inputs.end());
+
+    if(chunkDedupKb)
+    {
+      const auto start = NOW();
+      ChunkDedup chunkDedup(chunkDedupKb * KB);
+      if(!chunkDedup.copy(inputs, *outStream, decompress))
+        LOG << "Writing chunks into " << filename << " failed";
+
+      const ChunkDedupStats &stats = chunkDedup.stats();
+      LOG << "Wrote " << stats.uniqueChunks << " of " << stats.chunks << " chunks (" << stats.bytesOut << " of "
+          << stats.bytesIn << " bytes) of " << stats.files << " files in " << DURATION_MS(start).count() << "ms, "
+          << stats.unreadable << " unreadable";
+      LOG << "Chunk dedup ratio " << stats.dedupRatio() * 100.0 << "%, chunk index " << stats.indexBytes << " bytes";
+    }
+    else
+    {
+      std::optional<LineDedup> dedup;
+      if(lineDedupMb)
+        dedup.emplace(lineDedupMb * MB);
+
+      const auto start = NOW();
+      bool ok = true;
+      LineMergeStats stats;
+      if(mergeLines)
+      {
+        LineMerger merger(MERGE_READ_AHEAD, MERGE_FAN_IN, std::string{filename} + ".merge");
+        merger.setDedup(dedup ? &*dedup : nullptr);
+        if(decompress)
+          merger.decodeInputs();
+        ok = merger.merge(std::move(inputs), *outStream);
+        stats = merger.stats();
+      }
+      else
+      {
+        ok = copyUniqueLines(inputs, *outStream, *dedup, stats, decompress);
+      }
+
+      if(!ok)
+        LOG << "Writing lines into " << filename << " failed";
+
+      LOG << "Wrote " << stats.lines << " lines (" << stats.bytes << " bytes) of " << stats.files << " files in "
+          << DURATION_MS(start).count() << "ms, " << stats.passes << " passes, "
+          << stats.linesWithoutTimestamp << " lines without timestamp, " << stats.unreadable << " unreadable";
+
+      if(dedup)
+      {
+        const LineDedupStats dstats = dedup->stats();
+        LOG << "Line dedup dropped " << stats.droppedDuplicates << " of " << dstats.lines << " lines, set "
+            << dstats.setBytes << " bytes, Bloom filter " << dstats.bloomBytes << " bytes, "
+            << dstats.spilled << " lines spilled, " << dstats.bloomDuplicates << " dropped by Bloom filter";
+      }
+    }
+  }
+  else
+  {
+    writer.joinThreads();
+    if(directOutput)
+    {
+      if(const int err = directOutput->finish())
+        LOG << "Direct write into " << filename << " failed (" << std::strerror(err) << ")";
+    }
+    writer.logStats();
+  }
   LOG << "Finished writing";
 
+  if(reporter && !follower)
+    reporter->stop();
+
+  const auto logQueue = [](std::string_view name, const QueueStats &stats) {
+    LOG << name << " queue: " << stats.pushes << " items, max depth " << stats.maxDepth
+        << ", producer stalls " << stats.pushParks << ", consumer stalls " << stats.popParks;
+  };
+  logQueue("Hash", hasher.queueStats());
+  logQueue("Write", writeQueue.stats());
+  LOG << "Path arena " << paths.bytesUsed() << " bytes";
+  LOG << "Digest set " << hasher.digestCount() << " digests, " << hasher.digestBytes() << " bytes";
+  if(hasher.unreadable())
+    LOG << "Couldn't read " << hasher.unreadable() << " files, they are not in output";
+  const MappedHashStats &mapped = hasher.mappedStats();
+  LOG << "Hashed through mmap " << mapped.files.load() << " files (" << mapped.bytes.load() << " bytes), "
+      << mapped.fallbacks.load() << " fell back to reads";
+  if(readOncePool)
+    LOG << "Read once " << hasher.readOnceFiles() << " small files";
+  if(treeHasher)
+  {
+    const TreeHashStats &tree = treeHasher->stats();
+    LOG << "Tree hashed " << tree.files.load() << " files (" << tree.bytes.load() << " bytes) in "
+        << tree.chunks.load() << " chunks, " << tree.helpedChunks.load() << " by helpers, "
+        << tree.failures.load() << " fell back to BLAKE2b";
+  }
+  if(uring)
+    logQueue("io_uring", uring->queueStats());
+
+  if(compressed)
+  {
+    const bool ok = std::fclose(outStream) == 0;
+    if(!compressed->finish() || !ok)
+      LOG << "Writing compressed " << filename << " failed";
+
+    const CompressionStats stats = compressed->stats();
+    LOG << "Compressed " << stats.rawBytes << " bytes into " << stats.compressedBytes << " bytes, "
+        << stats.frames << " frames, producer stalls " << stats.producerStalls;
+  }
+
+  if(useRanges && ::ftruncate(fileno(outputFile), static_cast<off_t>(outputOffset.load())) != 0)
+    LOG << "Couldn't set final size of " << filename;
+
+  if(!indexPath.empty())
+  {
+    LOG << "Digests taken from index " << hasher.indexHits();
+    if(!index.save(std::string{indexPath}, appendOnly))
+      LOG << "Couldn't save index " << indexPath;
+  }
+
+  if(follower)
+  {
+    std::fflush(outputFile);
+    std::signal(SIGINT, stopFollowing);
+    std::signal(SIGTERM, stopFollowing);
+    LOG << "Following inputs, batch window " << *followMs << "ms";
+
+    follower->run(followOffsets.take(), std::chrono::milliseconds{*followMs}, g_stopFollow, metrics);
+    if(reporter)
+      reporter->stop();
+
+    const FollowStats &stats = follower->stats();
+    LOG << "Followed " << stats.bytes << " bytes of " << stats.files << " files (" << stats.newFiles << " new) in "
+        << stats.batches << " batches, " << stats.writes << " writes, " << stats.events << " events";
+    LOG << "  truncated " << stats.truncations << ", renamed " << stats.renames << ", event overflows "
+        << stats.overflows << ", errors " << stats.errors;
+  }
+
   return 0;
 }
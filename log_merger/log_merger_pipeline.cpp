@@ -0,0 +1,321 @@
+/*
+*  MIT License
+*
+*  Copyright (c) 2025 Pawel Drzycimski
+*
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+*
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+*
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*
+*/
+
+#include "simplelog/simplelog.hpp"
+#include "pipeline.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <string>
+#include <type_traits>
+
+#define KB (static_cast<size_t>(1024))
+
+/*
+ * Stage strategies picked by name, one of each
+ */
+struct PipelineSpec
+{
+  std::string_view traversal {"fs"};
+  std::string_view hashing {"blake2b"};
+  std::string_view buffering {"chunks"};
+  std::string_view sink {"stdio"};
+};
+
+struct AppArgs
+{
+  std::string_view filename;
+  std::string_view searchExtension;
+  std::string_view root {"./"};
+  PipelineSpec spec;
+  unsigned walkThreads {4};
+  unsigned hashThreads {5};
+  unsigned readerCount {2};
+  size_t chunkCount {32};
+  size_t chunkKb {4 * 1024};
+  bool hugePages {false};
+  bool valid {true};
+};
+
+static void usage()
+{
+  LOG << "log_merger_pipeline -f <file name> -e <extension> [-P <spec>] [-D <dir>] [-t <threads>] [-j <threads>] [-w <readers>] [-b <chunks>] [-s <KB>] [-H]";
+  LOG << "  -f <file name> - file name to output merged logs";
+  LOG << "  -e <extension> - case sensitive with dot ex. .txt, .log";
+  LOG << "  -P <spec>      - <traversal>:<hashing>:<buffering>:<sink>, default fs:blake2b:chunks:stdio";
+  LOG << "       traversal - fs (std::filesystem iterator) or walker (parallel getdents64)";
+  LOG << "       hashing   - blake2b or xxh3 (128 bit, not cryptographic)";
+  LOG << "       buffering - chunks (streamed through chunk pool, in order), nocache (reader copies file itself";
+  LOG << "                   when output is free, chunks otherwise) or whole (whole file per reader)";
+  LOG << "       sink      - stdio (fwrite), fd (write), direct (O_DIRECT, double buffered), kernel (copy_file_range";
+  LOG << "                   or sendfile of whole files) or range (pwrite, reserved range per file, no ordering)";
+  LOG << "                   kernel and range take whole files from readers, buffering isn't used with them";
+  LOG << "       log_merger_3 is fs:blake2b:chunks:stdio, log_merger_4 fs:blake2b:whole:stdio, log_merger_5 fs:blake2b:nocache:stdio";
+  LOG << "  -D <dir>       - directory to merge from, default current one";
+  LOG << "  -t <threads>   - walker threads, default 4";
+  LOG << "  -j <threads>   - hash threads, default 5";
+  LOG << "  -w <readers>   - reader threads, default 2";
+  LOG << "  -b <chunks>    - read buffer chunks, default 32";
+  LOG << "  -s <KB>        - size of single chunk, default 4096";
+  LOG << "  -H             - back chunks with huge pages, chunk size is rounded up to 2MB";
+}
+
+static std::optional<PipelineSpec> parseSpec(std::string_view str)
+{
+  std::string_view parts[4];
+  for(size_t i = 0; i < std::size(parts); ++i)
+  {
+    const size_t colon = str.find(':');
+    if((colon == std::string_view::npos) != (i + 1 == std::size(parts)))
+      return std::nullopt;
+
+    parts[i] = str.substr(0, colon);
+    str.remove_prefix(colon == std::string_view::npos ? str.size() : colon + 1);
+  }
+
+  const PipelineSpec ret{ .traversal = parts[0], .hashing = parts[1], .buffering = parts[2], .sink = parts[3] };
+  if((ret.traversal != "fs" && ret.traversal != "walker") || (ret.hashing != "blake2b" && ret.hashing != "xxh3")
+     || (ret.buffering != "chunks" && ret.buffering != "nocache" && ret.buffering != "whole") || (ret.sink != "stdio" && ret.sink != "fd" && ret.sink != "direct" && ret.sink != "kernel" && ret.sink != "range"))
+    return std::nullopt;
+
+  return ret;
+}
+
+struct FileGuardDeleter
+{
+  void operator()(std::FILE *file) const
+  {
+    std::fclose(file);
+  }
+};
+
+using FileGuard = std::unique_ptr<std::FILE, FileGuardDeleter>;
+
+template<typename Traversal, typename Hashing, template<typename> class Buffering, typename Sink>
+static int run(std::FILE &output, const PipelineConfig &config)
+{
+  Pipeline<Traversal, Hashing, Buffering, Sink> pipeline(output, config);
+  if(const PipelineError err = pipeline.reserve(); err != PipelineError::None)
+  {
+    LOG << pipelineErrorText(err);
+    return 1;
+  }
+
+  pipeline.start();
+  LOG << "Writer threads started";
+
+  pipeline.traverse();
+  LOG << "Finished path traversal";
+
+  pipeline.finishHashing();
+  LOG << "Finished hashing";
+
+  pipeline.finishWriting();
+  LOG << "Finished writing";
+
+  const PipelineStats &stats = pipeline.stats();
+  LOG << stats.hashed.load() << " files hashed, " << stats.unique.load() << " unique, " << stats.dropped.load() << " dropped, "
+      << stats.unreadable.load() << " unreadable, " << stats.tooLarge.load() << " too large, "
+      << stats.bytesWritten.load() << " bytes written, " << stats.writeErrors.load() << " write errors";
+  if(stats.noCacheCopies)
+    LOG << stats.noCacheCopies.load() << " files copied without cache";
+
+  if constexpr(std::is_same_v<Sink, KernelCopySink>)
+  {
+    const KernelCopyStats &kernel = pipeline.sink().kernelStats();
+    LOG << "Kernel copy " << kernel.bytes.load() << " bytes in " << kernel.syscalls.load() << " calls, "
+        << kernel.sendfileFallbacks.load() << " sendfile and " << kernel.userspaceFallbacks.load() << " read/write fallbacks";
+  }
+  if constexpr(std::is_same_v<Sink, DirectSink>)
+  {
+    const DirectIoStats &direct = pipeline.sink().directStats();
+    LOG << "O_DIRECT " << direct.bytesWritten.load() << " bytes in " << direct.writes.load() << " writes, "
+        << direct.outputStalls.load() << " output stalls";
+  }
+
+  return stats.writeErrors ? 1 : 0;
+}
+
+/*
+ * fn gets std::type_identity of First when first is set, of Second otherwise
+ */
+template<typename First, typename Second, typename Fn>
+static int choose(bool first, Fn &&fn)
+{
+  return first ? fn(std::type_identity<First>{}) : fn(std::type_identity<Second>{});
+}
+
+/*
+ * fn gets std::type_identity of sink named name
+ */
+template<typename Fn>
+static int chooseSink(std::string_view name, Fn &&fn)
+{
+  if(name == "fd")
+    return fn(std::type_identity<FdSink>{});
+  if(name == "direct")
+    return fn(std::type_identity<DirectSink>{});
+  if(name == "kernel")
+    return fn(std::type_identity<KernelCopySink>{});
+  if(name == "range")
+    return fn(std::type_identity<PwriteRangeSink>{});
+  return fn(std::type_identity<StdioSink>{});
+}
+
+/*
+ * Runtime names to one of compile time combinations
+ */
+static int dispatch(const PipelineSpec &spec, std::FILE &output, const PipelineConfig &config)
+{
+  return choose<FsIteratorTraversal, DirWalkerTraversal>(spec.traversal == "fs", [&](auto traversal) {
+    return choose<Blake2bHash, Xxh3Hash>(spec.hashing == "blake2b", [&](auto hashing) {
+      return chooseSink(spec.sink, [&](auto sink) {
+        using Traversal = typename decltype(traversal)::type;
+        using Hashing = typename decltype(hashing)::type;
+        using Sink = typename decltype(sink)::type;
+        if(spec.buffering == "chunks")
+          return run<Traversal, Hashing, ChunkStreamBuffering, Sink>(output, config);
+        if(spec.buffering == "nocache")
+          return run<Traversal, Hashing, NoCacheFirstBuffering, Sink>(output, config);
+        return run<Traversal, Hashing, WholeFileBuffering, Sink>(output, config);
+      });
+    });
+  });
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc < 5)
+  {
+    LOG << "Missing input parameters!";
+    usage();
+    return 0;
+  }
+
+  const auto args = [argc, argv] {
+    AppArgs ret;
+    for(size_t i = 1; i < static_cast<size_t>(argc); ++i)
+    {
+      if(std::strcmp("-H", argv[i]) == 0)
+        ret.hugePages = true;
+      else if(i + 1 == static_cast<size_t>(argc))
+        ret.valid = false;
+      else if(std::strcmp("-f", argv[i]) == 0)
+        ret.filename = argv[++i];
+      else if(std::strcmp("-e", argv[i]) == 0)
+        ret.searchExtension = argv[++i];
+      else if(std::strcmp("-D", argv[i]) == 0)
+        ret.root = argv[++i];
+      else if(std::strcmp("-P", argv[i]) == 0)
+      {
+        const auto spec = parseSpec(argv[++i]);
+        if(!spec)
+          ret.valid = false;
+        else
+          ret.spec = *spec;
+      }
+      else if(std::strcmp("-t", argv[i]) == 0 || std::strcmp("-j", argv[i]) == 0 || std::strcmp("-w", argv[i]) == 0)
+      {
+        const char option = argv[i][1];
+        const int threads = std::atoi(argv[++i]);
+        if(threads <= 0)
+          ret.valid = false;
+        else if(option == 't')
+          ret.walkThreads = static_cast<unsigned>(threads);
+        else if(option == 'j')
+          ret.hashThreads = static_cast<unsigned>(threads);
+        else
+          ret.readerCount = static_cast<unsigned>(threads);
+      }
+      else if(std::strcmp("-b", argv[i]) == 0)
+      {
+        const int count = std::atoi(argv[++i]);
+        if(count <= 0)
+          ret.valid = false;
+        else
+          ret.chunkCount = static_cast<size_t>(count);
+      }
+      else if(std::strcmp("-s", argv[i]) == 0)
+      {
+        const int kilobytes = std::atoi(argv[++i]);
+        if(kilobytes <= 0)
+          ret.valid = false;
+        else
+          ret.chunkKb = static_cast<size_t>(kilobytes);
+      }
+      else
+        ret.valid = false;
+    }
+    return ret;
+  }();
+
+  if(!args.valid)
+  {
+    LOG << "Invalid parameters!";
+    usage();
+    return 0;
+  }
+
+  if(args.filename.empty())
+  {
+    LOG << "Missing -f parameter!";
+    usage();
+    return 0;
+  }
+  if(args.searchExtension.empty() || !args.searchExtension.starts_with('.'))
+  {
+    LOG << "Extension need to start wth a dot!";
+    usage();
+    return 0;
+  }
+
+  std::FILE *outputFile = std::fopen(std::string{args.filename}.c_str(), "wb");
+  if(!outputFile)
+  {
+    LOG << "Couldn't open " << args.filename << " for writing";
+    return 1;
+  }
+
+  FileGuard writeFileGuard{outputFile};
+
+  const PipelineConfig config{
+    .root = args.root,
+    .extension = args.searchExtension,
+    .outName = args.filename,
+    .walkThreads = args.walkThreads,
+    .hashThreads = args.hashThreads,
+    .readerCount = args.readerCount,
+    .chunkCount = args.chunkCount,
+    .chunkSize = args.chunkKb * KB,
+    .hugePages = args.hugePages
+  };
+
+  LOG << "Pipeline " << args.spec.traversal << ':' << args.spec.hashing << ':' << args.spec.buffering << ':' << args.spec.sink;
+  return dispatch(args.spec, *outputFile, config);
+}
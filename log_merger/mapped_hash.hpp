@@ -0,0 +1,196 @@
+/*
+*  MIT License
+*
+*  Copyright (c) 2025 Pawel Drzycimski
+*
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+*
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+*
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*
+*/
+
+#ifndef LOG_MERGER_MAPPED_HASH_HPP_
+#define LOG_MERGER_MAPPED_HASH_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <csetjmp>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+
+struct MappedHashStats
+{
+  std::atomic<uint64_t> files {0};
+  std::atomic<uint64_t> bytes {0};
+  std::atomic<uint64_t> fallbacks {0};
+};
+
+namespace mapped_hash_detail
+{
+  // file shrinking under the mapping raises SIGBUS, copying thread jumps back and reads instead
+  inline thread_local sigjmp_buf *t_busJump = nullptr;
+  inline struct sigaction g_previousBus {};
+
+  inline void onSigbus(int sig, siginfo_t *info, void *ctx)
+  {
+    if(t_busJump)
+      siglongjmp(*t_busJump, 1);
+
+    // not ours
+    if(g_previousBus.sa_flags & SA_SIGINFO)
+    {
+      g_previousBus.sa_sigaction(sig, info, ctx);
+      return;
+    }
+    if(g_previousBus.sa_handler != SIG_IGN && g_previousBus.sa_handler != SIG_DFL)
+    {
+      g_previousBus.sa_handler(sig);
+      return;
+    }
+
+    ::signal(sig, SIG_DFL);
+    ::raise(sig);
+  }
+
+  inline void installSigbusHandler()
+  {
+    static std::once_flag once;
+    std::call_once(once, [] {
+      struct sigaction action {};
+      action.sa_sigaction = &onSigbus;
+      action.sa_flags = SA_SIGINFO;
+      sigemptyset(&action.sa_mask);
+      ::sigaction(SIGBUS, &action, &g_previousBus);
+    });
+  }
+
+  /*
+   * Only memcpy runs where SIGBUS can jump out, it holds no locks or state,
+   * unlike EVP_DigestUpdate. False when pages under src are gone.
+   */
+  inline bool copyPages(uint8_t *dst, const uint8_t *src, size_t len)
+  {
+    // mask isn't saved, that would be a syscall per copy, SIGBUS is unblocked by hand after jump
+    sigjmp_buf jump;
+    if(sigsetjmp(jump, 0) != 0)
+    {
+      t_busJump = nullptr;
+      sigset_t bus;
+      sigemptyset(&bus);
+      sigaddset(&bus, SIGBUS);
+      ::pthread_sigmask(SIG_UNBLOCK, &bus, nullptr);
+      return false;
+    }
+
+    t_busJump = &jump;
+    std::memcpy(dst, src, len);
+    t_busJump = nullptr;
+    return true;
+  }
+}
+
+/*
+ * Digest of size bytes of fd through read only mapping, copied to a cache sized
+ * bounce buffer and fed to EVP_DigestUpdate from there, so a SIGBUS never has to
+ * unwind digest code. Kernel is told to read ahead sequentially and to prefetch
+ * next slice, pages already hashed are unmapped from our address space right away,
+ * so RSS stays at about one slice no matter how big the file is. Page cache keeps
+ * them for writers.
+ *
+ * nullopt when mapping is not possible or file shrunk meanwhile, caller reads instead.
+ */
+inline std::optional<std::vector<uint8_t>> hashMapped(int fd, uint64_t size, const EVP_MD *evpMd, MappedHashStats &stats)
+{
+  static constexpr size_t SLICE_SIZE = 8 * 1024 * 1024;
+  static constexpr size_t BOUNCE_SIZE = 256 * 1024;
+
+  if(size == 0)
+    return std::nullopt;
+
+  void *map = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  if(map == MAP_FAILED)
+  {
+    ++stats.fallbacks;
+    return std::nullopt;
+  }
+
+  std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx{ EVP_MD_CTX_new(), &EVP_MD_CTX_free };
+  std::unique_ptr<uint8_t[]> bounce{ new(std::nothrow) uint8_t[BOUNCE_SIZE] };
+  if(!ctx || !bounce || !EVP_DigestInit_ex(ctx.get(), evpMd, nullptr))
+  {
+    ::munmap(map, size);
+    return std::nullopt;
+  }
+
+  ::madvise(map, size, MADV_SEQUENTIAL);
+  ::posix_fadvise(fd, 0, static_cast<off_t>(std::min<uint64_t>(size, 2 * SLICE_SIZE)), POSIX_FADV_WILLNEED);
+
+  mapped_hash_detail::installSigbusHandler();
+
+  const auto *base = static_cast<const uint8_t*>(map);
+  bool ok = true;
+  for(uint64_t offset = 0; ok && offset < size; offset += SLICE_SIZE)
+  {
+    const size_t len = static_cast<size_t>(std::min<uint64_t>(SLICE_SIZE, size - offset));
+
+    // one slice ahead of what kernel is reading already
+    if(offset + len + SLICE_SIZE < size)
+      ::posix_fadvise(fd, static_cast<off_t>(offset + len + SLICE_SIZE), SLICE_SIZE, POSIX_FADV_WILLNEED);
+
+    for(size_t pos = 0; pos < len; pos += BOUNCE_SIZE)
+    {
+      const size_t chunk = std::min(BOUNCE_SIZE, len - pos);
+      ok = mapped_hash_detail::copyPages(bounce.get(), base + offset + pos, chunk);
+      if(!ok)
+        break;
+
+      EVP_DigestUpdate(ctx.get(), bounce.get(), chunk);
+    }
+    ::madvise(const_cast<uint8_t*>(base) + offset, len, MADV_DONTNEED);
+  }
+
+  ::munmap(map, size);
+
+  if(!ok)
+  {
+    ++stats.fallbacks;
+    return std::nullopt;
+  }
+
+  uint8_t mdbuf[EVP_MAX_MD_SIZE];
+  unsigned mdlen = 0;
+  if(!EVP_DigestFinal_ex(ctx.get(), mdbuf, &mdlen))
+    return std::nullopt;
+
+  ++stats.files;
+  stats.bytes += size;
+  return std::vector<uint8_t>(mdbuf, mdbuf + mdlen);
+}
+
+#endif
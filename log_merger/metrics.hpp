@@ -0,0 +1,480 @@
+/*
+*  MIT License
+*
+*  Copyright (c) 2025 Pawel Drzycimski
+*
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+*
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+*
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*
+*/
+
+#ifndef LOG_MERGER_METRICS_HPP_
+#define LOG_MERGER_METRICS_HPP_
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+enum class Metric : unsigned
+{
+  FilesScanned,
+  FilesHashed,
+  FilesUnique,
+  FilesDuplicate,
+  FilesWritten,
+  BytesHashed,
+  BytesWritten,
+  HashNs,
+  WriteNs,
+  HashWaitNs,
+  WriteWaitNs,
+  WriteLockWaitNs,
+  Count
+};
+
+inline constexpr size_t METRIC_COUNT = static_cast<size_t>(Metric::Count);
+
+struct MetricInfo
+{
+  std::string_view name;
+  std::string_view help;
+  // exported in seconds, counted in nanoseconds
+  bool nanoseconds;
+};
+
+inline constexpr MetricInfo METRIC_INFO[METRIC_COUNT] = {
+  {"log_merger_files_scanned_total", "Files matching extension found by traversal", false},
+  {"log_merger_files_hashed_total", "Files digested or taken from index", false},
+  {"log_merger_files_unique_total", "Files accepted for output", false},
+  {"log_merger_files_duplicate_total", "Files dropped as duplicates", false},
+  {"log_merger_files_written_total", "Files copied into output", false},
+  {"log_merger_bytes_hashed_total", "Bytes fed to digest", false},
+  {"log_merger_bytes_written_total", "Bytes copied into output", false},
+  {"log_merger_hash_seconds_total", "Time hash workers spent hashing", true},
+  {"log_merger_write_seconds_total", "Time writers spent copying", true},
+  {"log_merger_hash_wait_seconds_total", "Time hash workers waited for paths", true},
+  {"log_merger_write_wait_seconds_total", "Time writers waited for unique files", true},
+  {"log_merger_write_lock_wait_seconds_total", "Time writers waited for output lock", true}
+};
+
+using MetricsSnapshot = std::array<uint64_t, METRIC_COUNT>;
+
+/*
+ * Counters of every stage. Each thread bumps its own cache line with plain
+ * relaxed load and store, so the hot path has neither lock nor locked
+ * instruction, readers sum all lines. Threads beyond MAX_THREADS share
+ * last line and pay for fetch_add.
+ *
+ * Gauges (queue depths and the like) are read on demand through callbacks.
+ */
+class Metrics final
+{
+public:
+  static constexpr size_t MAX_THREADS = 256;
+
+  class alignas(64) Counters
+  {
+    friend class Metrics;
+
+    std::atomic<uint64_t> m_values[METRIC_COUNT] {};
+    bool m_shared {false};
+
+  public:
+    void add(Metric metric, uint64_t value = 1)
+    {
+      auto &counter = m_values[static_cast<size_t>(metric)];
+      if(m_shared)
+        counter.fetch_add(value, std::memory_order_relaxed);
+      else
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+  };
+
+  struct Gauge
+  {
+    std::string name;
+    std::string help;
+    std::function<uint64_t()> read;
+  };
+
+private:
+  std::unique_ptr<Counters[]> m_counters{ new Counters[MAX_THREADS] };
+  std::atomic<size_t> m_claimed {0};
+
+  std::vector<Gauge> m_gauges;
+  mutable std::mutex m_gaugesMutex;
+
+  static inline thread_local const Metrics *t_owner = nullptr;
+  static inline thread_local Counters *t_counters = nullptr;
+
+public:
+  Metrics()
+  {
+    m_counters[MAX_THREADS - 1].m_shared = true;
+  }
+
+  Metrics(const Metrics&) = delete;
+  Metrics(Metrics&&) = delete;
+
+  /*
+   * Counters of calling thread, first call claims them
+   */
+  Counters &local()
+  {
+    if(t_owner != this)
+    {
+      const size_t idx = m_claimed.fetch_add(1, std::memory_order_relaxed);
+      t_counters = &m_counters[std::min(idx, MAX_THREADS - 1)];
+      t_owner = this;
+    }
+
+    return *t_counters;
+  }
+
+  void add(Metric metric, uint64_t value = 1)
+  {
+    local().add(metric, value);
+  }
+
+  void addGauge(std::string name, std::string help, std::function<uint64_t()> read)
+  {
+    std::lock_guard lock(m_gaugesMutex);
+    m_gauges.push_back(Gauge{ std::move(name), std::move(help), std::move(read) });
+  }
+
+  MetricsSnapshot snapshot() const
+  {
+    MetricsSnapshot ret {};
+    const size_t used = std::min(m_claimed.load(std::memory_order_relaxed), MAX_THREADS);
+    for(size_t i = 0; i < used; ++i)
+    {
+      for(size_t m = 0; m < METRIC_COUNT; ++m)
+        ret[m] += m_counters[i].m_values[m].load(std::memory_order_relaxed);
+    }
+
+    return ret;
+  }
+
+  uint64_t gauge(std::string_view name) const
+  {
+    std::lock_guard lock(m_gaugesMutex);
+    for(const auto &gauge : m_gauges)
+    {
+      if(gauge.name == name)
+        return gauge.read();
+    }
+
+    return 0;
+  }
+
+  /*
+   * Prometheus text exposition format 0.0.4
+   */
+  std::string prometheusText() const
+  {
+    const MetricsSnapshot values = snapshot();
+    std::string ret;
+    char line[128];
+    for(size_t m = 0; m < METRIC_COUNT; ++m)
+    {
+      const MetricInfo &info = METRIC_INFO[m];
+      appendHeader(ret, info.name, info.help, "counter");
+      if(info.nanoseconds)
+        std::snprintf(line, sizeof(line), " %.9f\n", static_cast<double>(values[m]) / 1e9);
+      else
+        std::snprintf(line, sizeof(line), " %llu\n", static_cast<unsigned long long>(values[m]));
+      ret += info.name;
+      ret += line;
+    }
+
+    std::lock_guard lock(m_gaugesMutex);
+    for(const auto &gauge : m_gauges)
+    {
+      appendHeader(ret, gauge.name, gauge.help, "gauge");
+      std::snprintf(line, sizeof(line), " %llu\n", static_cast<unsigned long long>(gauge.read()));
+      ret += gauge.name;
+      ret += line;
+    }
+
+    return ret;
+  }
+
+private:
+  static void appendHeader(std::string &out, std::string_view name, std::string_view help, std::string_view type)
+  {
+    out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+    out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+  }
+};
+
+/*
+ * Nanoseconds since start, for Metric::*Ns counters
+ */
+template<typename TimePoint>
+inline uint64_t elapsedNs(const TimePoint &start)
+{
+  return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(TimePoint::clock::now() - start).count());
+}
+
+/*
+ * Thread which every interval hands a progress line to onProgress and
+ * rewrites export file (through rename, so scrapers never see half of it).
+ * Export path "unix:<path>" instead serves current metrics to every client
+ * connecting to that socket, as HTTP/1.0 response so curl --unix-socket works.
+ *
+ * Final progress line and export are done in stop().
+ */
+class MetricsReporter final
+{
+  Metrics &m_metrics;
+  const std::chrono::milliseconds m_interval;
+  std::function<void(const std::string&)> m_onProgress;
+  std::string m_exportPath;
+  std::string m_socketPath;
+
+  int m_listenFd {-1};
+  int m_wakeFds[2] {-1, -1};
+  std::jthread m_thread;
+
+  std::chrono::steady_clock::time_point m_start;
+  std::chrono::steady_clock::time_point m_lastTick;
+  MetricsSnapshot m_last {};
+
+public:
+  /*
+   * interval 0 disables progress lines, export file is then written only at the end
+   */
+  MetricsReporter(Metrics &metrics, std::chrono::milliseconds interval, std::function<void(const std::string&)> onProgress, std::string exportPath)
+    : m_metrics{metrics}, m_interval{interval}, m_onProgress{std::move(onProgress)}
+  {
+    static constexpr std::string_view UNIX_PREFIX = "unix:";
+    if(std::string_view{exportPath}.starts_with(UNIX_PREFIX))
+      m_socketPath = exportPath.substr(UNIX_PREFIX.size());
+    else
+      m_exportPath = std::move(exportPath);
+  }
+
+  MetricsReporter(const MetricsReporter&) = delete;
+  MetricsReporter(MetricsReporter&&) = delete;
+
+  ~MetricsReporter()
+  {
+    stop();
+    if(m_listenFd >= 0)
+    {
+      ::close(m_listenFd);
+      ::unlink(m_socketPath.c_str());
+    }
+    for(const int fd : m_wakeFds)
+    {
+      if(fd >= 0)
+        ::close(fd);
+    }
+  }
+
+  /*
+   * Returns 0 or errno
+   */
+  int start()
+  {
+    m_start = m_lastTick = std::chrono::steady_clock::now();
+    if(::pipe2(m_wakeFds, O_CLOEXEC | O_NONBLOCK) != 0)
+      return errno;
+
+    if(!m_socketPath.empty())
+    {
+      if(const int err = listenUnix())
+        return err;
+    }
+
+    m_thread = std::jthread([this]{ loop(); });
+    return 0;
+  }
+
+  void stop()
+  {
+    if(!m_thread.joinable())
+      return;
+
+    const char wake = 1;
+    [[maybe_unused]] const ssize_t ret = ::write(m_wakeFds[1], &wake, 1);
+    m_thread.join();
+
+    if(m_interval.count())
+      tick();
+    writeExport();
+  }
+
+private:
+  int listenUnix()
+  {
+    sockaddr_un addr {};
+    if(m_socketPath.size() >= sizeof(addr.sun_path))
+      return ENAMETOOLONG;
+
+    m_listenFd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if(m_listenFd < 0)
+      return errno;
+
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, m_socketPath.data(), m_socketPath.size());
+    // stale socket of previous run, anything else at that path is not ours to remove
+    struct stat st;
+    if(::lstat(m_socketPath.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+      ::unlink(m_socketPath.c_str());
+    if(::bind(m_listenFd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(m_listenFd, 8) != 0)
+    {
+      const int err = errno;
+      ::close(m_listenFd);
+      m_listenFd = -1;
+      return err;
+    }
+
+    return 0;
+  }
+
+  void loop()
+  {
+    auto next = m_start + m_interval;
+    while(true)
+    {
+      int timeout = -1;
+      if(m_interval.count())
+      {
+        const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(next - std::chrono::steady_clock::now());
+        timeout = static_cast<int>(std::max<int64_t>(0, left.count()));
+      }
+
+      pollfd fds[2] = {{m_wakeFds[0], POLLIN, 0}, {m_listenFd, POLLIN, 0}};
+      const int ready = ::poll(fds, m_listenFd >= 0 ? 2 : 1, timeout);
+      if(ready < 0 && errno != EINTR)
+        break;
+      if(fds[0].revents)
+        break;
+      if(fds[1].revents)
+        serveClient();
+
+      if(m_interval.count() && std::chrono::steady_clock::now() >= next)
+      {
+        tick();
+        writeExport();
+        next += m_interval;
+      }
+    }
+  }
+
+  void tick()
+  {
+    const auto now = std::chrono::steady_clock::now();
+    const double seconds = std::chrono::duration<double>(now - m_lastTick).count();
+    const MetricsSnapshot values = m_metrics.snapshot();
+    const auto at = [&values](Metric m) { return values[static_cast<size_t>(m)]; };
+    const auto rate = [&](Metric m) {
+      const uint64_t delta = at(m) - m_last[static_cast<size_t>(m)];
+      return seconds > 0 ? static_cast<double>(delta) / (1024.0 * 1024.0) / seconds : 0.0;
+    };
+
+    char line[512];
+    std::snprintf(line, sizeof(line),
+        "Progress %.1fs: scanned %llu, hashed %llu (%.1f MB/s), unique %llu, duplicates %llu, written %llu (%.1f MB/s), queues hash %llu write %llu",
+        std::chrono::duration<double>(now - m_start).count(),
+        static_cast<unsigned long long>(at(Metric::FilesScanned)),
+        static_cast<unsigned long long>(at(Metric::FilesHashed)), rate(Metric::BytesHashed),
+        static_cast<unsigned long long>(at(Metric::FilesUnique)),
+        static_cast<unsigned long long>(at(Metric::FilesDuplicate)),
+        static_cast<unsigned long long>(at(Metric::FilesWritten)), rate(Metric::BytesWritten),
+        static_cast<unsigned long long>(m_metrics.gauge("log_merger_hash_queue_depth")),
+        static_cast<unsigned long long>(m_metrics.gauge("log_merger_write_queue_depth")));
+
+    m_last = values;
+    m_lastTick = now;
+    if(m_onProgress)
+      m_onProgress(line);
+  }
+
+  void writeExport() const
+  {
+    if(m_exportPath.empty())
+      return;
+
+    const std::string tmpPath = m_exportPath + ".tmp";
+    std::FILE *out = std::fopen(tmpPath.c_str(), "w");
+    if(!out)
+      return;
+
+    const std::string text = m_metrics.prometheusText();
+    const bool ok = std::fwrite(text.data(), 1, text.size(), out) == text.size();
+    if(std::fclose(out) == 0 && ok)
+      std::rename(tmpPath.c_str(), m_exportPath.c_str());
+    else
+      std::remove(tmpPath.c_str());
+  }
+
+  void serveClient() const
+  {
+    const int fd = ::accept4(m_listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+    if(fd < 0)
+      return;
+
+    // whatever client asked for it gets metrics, request is read only so it's not reset
+    pollfd pfd{fd, POLLIN, 0};
+    char request[1024];
+    if(::poll(&pfd, 1, 100) > 0)
+    {
+      [[maybe_unused]] const ssize_t got = ::recv(fd, request, sizeof(request), MSG_DONTWAIT);
+    }
+
+    const std::string body = m_metrics.prometheusText();
+    std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+                         + std::to_string(body.size()) + "\r\n\r\n" + body;
+
+    size_t sent = 0;
+    while(sent < response.size())
+    {
+      const ssize_t ret = ::send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+      if(ret < 0 && errno == EINTR)
+        continue;
+      if(ret <= 0)
+        break;
+      sent += static_cast<size_t>(ret);
+    }
+
+    ::close(fd);
+  }
+};
+
+#endif
@@ -0,0 +1,358 @@
+/*
+*  MIT License
+*
+*  Copyright (c) 2025 Pawel Drzycimski
+*
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+*
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+*
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*
+*/
+
+#ifndef LOG_MERGER_MPMC_QUEUE_HPP_
+#define LOG_MERGER_MPMC_QUEUE_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <type_traits>
+
+inline void cpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#else
+  std::this_thread::yield();
+#endif
+}
+
+struct QueueStats
+{
+  uint64_t pushes {0};
+  uint64_t maxDepth {0};
+  uint64_t pushParks {0};
+  uint64_t popParks {0};
+};
+
+/*
+ * Bounded multi producer multi consumer ring, Dmitry Vyukov's design.
+ *
+ * Blocking push/pop spin first and park on futex (std::atomic::wait) only
+ * when spinning didn't help, waking side makes syscall only when someone
+ * actually sleeps. Spin budget grows when spinning pays off and shrinks
+ * when it ends up parking anyway.
+ */
+template<typename T>
+class MpmcQueue final
+{
+  static_assert(std::is_trivially_copyable_v<T>, "Queue carries handles, not objects");
+
+  static constexpr unsigned MIN_SPIN = 16;
+  static constexpr unsigned MAX_SPIN = 4096;
+
+  struct Cell
+  {
+    std::atomic<size_t> seq;
+    T data;
+  };
+
+  const size_t m_mask;
+  std::unique_ptr<Cell[]> m_cells;
+
+  alignas(64) std::atomic<size_t> m_enqueuePos{0};
+  alignas(64) std::atomic<size_t> m_dequeuePos{0};
+
+  alignas(64) std::atomic<uint32_t> m_notEmptySeq{0};
+  std::atomic<uint32_t> m_popWaiters{0};
+  std::atomic<uint32_t> m_notFullSeq{0};
+  std::atomic<uint32_t> m_pushWaiters{0};
+  std::atomic<unsigned> m_spinBudget{256};
+  std::atomic_bool m_closed{false};
+
+  // stats
+  alignas(64) std::atomic<uint64_t> m_pushes{0};
+  std::atomic<uint64_t> m_maxDepth{0};
+  std::atomic<uint64_t> m_pushParks{0};
+  std::atomic<uint64_t> m_popParks{0};
+
+public:
+  explicit MpmcQueue(size_t capacity)
+    : m_mask{std::bit_ceil(std::max<size_t>(capacity, 2)) - 1},
+      m_cells{new Cell[m_mask + 1]}
+  {
+    for(size_t i = 0; i <= m_mask; ++i)
+      m_cells[i].seq.store(i, std::memory_order_relaxed);
+  }
+
+  MpmcQueue(const MpmcQueue&) = delete;
+  MpmcQueue(MpmcQueue&&) = delete;
+
+  bool tryPush(const T &value)
+  {
+    if(!enqueue(value))
+      return false;
+
+    afterPush();
+    return true;
+  }
+
+  bool tryPop(T &value)
+  {
+    if(!dequeue(value))
+      return false;
+
+    afterPop();
+    return true;
+  }
+
+  /*
+   * Blocks while queue is full, returns false when it got closed meanwhile
+   */
+  bool push(const T &value)
+  {
+    if(!enqueue(value) && !waitPush(value))
+      return false;
+
+    afterPush();
+    return true;
+  }
+
+  /*
+   * Blocks while queue is empty, returns false once it's closed and drained
+   */
+  bool pop(T &value)
+  {
+    if(!dequeue(value) && !waitPop(value))
+      return false;
+
+    afterPop();
+    return true;
+  }
+
+  /*
+   * Blocks for first item, then takes whatever else is ready up to maxCount.
+   * Returns 0 once queue is closed and drained.
+   */
+  size_t popBatch(T *values, size_t maxCount)
+  {
+    if(maxCount == 0 || !pop(values[0]))
+      return 0;
+
+    size_t count = 1;
+    while(count < maxCount && tryPop(values[count]))
+      ++count;
+
+    return count;
+  }
+
+  /*
+   * No more pushes, consumers drain what's left and leave
+   */
+  void close()
+  {
+    m_closed.store(true, std::memory_order_seq_cst);
+    m_notEmptySeq.fetch_add(1, std::memory_order_seq_cst);
+    m_notEmptySeq.notify_all();
+    m_notFullSeq.fetch_add(1, std::memory_order_seq_cst);
+    m_notFullSeq.notify_all();
+  }
+
+  size_t depth() const
+  {
+    const size_t enq = m_enqueuePos.load(std::memory_order_relaxed);
+    const size_t deq = m_dequeuePos.load(std::memory_order_relaxed);
+    return enq > deq ? enq - deq : 0;
+  }
+
+  size_t capacity() const { return m_mask + 1; }
+
+  QueueStats stats() const
+  {
+    return QueueStats{
+      .pushes = m_pushes.load(std::memory_order_relaxed),
+      .maxDepth = m_maxDepth.load(std::memory_order_relaxed),
+      .pushParks = m_pushParks.load(std::memory_order_relaxed),
+      .popParks = m_popParks.load(std::memory_order_relaxed)
+    };
+  }
+
+private:
+  bool enqueue(const T &value)
+  {
+    Cell *cell;
+    size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+    while(true)
+    {
+      cell = &m_cells[pos & m_mask];
+      const size_t seq = cell->seq.load(std::memory_order_acquire);
+      const auto dif = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+      if(dif == 0)
+      {
+        if(m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      }
+      else if(dif < 0)
+      {
+        return false;
+      }
+      else
+      {
+        pos = m_enqueuePos.load(std::memory_order_relaxed);
+      }
+    }
+
+    cell->data = value;
+    cell->seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool dequeue(T &value)
+  {
+    Cell *cell;
+    size_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+    while(true)
+    {
+      cell = &m_cells[pos & m_mask];
+      const size_t seq = cell->seq.load(std::memory_order_acquire);
+      const auto dif = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+      if(dif == 0)
+      {
+        if(m_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      }
+      else if(dif < 0)
+      {
+        return false;
+      }
+      else
+      {
+        pos = m_dequeuePos.load(std::memory_order_relaxed);
+      }
+    }
+
+    value = cell->data;
+    cell->seq.store(pos + m_mask + 1, std::memory_order_release);
+    return true;
+  }
+
+  void adaptSpin(bool spinningHelped)
+  {
+    const unsigned budget = m_spinBudget.load(std::memory_order_relaxed);
+    m_spinBudget.store(spinningHelped ? std::min(budget * 2, MAX_SPIN) : std::max(budget / 2, MIN_SPIN), std::memory_order_relaxed);
+  }
+
+  void afterPush()
+  {
+    m_pushes.fetch_add(1, std::memory_order_relaxed);
+
+    const uint64_t curDepth = depth();
+    uint64_t maxDepth = m_maxDepth.load(std::memory_order_relaxed);
+    while(curDepth > maxDepth && !m_maxDepth.compare_exchange_weak(maxDepth, curDepth, std::memory_order_relaxed));
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(m_popWaiters.load(std::memory_order_relaxed))
+    {
+      m_notEmptySeq.fetch_add(1, std::memory_order_relaxed);
+      m_notEmptySeq.notify_one();
+    }
+  }
+
+  void afterPop()
+  {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(m_pushWaiters.load(std::memory_order_relaxed))
+    {
+      m_notFullSeq.fetch_add(1, std::memory_order_relaxed);
+      m_notFullSeq.notify_one();
+    }
+  }
+
+  bool waitPush(const T &value)
+  {
+    const unsigned budget = m_spinBudget.load(std::memory_order_relaxed);
+    for(unsigned spin = 0; spin < budget; ++spin)
+    {
+      cpuRelax();
+      if(enqueue(value))
+      {
+        adaptSpin(true);
+        return true;
+      }
+    }
+    adaptSpin(false);
+
+    while(true)
+    {
+      const uint32_t seq = m_notFullSeq.load(std::memory_order_acquire);
+      m_pushWaiters.fetch_add(1, std::memory_order_seq_cst);
+      const bool pushed = enqueue(value);
+      if(!pushed && !m_closed.load(std::memory_order_seq_cst))
+      {
+        m_pushParks.fetch_add(1, std::memory_order_relaxed);
+        m_notFullSeq.wait(seq, std::memory_order_acquire);
+      }
+      m_pushWaiters.fetch_sub(1, std::memory_order_relaxed);
+
+      if(pushed || enqueue(value))
+        return true;
+
+      // nobody is going to drain it anymore
+      if(m_closed.load(std::memory_order_acquire))
+        return false;
+    }
+  }
+
+  bool waitPop(T &value)
+  {
+    const unsigned budget = m_spinBudget.load(std::memory_order_relaxed);
+    for(unsigned spin = 0; spin < budget; ++spin)
+    {
+      cpuRelax();
+      if(dequeue(value))
+      {
+        adaptSpin(true);
+        return true;
+      }
+    }
+    adaptSpin(false);
+
+    while(true)
+    {
+      const uint32_t seq = m_notEmptySeq.load(std::memory_order_acquire);
+      m_popWaiters.fetch_add(1, std::memory_order_seq_cst);
+      bool popped = dequeue(value);
+      if(!popped && !m_closed.load(std::memory_order_seq_cst))
+      {
+        m_popParks.fetch_add(1, std::memory_order_relaxed);
+        m_notEmptySeq.wait(seq, std::memory_order_acquire);
+      }
+      m_popWaiters.fetch_sub(1, std::memory_order_relaxed);
+
+      if(popped || dequeue(value))
+        return true;
+
+      if(m_closed.load(std::memory_order_acquire))
+        return dequeue(value);
+    }
+  }
+};
+
+#endif
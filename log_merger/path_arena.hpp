@@ -0,0 +1,152 @@
+/*
+*  MIT License
+*
+*  Copyright (c) 2025 Pawel Drzycimski
+*
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+*
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+*
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*
+*/
+
+#ifndef LOG_MERGER_PATH_ARENA_HPP_
+#define LOG_MERGER_PATH_ARENA_HPP_
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string_view>
+
+using PathHandle = uint64_t;
+
+/*
+ * Append only, lock free storage for paths.
+ *
+ * Handle packs 48 bit offset and 16 bit length, so it can travel through
+ * queues instead of std::string. Chunks never move, views stay valid
+ * as long as arena lives. Every path is NUL terminated for open().
+ *
+ * Memory grows with real path volume: chunks and blocks of chunk table
+ * are allocated on first use.
+ */
+class PathArena final
+{
+public:
+  static constexpr size_t CHUNK_SIZE = 1024 * 1024;
+  static constexpr PathHandle INVALID_HANDLE = ~PathHandle{0};
+
+private:
+  static constexpr unsigned LEN_BITS = 16;
+  static constexpr uint64_t LEN_MASK = (uint64_t{1} << LEN_BITS) - 1;
+
+  // two level chunk table, 1024 * 1024 chunks of 1MB each
+  static constexpr size_t TABLE_BLOCK = 1024;
+  static constexpr size_t MAX_CHUNKS = TABLE_BLOCK * TABLE_BLOCK;
+
+  using ChunkBlock = std::atomic<char*>[TABLE_BLOCK];
+
+  std::atomic<uint64_t> m_pos{0};
+  std::atomic<ChunkBlock*> m_table[TABLE_BLOCK] = {};
+
+public:
+  PathArena() = default;
+  PathArena(const PathArena&) = delete;
+  PathArena(PathArena&&) = delete;
+
+  ~PathArena()
+  {
+    for(auto &entry : m_table)
+    {
+      ChunkBlock *block = entry.load(std::memory_order_relaxed);
+      if(!block)
+        continue;
+
+      for(auto &chunk : *block)
+        delete[] chunk.load(std::memory_order_relaxed);
+      delete[] block;
+    }
+  }
+
+  /*
+   * Returns INVALID_HANDLE when path is longer than 64KB or arena is full
+   */
+  PathHandle append(std::string_view str)
+  {
+    const size_t need = str.size() + 1;
+    if(str.size() > LEN_MASK || need > CHUNK_SIZE)
+      return INVALID_HANDLE;
+
+    while(true)
+    {
+      const uint64_t pos = m_pos.fetch_add(need, std::memory_order_relaxed);
+      const size_t chunk = pos / CHUNK_SIZE;
+      const size_t offset = pos % CHUNK_SIZE;
+      if(chunk >= MAX_CHUNKS)
+        return INVALID_HANDLE;
+
+      // doesn't fit, tail of this chunk is wasted and next one is used
+      if(offset + need > CHUNK_SIZE)
+        continue;
+
+      char *base = chunkAt(chunk);
+      std::memcpy(base + offset, str.data(), str.size());
+      base[offset + str.size()] = '\0';
+
+      return (pos << LEN_BITS) | str.size();
+    }
+  }
+
+  /*
+   * Requires valid handle, view is NUL terminated
+   */
+  std::string_view get(PathHandle handle) const
+  {
+    const uint64_t pos = handle >> LEN_BITS;
+    const size_t chunk = pos / CHUNK_SIZE;
+    const ChunkBlock *block = m_table[chunk / TABLE_BLOCK].load(std::memory_order_acquire);
+    const char *base = (*block)[chunk % TABLE_BLOCK].load(std::memory_order_acquire);
+    return std::string_view{ base + pos % CHUNK_SIZE, static_cast<size_t>(handle & LEN_MASK) };
+  }
+
+  uint64_t bytesUsed() const { return m_pos.load(std::memory_order_relaxed); }
+
+private:
+  template<typename T, typename Alloc>
+  static T *getOrCreate(std::atomic<T*> &slot, Alloc &&alloc)
+  {
+    T *ptr = slot.load(std::memory_order_acquire);
+    if(ptr)
+      return ptr;
+
+    T *fresh = alloc();
+    if(slot.compare_exchange_strong(ptr, fresh, std::memory_order_acq_rel))
+      return fresh;
+
+    // someone else was faster
+    delete[] fresh;
+    return ptr;
+  }
+
+  char *chunkAt(size_t idx)
+  {
+    ChunkBlock *block = getOrCreate(m_table[idx / TABLE_BLOCK], [] { return new ChunkBlock[1](); });
+    return getOrCreate((*block)[idx % TABLE_BLOCK], [] { return new char[CHUNK_SIZE]; });
+  }
+};
+
+#endif
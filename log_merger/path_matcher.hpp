@@ -0,0 +1,706 @@
+/*
+*  MIT License
+*
+*  Copyright (c) 2025 Pawel Drzycimski
+*
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+*
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+*
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*
+*/
+
+#ifndef LOG_MERGER_PATH_MATCHER_HPP_
+#define LOG_MERGER_PATH_MATCHER_HPP_
+
+#include <algorithm>
+#include <bitset>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+using ByteClass = std::bitset<256>;
+
+/*
+ * Set of name suffixes (extensions), looked up by walking name backwards,
+ * so cost depends on the name, not on how many extensions there are.
+ * Suffix has to be shorter than name, ".log" alone doesn't match ".log".
+ */
+class SuffixTrie final
+{
+  struct Node
+  {
+    std::vector<std::pair<uint8_t, uint32_t>> children;
+    bool terminal {false};
+  };
+
+  std::vector<Node> m_nodes{1};
+
+public:
+  void insert(std::string_view suffix)
+  {
+    uint32_t node = 0;
+    for(auto it = suffix.rbegin(); it != suffix.rend(); ++it)
+    {
+      const auto byte = static_cast<uint8_t>(*it);
+      const uint32_t next = child(node, byte);
+      if(next)
+      {
+        node = next;
+        continue;
+      }
+
+      m_nodes.emplace_back();
+      const auto created = static_cast<uint32_t>(m_nodes.size() - 1);
+      m_nodes[node].children.emplace_back(byte, created);
+      node = created;
+    }
+    m_nodes[node].terminal = true;
+  }
+
+  bool empty() const { return m_nodes.size() == 1; }
+
+  bool matches(std::string_view name) const
+  {
+    uint32_t node = 0;
+    for(size_t i = name.size(); i > 0; --i)
+    {
+      node = child(node, static_cast<uint8_t>(name[i - 1]));
+      if(!node)
+        return false;
+      if(m_nodes[node].terminal && i > 1)
+        return true;
+    }
+
+    return false;
+  }
+
+private:
+  uint32_t child(uint32_t node, uint8_t byte) const
+  {
+    for(const auto &[edge, next] : m_nodes[node].children)
+    {
+      if(edge == byte)
+        return next;
+    }
+
+    return 0;
+  }
+};
+
+namespace path_matcher_detail
+{
+  /*
+   * "[...]" at pattern[pos], pos is moved past it. Ranges, leading ! or ^
+   * negation and ] right after opening bracket as literal. nullopt when not closed.
+   */
+  inline std::optional<ByteClass> parseClass(std::string_view pattern, size_t &pos)
+  {
+    size_t i = pos + 1;
+    bool negate = false;
+    if(i < pattern.size() && (pattern[i] == '!' || pattern[i] == '^'))
+    {
+      negate = true;
+      ++i;
+    }
+
+    ByteClass ret;
+    bool first = true;
+    for(; i < pattern.size() && (first || pattern[i] != ']'); ++i, first = false)
+    {
+      auto low = static_cast<uint8_t>(pattern[i]);
+      if(low == '\\' && i + 1 < pattern.size())
+        low = static_cast<uint8_t>(pattern[++i]);
+
+      auto high = low;
+      if(i + 2 < pattern.size() && pattern[i + 1] == '-' && pattern[i + 2] != ']')
+      {
+        high = static_cast<uint8_t>(pattern[i + 2]);
+        i += 2;
+      }
+      for(unsigned ch = low; ch <= high; ++ch)
+        ret.set(ch);
+    }
+
+    if(i >= pattern.size())
+      return std::nullopt;
+
+    pos = i + 1;
+    return negate ? ~ret : ret;
+  }
+}
+
+/*
+ * Shell style pattern: * any run of bytes, ? any byte, [...] class, \ escapes.
+ * Like fnmatch without FNM_PATHNAME, * crosses '/' as well.
+ */
+class Glob final
+{
+  enum class Op : uint8_t
+  {
+    Literal,
+    AnyByte,
+    Class,
+    Star
+  };
+
+  struct Token
+  {
+    Op op;
+    uint8_t byte;
+    uint16_t classIdx;
+  };
+
+  std::vector<Token> m_tokens;
+  std::vector<ByteClass> m_classes;
+
+public:
+  explicit Glob(std::string_view pattern)
+  {
+    for(size_t i = 0; i < pattern.size();)
+    {
+      const char ch = pattern[i];
+      if(ch == '*')
+      {
+        // runs of stars are one star
+        if(m_tokens.empty() || m_tokens.back().op != Op::Star)
+          m_tokens.push_back(Token{ Op::Star, 0, 0 });
+        ++i;
+      }
+      else if(ch == '?')
+      {
+        m_tokens.push_back(Token{ Op::AnyByte, 0, 0 });
+        ++i;
+      }
+      else if(ch == '[')
+      {
+        size_t pos = i;
+        if(auto cls = path_matcher_detail::parseClass(pattern, pos))
+        {
+          m_classes.push_back(*cls);
+          m_tokens.push_back(Token{ Op::Class, 0, static_cast<uint16_t>(m_classes.size() - 1) });
+          i = pos;
+        }
+        else
+        {
+          // unclosed bracket is just a bracket
+          m_tokens.push_back(Token{ Op::Literal, '[', 0 });
+          ++i;
+        }
+      }
+      else
+      {
+        if(ch == '\\' && i + 1 < pattern.size())
+          ++i;
+        m_tokens.push_back(Token{ Op::Literal, static_cast<uint8_t>(pattern[i]), 0 });
+        ++i;
+      }
+    }
+  }
+
+  /*
+   * Whole text has to match, backtracks only to the last star
+   */
+  bool matches(std::string_view text) const
+  {
+    size_t tok = 0;
+    size_t pos = 0;
+    size_t starTok = SIZE_MAX;
+    size_t starPos = 0;
+    while(pos < text.size())
+    {
+      if(tok < m_tokens.size())
+      {
+        const Token &token = m_tokens[tok];
+        const auto byte = static_cast<uint8_t>(text[pos]);
+        if(token.op == Op::Star)
+        {
+          starTok = ++tok;
+          starPos = pos;
+          continue;
+        }
+        if((token.op == Op::AnyByte)
+            || (token.op == Op::Literal && token.byte == byte)
+            || (token.op == Op::Class && m_classes[token.classIdx].test(byte)))
+        {
+          ++tok;
+          ++pos;
+          continue;
+        }
+      }
+
+      if(starTok == SIZE_MAX)
+        return false;
+      tok = starTok;
+      pos = ++starPos;
+    }
+
+    while(tok < m_tokens.size() && m_tokens[tok].op == Op::Star)
+      ++tok;
+    return tok == m_tokens.size();
+  }
+};
+
+/*
+ * Regular expression compiled to Thompson NFA and simulated state set by
+ * state set, so time is linear in text length. State lists live in caller's
+ * Scratch, sized to the NFA once and reused by every later search, nothing is
+ * allocated per match. Unanchored search like grep, supports literals, ., [...],
+ * \d \w \s \D \W \S, escapes, ^ $, groups, | and * + ? quantifiers.
+ * No backreferences and no counted repetition.
+ */
+class Regex final
+{
+  static constexpr size_t MAX_STATES = 1024;
+
+  enum class Op : uint8_t
+  {
+    Byte,
+    Any,
+    Class,
+    Split,
+    Epsilon,
+    LineStart,
+    LineEnd,
+    Match
+  };
+
+  struct State
+  {
+    Op op;
+    uint8_t byte {0};
+    uint16_t classIdx {0};
+    int out {-1};
+    int out1 {-1};
+  };
+
+  // piece of NFA with single entry and single exit, exit's out is patched later
+  struct Fragment
+  {
+    int start;
+    int end;
+  };
+
+  std::vector<State> m_states;
+  std::vector<ByteClass> m_classes;
+  int m_start {-1};
+
+  using StateSet = std::bitset<MAX_STATES>;
+
+public:
+  /*
+   * Working memory of search, one per thread, grows to the largest NFA it's used with
+   */
+  struct Scratch
+  {
+    StateSet seen;
+    std::vector<uint16_t> current;
+    std::vector<uint16_t> next;
+    std::vector<int> stack;
+  };
+
+  static std::optional<Regex> compile(std::string_view pattern)
+  {
+    Regex ret;
+    size_t pos = 0;
+    const auto fragment = ret.parseAlternation(pattern, pos);
+    if(!fragment || pos != pattern.size() || ret.m_states.size() + 1 > MAX_STATES)
+      return std::nullopt;
+
+    const int match = ret.add(State{ .op = Op::Match });
+    ret.m_states[fragment->end].out = match;
+    ret.m_start = fragment->start;
+    return ret;
+  }
+
+  bool search(std::string_view text, Scratch &scratch) const
+  {
+    // every state is expanded once and pushes at most two more
+    if(scratch.current.size() < m_states.size())
+    {
+      scratch.current.resize(m_states.size());
+      scratch.next.resize(m_states.size());
+      scratch.stack.resize(2 * m_states.size() + 1);
+    }
+
+    StateSet &seen = scratch.seen;
+    seen.reset();
+    uint16_t *current = scratch.current.data();
+    uint16_t *next = scratch.next.data();
+    int *stack = scratch.stack.data();
+    size_t currentCount = 0;
+
+    for(size_t pos = 0; ; ++pos)
+    {
+      // unanchored, a match may start at every position
+      if(addClosure(m_start, pos, text.size(), seen, stack, current, currentCount))
+        return true;
+
+      if(pos == text.size() || currentCount == 0)
+      {
+        if(pos == text.size())
+          return false;
+        seen.reset();
+        continue;
+      }
+
+      const auto byte = static_cast<uint8_t>(text[pos]);
+      seen.reset();
+      size_t nextCount = 0;
+      for(size_t i = 0; i < currentCount; ++i)
+      {
+        const State &state = m_states[current[i]];
+        const bool step = state.op == Op::Any
+            || (state.op == Op::Byte && state.byte == byte)
+            || (state.op == Op::Class && m_classes[state.classIdx].test(byte));
+        if(step && addClosure(state.out, pos + 1, text.size(), seen, stack, next, nextCount))
+          return true;
+      }
+
+      std::swap(current, next);
+      currentCount = nextCount;
+    }
+  }
+
+private:
+  int add(State state)
+  {
+    m_states.push_back(state);
+    return static_cast<int>(m_states.size() - 1);
+  }
+
+  Fragment single(State state)
+  {
+    const int start = add(state);
+    const int end = add(State{ .op = Op::Epsilon });
+    m_states[start].out = end;
+    return Fragment{ start, end };
+  }
+
+  std::optional<Fragment> parseAlternation(std::string_view pattern, size_t &pos)
+  {
+    auto left = parseConcatenation(pattern, pos);
+    while(left && pos < pattern.size() && pattern[pos] == '|')
+    {
+      ++pos;
+      const auto right = parseConcatenation(pattern, pos);
+      if(!right)
+        return std::nullopt;
+
+      const int split = add(State{ .op = Op::Split, .out = left->start, .out1 = right->start });
+      const int end = add(State{ .op = Op::Epsilon });
+      m_states[left->end].out = end;
+      m_states[right->end].out = end;
+      left = Fragment{ split, end };
+    }
+
+    return left;
+  }
+
+  std::optional<Fragment> parseConcatenation(std::string_view pattern, size_t &pos)
+  {
+    std::optional<Fragment> ret;
+    while(pos < pattern.size() && pattern[pos] != '|' && pattern[pos] != ')')
+    {
+      auto atom = parseAtom(pattern, pos);
+      if(!atom)
+        return std::nullopt;
+
+      atom = parseQuantifier(pattern, pos, *atom);
+      if(ret)
+      {
+        m_states[ret->end].out = atom->start;
+        ret->end = atom->end;
+      }
+      else
+      {
+        ret = atom;
+      }
+    }
+
+    if(!ret)
+    {
+      // empty branch matches empty string
+      const int eps = add(State{ .op = Op::Epsilon });
+      ret = Fragment{ eps, eps };
+    }
+    return ret;
+  }
+
+  Fragment parseQuantifier(std::string_view pattern, size_t &pos, Fragment atom)
+  {
+    while(pos < pattern.size() && (pattern[pos] == '*' || pattern[pos] == '+' || pattern[pos] == '?'))
+    {
+      const char quantifier = pattern[pos++];
+      const int end = add(State{ .op = Op::Epsilon });
+      const int split = add(State{ .op = Op::Split, .out = atom.start, .out1 = end });
+      if(quantifier == '*')
+      {
+        m_states[atom.end].out = split;
+        atom = Fragment{ split, end };
+      }
+      else if(quantifier == '+')
+      {
+        m_states[atom.end].out = split;
+        atom = Fragment{ atom.start, end };
+      }
+      else
+      {
+        m_states[atom.end].out = end;
+        atom = Fragment{ split, end };
+      }
+    }
+
+    return atom;
+  }
+
+  std::optional<Fragment> parseAtom(std::string_view pattern, size_t &pos)
+  {
+    const char ch = pattern[pos];
+    switch(ch)
+    {
+      case '(':
+      {
+        ++pos;
+        auto inner = parseAlternation(pattern, pos);
+        if(!inner || pos >= pattern.size() || pattern[pos] != ')')
+          return std::nullopt;
+        ++pos;
+        return inner;
+      }
+      case '*':
+      case '+':
+      case '?':
+        // nothing to repeat
+        return std::nullopt;
+      case '.':
+        ++pos;
+        return single(State{ .op = Op::Any });
+      case '^':
+        ++pos;
+        return single(State{ .op = Op::LineStart });
+      case '$':
+        ++pos;
+        return single(State{ .op = Op::LineEnd });
+      case '[':
+      {
+        auto cls = path_matcher_detail::parseClass(pattern, pos);
+        if(!cls)
+          return std::nullopt;
+        return single(classState(*cls));
+      }
+      case '\\':
+      {
+        if(pos + 1 >= pattern.size())
+          return std::nullopt;
+        const char escaped = pattern[pos + 1];
+        pos += 2;
+        if(const auto cls = escapeClass(escaped))
+          return single(classState(*cls));
+        return single(State{ .op = Op::Byte, .byte = static_cast<uint8_t>(escaped) });
+      }
+      default:
+        ++pos;
+        return single(State{ .op = Op::Byte, .byte = static_cast<uint8_t>(ch) });
+    }
+  }
+
+  State classState(const ByteClass &cls)
+  {
+    m_classes.push_back(cls);
+    return State{ .op = Op::Class, .classIdx = static_cast<uint16_t>(m_classes.size() - 1) };
+  }
+
+  static std::optional<ByteClass> escapeClass(char escaped)
+  {
+    ByteClass ret;
+    switch(escaped)
+    {
+      case 'd':
+      case 'D':
+        for(unsigned ch = '0'; ch <= '9'; ++ch)
+          ret.set(ch);
+        break;
+      case 'w':
+      case 'W':
+        for(unsigned ch = 0; ch < 256; ++ch)
+          ret.set(ch, (ch >= '0' && ch <= '9') || (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || ch == '_');
+        break;
+      case 's':
+      case 'S':
+        for(const unsigned ch : {' ', '\t', '\n', '\r', '\f', '\v'})
+          ret.set(ch);
+        break;
+      default:
+        return std::nullopt;
+    }
+
+    return escaped >= 'A' && escaped <= 'Z' ? ~ret : ret;
+  }
+
+  /*
+   * Adds state and everything reachable from it without consuming input,
+   * true when Match is reached
+   */
+  bool addClosure(int start, size_t pos, size_t textSize, StateSet &seen, int *stack, uint16_t *list, size_t &count) const
+  {
+    size_t depth = 0;
+    stack[depth++] = start;
+    while(depth)
+    {
+      const int idx = stack[--depth];
+      if(idx < 0 || seen.test(static_cast<size_t>(idx)))
+        continue;
+      seen.set(static_cast<size_t>(idx));
+
+      const State &state = m_states[static_cast<size_t>(idx)];
+      switch(state.op)
+      {
+        case Op::Match:
+          return true;
+        case Op::Split:
+          stack[depth++] = state.out1;
+          stack[depth++] = state.out;
+          break;
+        case Op::Epsilon:
+          stack[depth++] = state.out;
+          break;
+        case Op::LineStart:
+          if(pos == 0)
+            stack[depth++] = state.out;
+          break;
+        case Op::LineEnd:
+          if(pos == textSize)
+            stack[depth++] = state.out;
+          break;
+        default:
+          list[count++] = static_cast<uint16_t>(idx);
+          break;
+      }
+    }
+
+    return false;
+  }
+};
+
+/*
+ * Decides which files are inputs, compiled once before traversal and called
+ * from walker threads with raw d_name (and path, for patterns with '/').
+ *
+ * File is taken when its name ends with one of extensions (if any given),
+ * matches at least one include pattern (if any given) and no exclude pattern.
+ * Patterns containing '/' are matched against path, others against name.
+ */
+class PathMatcher final
+{
+  struct Pattern
+  {
+    std::optional<Glob> glob;
+    std::optional<Regex> regex;
+    bool onPath {false};
+
+    bool matches(std::string_view name, std::string_view path) const
+    {
+      const std::string_view text = onPath ? path : name;
+      return glob ? glob->matches(text) : regex->search(text, s_regexScratch);
+    }
+  };
+
+  // matches() runs on every walker thread at once, each one reuses its own
+  static inline thread_local Regex::Scratch s_regexScratch;
+
+  SuffixTrie m_extensions;
+  std::vector<Pattern> m_includes;
+  std::vector<Pattern> m_excludes;
+  bool m_rotated {false};
+
+public:
+  /*
+   * "<name><ext>.<number>" and .gz/.zst on top of either count as <ext> too
+   */
+  void matchRotated(bool rotated)
+  {
+    m_rotated = rotated;
+  }
+
+  void addExtension(std::string_view ext)
+  {
+    m_extensions.insert(ext);
+  }
+
+  void addGlob(std::string_view pattern, bool exclude)
+  {
+    (exclude ? m_excludes : m_includes).push_back(Pattern{ .glob = Glob{pattern}, .regex = std::nullopt, .onPath = pattern.find('/') != std::string_view::npos });
+  }
+
+  /*
+   * false when pattern doesn't compile
+   */
+  bool addRegex(std::string_view pattern, bool exclude)
+  {
+    auto regex = Regex::compile(pattern);
+    if(!regex)
+      return false;
+
+    (exclude ? m_excludes : m_includes).push_back(Pattern{ .glob = std::nullopt, .regex = std::move(regex), .onPath = pattern.find('/') != std::string_view::npos });
+    return true;
+  }
+
+  /*
+   * Nothing to select by, every file would match
+   */
+  bool empty() const
+  {
+    return m_extensions.empty() && m_includes.empty();
+  }
+
+  bool matches(std::string_view name, std::string_view path) const
+  {
+    if(!m_extensions.empty() && !m_extensions.matches(m_rotated ? stripRotation(name) : name))
+      return false;
+
+    if(!m_includes.empty()
+        && std::none_of(m_includes.begin(), m_includes.end(), [&](const Pattern &p) { return p.matches(name, path); }))
+      return false;
+
+    return std::none_of(m_excludes.begin(), m_excludes.end(), [&](const Pattern &p) { return p.matches(name, path); });
+  }
+
+private:
+  static std::string_view stripRotation(std::string_view name)
+  {
+    for(const std::string_view suffix : {".gz", ".zst"})
+    {
+      if(name.ends_with(suffix))
+      {
+        name.remove_suffix(suffix.size());
+        break;
+      }
+    }
+
+    const size_t dot = name.rfind('.');
+    if(dot != std::string_view::npos && dot + 1 < name.size()
+        && std::all_of(name.begin() + static_cast<ptrdiff_t>(dot) + 1, name.end(), [](char ch) { return ch >= '0' && ch <= '9'; }))
+      name = name.substr(0, dot);
+
+    return name;
+  }
+};
+
+#endif
@@ -0,0 +1,1081 @@
+/*
+*  MIT License
+*
+*  Copyright (c) 2025 Pawel Drzycimski
+*
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+*
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+*
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*
+*/
+
+#ifndef LOG_MERGER_PIPELINE_HPP_
+#define LOG_MERGER_PIPELINE_HPP_
+
+#include "chunk_pool.hpp"
+#include "digest_set.hpp"
+#include "dir_walker.hpp"
+#include "direct_io.hpp"
+#include "input_hash.hpp"
+#include "kernel_copy.hpp"
+#include "path_arena.hpp"
+#include "xxhash.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <concepts>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+
+/*
+ * Merge pipeline of log_merger_3..5 split into stages with compile time
+ * strategies, every variant is one instantiation (log_merger_2 has its own
+ * thread pools and doesn't use it):
+ *
+ *   Traversal  - static walk(config, onFile(path)), onFile may be called
+ *                from many threads
+ *   Hashing    - static digest(path) -> std::vector<uint8_t>, empty on error
+ *   Buffering  - template<Sink>, reader threads taking unique files and
+ *                moving their bytes to sink, see BasicChunkStreamBuffering
+ *   Sink       - constructed from output FILE and config, open() -> 0 or
+ *                errno, write(data, size) -> bool called by one thread at
+ *                a time, finish() -> bool after last write. Sinks placing
+ *                whole files by themselves have copyFile, see FileSink.
+ */
+
+struct PipelineConfig
+{
+  std::string_view root {"./"};
+  std::string_view extension;
+  // output file name, never taken as input
+  std::string_view outName;
+
+  // unique files waiting for readers at a time
+  size_t fileCountLimit {1'048'576};
+  // only a hint, digest set grows past it, a million up front would take 128MB
+  size_t digestReserve {65'536};
+
+  unsigned walkThreads {4};
+  unsigned hashThreads {5};
+  unsigned readerCount {2};
+
+  // ChunkStreamBuffering
+  size_t chunkCount {32};
+  size_t chunkSize {4 * 1024 * 1024};
+  bool hugePages {false};
+
+  // WholeFileBuffering, per reader
+  size_t wholeFileMax {2ULL * 1024 * 1024 * 1024 + 10};
+};
+
+struct PipelineStats
+{
+  std::atomic<uint64_t> scheduled {0};
+  std::atomic<uint64_t> hashed {0};
+  std::atomic<uint64_t> unique {0};
+  // unique, but path memory exhausted, path too long or too many files waiting
+  std::atomic<uint64_t> dropped {0};
+  std::atomic<uint64_t> unreadable {0};
+  std::atomic<uint64_t> tooLarge {0};
+  // written by reader itself, no chunk in between
+  std::atomic<uint64_t> noCacheCopies {0};
+  std::atomic<uint64_t> bytesWritten {0};
+  std::atomic<uint64_t> writeErrors {0};
+};
+
+enum class PipelineError
+{
+  None,
+  NameMemory,
+  DigestMemory,
+  BufferMemory,
+  Output
+};
+
+inline std::string_view pipelineErrorText(PipelineError error)
+{
+  switch(error)
+  {
+    case PipelineError::None: return "no error";
+    case PipelineError::NameMemory: return "Can't initialize memory to hold waiting files";
+    case PipelineError::DigestMemory: return "Couldn't initialize enough memory for hash cache";
+    case PipelineError::BufferMemory: return "Couldn't initialize enough memory for I/O";
+    case PipelineError::Output: return "Couldn't prepare output for writing";
+  }
+  return "unknown error";
+}
+
+/*
+ * Unique files between hashers and readers, paths are kept in PathArena and
+ * only their handles wait here. Readers take the most recently added one
+ * (LIFO) along with ticket, order in which files were taken.
+ */
+class UniqueFiles final
+{
+  PathArena m_paths;
+  std::vector<PathHandle> m_pending;
+  size_t m_countLimit {0};
+  std::mutex m_mutex;
+  std::condition_variable m_signal;
+  bool m_finished {false};
+  bool m_aborted {false};
+  uint64_t m_nextTicket {0};
+
+public:
+  /*
+   * At most count files wait for readers at a time, room for them grows on use
+   */
+  bool reserve(size_t count)
+  {
+    static constexpr size_t INITIAL_PENDING = 4096;
+
+    m_countLimit = count;
+    try{
+      m_pending.reserve(std::min(count, INITIAL_PENDING));
+    }catch(const std::bad_alloc&)
+    {
+      return false;
+    }
+
+    return true;
+  }
+
+  /*
+   * False when path is longer than 64KB, path memory is exhausted
+   * or count limit of waiting files is reached
+   */
+  bool add(std::string_view path)
+  {
+    const PathHandle handle = m_paths.append(path);
+    if(handle == PathArena::INVALID_HANDLE)
+      return false;
+
+    {
+      std::lock_guard lock(m_mutex);
+      if(m_pending.size() == m_countLimit)
+        return false;
+      m_pending.push_back(handle);
+    }
+    m_signal.notify_one();
+    return true;
+  }
+
+  /*
+   * Nothing more will be added, readers leave once names are drained
+   */
+  void finish()
+  {
+    {
+      std::lock_guard lock(m_mutex);
+      m_finished = true;
+    }
+    m_signal.notify_all();
+  }
+
+  /*
+   * Readers leave right away
+   */
+  void abort()
+  {
+    {
+      std::lock_guard lock(m_mutex);
+      m_aborted = true;
+    }
+    m_signal.notify_all();
+  }
+
+  /*
+   * False when there's nothing left to take
+   */
+  bool take(std::string &name, uint64_t &ticket)
+  {
+    PathHandle handle;
+    {
+      std::unique_lock lock(m_mutex);
+      m_signal.wait(lock, [this] { return !m_pending.empty() || m_finished || m_aborted; });
+      if(m_aborted || m_pending.empty())
+        return false;
+
+      handle = m_pending.back();
+      m_pending.pop_back();
+      ticket = m_nextTicket++;
+    }
+
+    name = m_paths.get(handle);
+    return true;
+  }
+
+  /*
+   * Tickets handed out so far
+   */
+  uint64_t tickets()
+  {
+    std::lock_guard lock(m_mutex);
+    return m_nextTicket;
+  }
+};
+
+struct FsIteratorTraversal
+{
+  /*
+   * std::filesystem recursive iterator, single thread, match by path extension
+   */
+  template<typename OnFile>
+  static void walk(const PipelineConfig &config, OnFile &&onFile)
+  {
+    const std::filesystem::path fsExtension{config.extension};
+    const std::filesystem::path fsOutFilename{config.outName};
+    std::error_code ec;
+    for(auto itEntry = std::filesystem::recursive_directory_iterator(config.root, ec);
+        itEntry != std::filesystem::recursive_directory_iterator();
+        itEntry.increment(ec))
+    {
+      const auto &path = itEntry->path();
+      if(path.filename() == fsOutFilename || itEntry->is_directory(ec) || path.extension() != fsExtension)
+        continue;
+
+      onFile(std::string_view{path.native()});
+    }
+  }
+};
+
+struct DirWalkerTraversal
+{
+  /*
+   * getdents64 walker with walkThreads threads, match by name suffix
+   */
+  template<typename OnFile>
+  static void walk(const PipelineConfig &config, OnFile &&onFile)
+  {
+    DirWalker walker;
+    walker.walk(config.root, config.walkThreads, [&](unsigned, const WalkEntry &entry) {
+      if(entry.name == config.outName || entry.name.size() <= config.extension.size() || !entry.name.ends_with(config.extension))
+        return;
+
+      onFile(entry.path);
+    });
+  }
+};
+
+struct Blake2bHash
+{
+  /*
+   * BLAKE2b-512, same routine log_merger_2 hashes its inputs with
+   */
+  static std::vector<uint8_t> digest(const std::string &path)
+  {
+    InputReader input;
+    if(!input.open(path.c_str(), false))
+      return {};
+
+    uint64_t size = 0;
+    return hashInput(input, EVP_blake2b512(), size);
+  }
+};
+
+struct Xxh3Hash
+{
+  /*
+   * Streaming xxh3-128, not cryptographic, for measuring what hashing costs
+   */
+  static std::vector<uint8_t> digest(const std::string &path)
+  {
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+      return {};
+
+    xxh::hash3_state128_t state;
+    uint8_t buf[64 * 1024];
+    ssize_t got;
+    while((got = ::read(fd, buf, sizeof(buf))) != 0)
+    {
+      if(got < 0 && errno == EINTR)
+        continue;
+      if(got < 0)
+      {
+        ::close(fd);
+        return {};
+      }
+      state.update(buf, static_cast<size_t>(got));
+    }
+    ::close(fd);
+
+    const xxh::hash128_t hash = state.digest();
+    std::vector<uint8_t> ret(sizeof(hash.low64) + sizeof(hash.high64));
+    std::memcpy(ret.data(), &hash.low64, sizeof(hash.low64));
+    std::memcpy(ret.data() + sizeof(hash.low64), &hash.high64, sizeof(hash.high64));
+    return ret;
+  }
+};
+
+inline bool writeAll(int fd, const uint8_t *data, size_t size)
+{
+  while(size)
+  {
+    const ssize_t ret = ::write(fd, data, size);
+    if(ret < 0 && errno == EINTR)
+      continue;
+    if(ret <= 0)
+      return false;
+    data += ret;
+    size -= static_cast<size_t>(ret);
+  }
+  return true;
+}
+
+inline bool pwriteAll(int fd, const uint8_t *data, size_t size, uint64_t offset)
+{
+  while(size)
+  {
+    const ssize_t ret = ::pwrite(fd, data, size, static_cast<off_t>(offset));
+    if(ret < 0 && errno == EINTR)
+      continue;
+    if(ret <= 0)
+      return false;
+    data += ret;
+    size -= static_cast<size_t>(ret);
+    offset += static_cast<uint64_t>(ret);
+  }
+  return true;
+}
+
+/*
+ * Sink taking whole files from readers, any thread, any time. copyFile
+ * gets input at position 0 and its size, returns bytes written. Buffering
+ * doesn't read such files at all, it only hands them over.
+ */
+template<typename Sink>
+concept FileSink = requires(Sink &sink, int inFd, uint64_t size) {
+  { sink.copyFile(inFd, size) } -> std::same_as<uint64_t>;
+};
+
+class StdioSink final
+{
+  std::FILE &m_file;
+
+public:
+  StdioSink(std::FILE &file, const PipelineConfig&)
+    : m_file{file}
+  {}
+
+  int open() { return 0; }
+
+  bool write(const uint8_t *data, size_t size)
+  {
+    return std::fwrite(data, 1, size, &m_file) == size;
+  }
+
+  bool finish() { return std::fflush(&m_file) == 0; }
+};
+
+/*
+ * write(2) on descriptor of output, no user space copy in between
+ */
+class FdSink final
+{
+  int m_fd;
+
+public:
+  FdSink(std::FILE &file, const PipelineConfig&)
+    : m_fd{::fileno(&file)}
+  {
+    std::fflush(&file);
+  }
+
+  int open() { return 0; }
+
+  bool write(const uint8_t *data, size_t size)
+  {
+    return writeAll(m_fd, data, size);
+  }
+
+  bool finish() { return true; }
+};
+
+/*
+ * Files appended by copy_file_range or sendfile under output lock, bytes
+ * never reach user space (log_merger_2 -c kernel)
+ */
+class KernelCopySink final
+{
+  int m_fd;
+  std::mutex m_mutex;
+  KernelCopyStats m_stats;
+
+public:
+  KernelCopySink(std::FILE &file, const PipelineConfig&)
+    : m_fd{::fileno(&file)}
+  {
+    std::fflush(&file);
+  }
+
+  int open() { return 0; }
+
+  bool write(const uint8_t *data, size_t size)
+  {
+    std::lock_guard lock(m_mutex);
+    return writeAll(m_fd, data, size);
+  }
+
+  uint64_t copyFile(int inFd, uint64_t)
+  {
+    std::lock_guard lock(m_mutex);
+    // copies are serialized by the lock, so the difference is this file
+    const uint64_t before = m_stats.bytes;
+    if(kernelCopy(inFd, m_fd, m_stats))
+      return m_stats.bytes - before;
+
+    // kernel refused, the rest goes through read/write from where it stopped
+    uint64_t written = m_stats.bytes - before;
+    uint8_t buffer[COPY_BUFFER_SIZE];
+    ssize_t got;
+    while((got = ::read(inFd, buffer, sizeof(buffer))) != 0)
+    {
+      if(got < 0 && errno == EINTR)
+        continue;
+      if(got < 0 || !writeAll(m_fd, buffer, static_cast<size_t>(got)))
+        break;
+      written += static_cast<uint64_t>(got);
+    }
+    return written;
+  }
+
+  bool finish() { return true; }
+
+  const KernelCopyStats &kernelStats() const { return m_stats; }
+
+private:
+  static constexpr size_t COPY_BUFFER_SIZE = 64 * 1024;
+};
+
+/*
+ * Every file gets its own range of output reserved up front, readers fill
+ * ranges concurrently with copy_file_range at explicit offsets, pread and
+ * pwrite where filesystem refuses it. No lock and no ordering between
+ * files (log_merger_2 -c pwrite).
+ */
+class PwriteRangeSink final
+{
+  int m_fd;
+  std::atomic<uint64_t> m_end;
+  // furthest byte really written, reserved ranges of shrunk inputs end past it
+  std::atomic<uint64_t> m_writtenEnd;
+
+public:
+  PwriteRangeSink(std::FILE &file, const PipelineConfig&)
+    : m_fd{::fileno(&file)}
+  {
+    std::fflush(&file);
+    m_end = static_cast<uint64_t>(std::max<off_t>(0, ::lseek(m_fd, 0, SEEK_CUR)));
+    m_writtenEnd = m_end.load();
+  }
+
+  int open() { return 0; }
+
+  bool write(const uint8_t *data, size_t size)
+  {
+    const uint64_t offset = m_end.fetch_add(size);
+    const bool ok = pwriteAll(m_fd, data, size, offset);
+    wrote(offset + (ok ? size : 0));
+    return ok;
+  }
+
+  /*
+   * Input that shrank since it was sized gives its unfilled tail back when
+   * no range was reserved after it, otherwise that tail stays zeroed
+   */
+  uint64_t copyFile(int inFd, uint64_t size)
+  {
+    const uint64_t offset = m_end.fetch_add(size);
+    const uint64_t written = copyRange(inFd, offset, size);
+    if(written < size)
+    {
+      uint64_t expected = offset + size;
+      m_end.compare_exchange_strong(expected, offset + written);
+    }
+    wrote(offset + written);
+    return written;
+  }
+
+  /*
+   * Cuts what fallocate reserved past the last byte written
+   */
+  bool finish()
+  {
+    return ::ftruncate(m_fd, static_cast<off_t>(m_writtenEnd.load())) == 0;
+  }
+
+private:
+  static constexpr size_t COPY_BUFFER_SIZE = 64 * 1024;
+
+  void wrote(uint64_t end)
+  {
+    uint64_t current = m_writtenEnd.load(std::memory_order_relaxed);
+    while(current < end && !m_writtenEnd.compare_exchange_weak(current, end, std::memory_order_relaxed))
+    {}
+  }
+
+  uint64_t copyRange(int inFd, uint64_t offset, uint64_t size)
+  {
+    if(size)
+    {
+      // extent allocation of disjoint ranges can go in parallel too, only an optimization
+      ::posix_fallocate(m_fd, static_cast<off_t>(offset), static_cast<off_t>(size));
+    }
+
+    loff_t inPos = 0;
+    loff_t outPos = static_cast<loff_t>(offset);
+    uint64_t written = 0;
+    while(written < size)
+    {
+      const ssize_t moved = ::copy_file_range(inFd, &inPos, m_fd, &outPos, static_cast<size_t>(size - written), 0);
+      if(moved > 0)
+      {
+        written += static_cast<uint64_t>(moved);
+        continue;
+      }
+      if(moved < 0 && errno == EINTR)
+        continue;
+      if(moved == 0 || !kernelCopyRefused(errno))
+        return written;
+      break;
+    }
+
+    uint8_t buffer[COPY_BUFFER_SIZE];
+    while(written < size)
+    {
+      const ssize_t got = ::pread(inFd, buffer, static_cast<size_t>(std::min<uint64_t>(sizeof(buffer), size - written)), static_cast<off_t>(written));
+      if(got < 0 && errno == EINTR)
+        continue;
+      if(got <= 0 || !pwriteAll(m_fd, buffer, static_cast<size_t>(got), offset + written))
+        break;
+      written += static_cast<uint64_t>(got);
+    }
+    return written;
+  }
+};
+
+/*
+ * Output through O_DIRECT, around page cache. Bytes are collected in
+ * aligned chunks, DirectOutput thread writes one while the next fills
+ * (log_merger_2 -c direct). open() fails with EINVAL on filesystems
+ * without O_DIRECT.
+ */
+class DirectSink final
+{
+  static constexpr size_t CHUNK_SIZE = 1024 * 1024;
+  static constexpr size_t CHUNK_COUNT = 8;
+
+  std::FILE &m_file;
+  const PipelineConfig &m_config;
+  DirectIoStats m_stats;
+  DirectOutput m_output;
+
+public:
+  DirectSink(std::FILE &file, const PipelineConfig &config)
+    : m_file{file},
+      m_config{config},
+      m_output{CHUNK_SIZE, CHUNK_COUNT, m_stats}
+  {}
+
+  int open()
+  {
+    std::fflush(&m_file);
+    const off_t start = ::lseek(::fileno(&m_file), 0, SEEK_CUR);
+    return m_output.open(std::string{m_config.outName}.c_str(), static_cast<uint64_t>(std::max<off_t>(0, start)));
+  }
+
+  bool write(const uint8_t *data, size_t size)
+  {
+    // write errors are sticky in DirectOutput, finish() reports them
+    m_output.append(data, size);
+    return true;
+  }
+
+  bool finish() { return m_output.finish() == 0; }
+
+  const DirectIoStats &directStats() const { return m_stats; }
+};
+
+/*
+ * Hands whole file over to FileSink
+ */
+template<FileSink Sink>
+void copyToSink(Sink &sink, const std::string &fileName, PipelineStats &stats)
+{
+  const int fd = ::open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if(fd < 0 || ::fstat(fd, &st) != 0)
+  {
+    if(fd >= 0)
+      ::close(fd);
+    ++stats.unreadable;
+    return;
+  }
+
+  const auto size = static_cast<uint64_t>(st.st_size);
+  const uint64_t written = sink.copyFile(fd, size);
+  ::close(fd);
+
+  stats.bytesWritten += written;
+  if(written < size)
+    ++stats.writeErrors;
+}
+
+/*
+ * Readers stream files through chunks of fixed pool, output thread writes
+ * them in ticket order, so memory stays bounded whatever file sizes are.
+ *
+ * With NoCacheFirst reader whose file is next in order and finds output
+ * idle copies file to sink itself through small stack buffer, chunks are
+ * used only when output is busy.
+ */
+template<typename Sink, bool NoCacheFirst>
+class BasicChunkStreamBuffering final
+{
+  Sink &m_sink;
+  UniqueFiles &m_files;
+  PipelineStats &m_stats;
+  const PipelineConfig &m_config;
+
+  std::unique_ptr<ChunkPool> m_pool;
+  OrderedChunkQueue m_chunks;
+  std::vector<std::jthread> m_readers;
+  std::jthread m_outputThread;
+
+  static constexpr size_t NO_CACHE_BUFFER_SIZE = 64 * 1024;
+
+public:
+  BasicChunkStreamBuffering(Sink &sink, UniqueFiles &files, PipelineStats &stats, const PipelineConfig &config)
+    : m_sink{sink}, m_files{files}, m_stats{stats}, m_config{config}
+  {}
+
+  BasicChunkStreamBuffering(const BasicChunkStreamBuffering&) = delete;
+  BasicChunkStreamBuffering(BasicChunkStreamBuffering&&) = delete;
+
+  ~BasicChunkStreamBuffering()
+  {
+    join();
+  }
+
+  /*
+   * Returns 0 or errno
+   */
+  int reserve()
+  {
+    if constexpr(FileSink<Sink>)
+      return 0;
+
+    m_pool = std::make_unique<ChunkPool>(m_config.chunkCount, m_config.chunkSize, m_config.readerCount);
+    return m_pool->init(m_config.hugePages);
+  }
+
+  // file sinks copy whole files by themselves, no pool is allocated for them
+  const ChunkPool &pool() const requires(!FileSink<Sink>) { return *m_pool; }
+
+  void start()
+  {
+    for(unsigned i = 0; i < m_config.readerCount; ++i)
+      m_readers.emplace_back([this, i] { reader(i); });
+    if constexpr(!FileSink<Sink>)
+      m_outputThread = std::jthread([this] { output(); });
+  }
+
+  void join()
+  {
+    for(auto &thread : m_readers)
+      thread.join();
+    m_readers.clear();
+
+    if(!m_outputThread.joinable())
+      return;
+
+    // readers are gone, so is every ticket which will ever be
+    m_chunks.close(m_files.tickets());
+    m_outputThread.join();
+  }
+
+private:
+  void reader(unsigned lane)
+  {
+    std::string fileName;
+    uint64_t ticket = 0;
+    while(m_files.take(fileName, ticket))
+    {
+      if constexpr(FileSink<Sink>)
+      {
+        copyToSink(m_sink, fileName, m_stats);
+        continue;
+      }
+
+      std::FILE *inFile = std::fopen(fileName.c_str(), "rb");
+      if constexpr(NoCacheFirst)
+      {
+        if(inFile && m_chunks.tryClaim(ticket))
+        {
+          copyNoCache(*inFile);
+          std::fclose(inFile);
+          m_chunks.endClaim();
+          continue;
+        }
+      }
+
+      if(inFile)
+      {
+        // blocks while every chunk of this lane waits for output, that's the back-pressure
+        while(true)
+        {
+          Chunk *chunk = m_pool->acquire(lane);
+          chunk->size = std::fread(chunk->data, 1, m_pool->chunkSize(), inFile);
+          if(chunk->size == 0)
+          {
+            m_pool->release(chunk);
+            break;
+          }
+
+          m_chunks.push(ticket, chunk);
+          if(chunk->size < m_pool->chunkSize())
+            break;
+        }
+
+        if(std::ferror(inFile))
+          ++m_stats.unreadable;
+        std::fclose(inFile);
+      }
+      else
+      {
+        ++m_stats.unreadable;
+      }
+
+      // ends the file, even one which couldn't be opened, output waits for it
+      m_chunks.push(ticket, nullptr);
+    }
+  }
+
+  /*
+   * Caller holds output claim
+   */
+  void copyNoCache(std::FILE &inFile)
+  {
+    ++m_stats.noCacheCopies;
+    uint8_t buffer[NO_CACHE_BUFFER_SIZE];
+    while(const size_t bytesRead = std::fread(buffer, 1, sizeof(buffer), &inFile))
+    {
+      if(!m_sink.write(buffer, bytesRead))
+      {
+        ++m_stats.writeErrors;
+        return;
+      }
+      m_stats.bytesWritten += bytesRead;
+    }
+
+    if(std::ferror(&inFile))
+      ++m_stats.unreadable;
+  }
+
+  void output()
+  {
+    Chunk *chunk = nullptr;
+    while(m_chunks.pop(chunk))
+    {
+      if(m_sink.write(chunk->data, chunk->size))
+        m_stats.bytesWritten += chunk->size;
+      else
+        ++m_stats.writeErrors;
+      m_pool->release(chunk);
+    }
+  }
+};
+
+// log_merger_3
+template<typename Sink>
+using ChunkStreamBuffering = BasicChunkStreamBuffering<Sink, false>;
+
+// log_merger_5
+template<typename Sink>
+using NoCacheFirstBuffering = BasicChunkStreamBuffering<Sink, true>;
+
+/*
+ * Every reader loads whole file into its own buffer and writes it under
+ * output lock, needs wholeFileMax of memory per reader (log_merger_4)
+ */
+template<typename Sink>
+class WholeFileBuffering final
+{
+  Sink &m_sink;
+  UniqueFiles &m_files;
+  PipelineStats &m_stats;
+  const PipelineConfig &m_config;
+
+  std::mutex m_sinkMutex;
+  std::vector<std::unique_ptr<uint8_t[]>> m_buffers;
+  std::vector<std::jthread> m_readers;
+
+public:
+  WholeFileBuffering(Sink &sink, UniqueFiles &files, PipelineStats &stats, const PipelineConfig &config)
+    : m_sink{sink}, m_files{files}, m_stats{stats}, m_config{config}
+  {}
+
+  WholeFileBuffering(const WholeFileBuffering&) = delete;
+  WholeFileBuffering(WholeFileBuffering&&) = delete;
+
+  ~WholeFileBuffering()
+  {
+    join();
+  }
+
+  /*
+   * Returns 0 or errno
+   */
+  int reserve()
+  {
+    if constexpr(FileSink<Sink>)
+      return 0;
+
+    for(unsigned i = 0; i < m_config.readerCount; ++i)
+    {
+      m_buffers.emplace_back(new(std::nothrow) uint8_t[m_config.wholeFileMax]);
+      if(!m_buffers.back())
+        return ENOMEM;
+    }
+    return 0;
+  }
+
+  void start()
+  {
+    for(unsigned i = 0; i < m_config.readerCount; ++i)
+      m_readers.emplace_back([this, i] { reader(m_buffers.empty() ? nullptr : m_buffers[i].get()); });
+  }
+
+  void join()
+  {
+    for(auto &thread : m_readers)
+      thread.join();
+    m_readers.clear();
+  }
+
+private:
+  void reader(uint8_t *buffer)
+  {
+    std::string fileName;
+    uint64_t ticket = 0;
+    while(m_files.take(fileName, ticket))
+    {
+      if constexpr(FileSink<Sink>)
+      {
+        copyToSink(m_sink, fileName, m_stats);
+        continue;
+      }
+
+      std::FILE *inFile = std::fopen(fileName.c_str(), "rb");
+      if(!inFile)
+      {
+        ++m_stats.unreadable;
+        continue;
+      }
+
+      size_t size = 0;
+      bool fits = true;
+      while(size_t bytesRead = std::fread(buffer + size, 1, std::min<size_t>(BUFSIZ, m_config.wholeFileMax - size), inFile))
+      {
+        size += bytesRead;
+        if(size == m_config.wholeFileMax)
+        {
+          // one more byte tells whether file ends exactly here
+          uint8_t probe;
+          fits = std::fread(&probe, 1, 1, inFile) == 0;
+          break;
+        }
+      }
+      const bool failed = std::ferror(inFile);
+      std::fclose(inFile);
+
+      if(!fits)
+      {
+        ++m_stats.tooLarge;
+        continue;
+      }
+      if(failed)
+        ++m_stats.unreadable;
+
+      std::lock_guard lock(m_sinkMutex);
+      if(m_sink.write(buffer, size))
+        m_stats.bytesWritten += size;
+      else
+        ++m_stats.writeErrors;
+    }
+  }
+};
+
+/*
+ * Traversal feeds hash threads through mutex guarded queue, files with
+ * digest not seen before go to UniqueFiles, Buffering readers take them
+ * from there and hand bytes to Sink.
+ *
+ * Stages are driven step by step, so caller can report every one:
+ * reserve(), start(), traverse(), finishHashing(), finishWriting().
+ */
+template<typename Traversal, typename Hashing, template<typename> class Buffering, typename Sink>
+class Pipeline final
+{
+  const PipelineConfig m_config;
+  PipelineStats m_stats;
+
+  Sink m_sink;
+  UniqueFiles m_files;
+  DigestSet m_digests;
+  Buffering<Sink> m_buffering;
+
+  std::queue<std::string> m_filePaths;
+  std::mutex m_filePathsMutex;
+  std::condition_variable m_pathAvailable;
+  bool m_traversalFinished {false};
+  std::vector<std::jthread> m_hashers;
+
+public:
+  Pipeline(std::FILE &output, const PipelineConfig &config)
+    : m_config{config},
+      m_sink{output, m_config},
+      m_buffering{m_sink, m_files, m_stats, m_config}
+  {}
+
+  Pipeline(const Pipeline&) = delete;
+  Pipeline(Pipeline&&) = delete;
+
+  ~Pipeline()
+  {
+    if(!m_hashers.empty())
+    {
+      {
+        std::lock_guard lock(m_filePathsMutex);
+        m_traversalFinished = true;
+        std::queue<std::string>{}.swap(m_filePaths);
+      }
+      m_pathAvailable.notify_all();
+      m_hashers.clear();
+    }
+    m_files.abort();
+  }
+
+  PipelineError reserve()
+  {
+    if(!m_files.reserve(m_config.fileCountLimit))
+      return PipelineError::NameMemory;
+    if(!m_digests.reserve(m_config.digestReserve))
+      return PipelineError::DigestMemory;
+    if(m_buffering.reserve() != 0)
+      return PipelineError::BufferMemory;
+    if(m_sink.open() != 0)
+      return PipelineError::Output;
+    return PipelineError::None;
+  }
+
+  Buffering<Sink> &buffering() { return m_buffering; }
+  const Sink &sink() const { return m_sink; }
+  const PipelineStats &stats() const { return m_stats; }
+
+  void start()
+  {
+    for(unsigned i = 0; i < m_config.hashThreads; ++i)
+      m_hashers.emplace_back([this] { hashWorker(); });
+    m_buffering.start();
+  }
+
+  /*
+   * Returns once every matching file is scheduled for hashing
+   */
+  void traverse()
+  {
+    Traversal::walk(m_config, [this](std::string_view path) {
+      ++m_stats.scheduled;
+      {
+        std::lock_guard lock(m_filePathsMutex);
+        m_filePaths.emplace(path);
+      }
+      m_pathAvailable.notify_one();
+    });
+
+    {
+      std::lock_guard lock(m_filePathsMutex);
+      m_traversalFinished = true;
+    }
+    m_pathAvailable.notify_all();
+  }
+
+  void finishHashing()
+  {
+    for(auto &thread : m_hashers)
+      thread.join();
+    m_hashers.clear();
+    m_files.finish();
+  }
+
+  void finishWriting()
+  {
+    m_buffering.join();
+    if(!m_sink.finish())
+      ++m_stats.writeErrors;
+  }
+
+private:
+  void hashWorker()
+  {
+    while(true)
+    {
+      std::string file;
+      {
+        std::unique_lock lock(m_filePathsMutex);
+        m_pathAvailable.wait(lock, [this] { return !m_filePaths.empty() || m_traversalFinished; });
+        if(m_filePaths.empty())
+          break;
+
+        file = std::move(m_filePaths.front());
+        m_filePaths.pop();
+      }
+
+      const auto fileHash = Hashing::digest(file);
+      ++m_stats.hashed;
+      if(!m_digests.insert(fileHash))
+        continue;
+
+      ++m_stats.unique;
+      if(!m_files.add(file))
+        ++m_stats.dropped;
+    }
+  }
+};
+
+#endif
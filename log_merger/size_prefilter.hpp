@@ -0,0 +1,184 @@
+/*
+*  MIT License
+*
+*  Copyright (c) 2025 Pawel Drzycimski
+*
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+*
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+*
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*
+*/
+
+#ifndef LOG_MERGER_SIZE_PREFILTER_HPP_
+#define LOG_MERGER_SIZE_PREFILTER_HPP_
+
+#include "xxhash.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+struct DedupCandidate
+{
+  std::string path;
+  uint64_t size {0};
+  uint64_t sample {0};
+};
+
+struct PrefilterStats
+{
+  uint64_t files {0};
+  uint64_t bytes {0};
+  uint64_t uniqueBySize {0};
+  uint64_t uniqueBySample {0};
+  uint64_t fullHashFiles {0};
+  uint64_t fullHashBytes {0};
+};
+
+/*
+ * xxh3 over first and last SAMPLE_SIZE bytes, whole file when it's smaller than both.
+ * Returns 0 on read error, such file just ends up being fully hashed.
+ */
+inline uint64_t sampleHash(const std::string &path, uint64_t size)
+{
+  static constexpr size_t SAMPLE_SIZE = 64 * 1024;
+
+  const int fd = ::open(path.c_str(), O_RDONLY);
+  if(fd < 0)
+    return 0;
+
+  std::unique_ptr<uint8_t[]> buffer{ new uint8_t[2 * SAMPLE_SIZE] };
+  const size_t headLen = size > 2 * SAMPLE_SIZE ? SAMPLE_SIZE : static_cast<size_t>(size);
+  ssize_t total = ::pread(fd, buffer.get(), headLen, 0);
+  if(total >= 0 && size > 2 * SAMPLE_SIZE)
+  {
+    const ssize_t tail = ::pread(fd, buffer.get() + SAMPLE_SIZE, SAMPLE_SIZE, static_cast<off_t>(size - SAMPLE_SIZE));
+    total = tail < 0 ? tail : static_cast<ssize_t>(SAMPLE_SIZE) + tail;
+  }
+  ::close(fd);
+
+  if(total < 0)
+    return 0;
+
+  return xxh::xxhash3<64>(buffer.get(), static_cast<size_t>(total));
+}
+
+/*
+ * Runs fn(idx) for every idx in [0, count) on threadCount threads
+ */
+template<typename Fn>
+void parallelFor(size_t count, unsigned threadCount, Fn &&fn)
+{
+  std::atomic<size_t> next{0};
+  std::vector<std::jthread> threads;
+  threads.reserve(threadCount);
+  for(unsigned i = 0; i < threadCount; ++i)
+  {
+    threads.emplace_back([&] {
+      for(size_t idx = next++; idx < count; idx = next++)
+        fn(idx);
+    });
+  }
+}
+
+/*
+ * Staged dedup, cheapest check first:
+ *   1. file with size nobody else has is unique
+ *   2. same size, but different xxh3 of head and tail is unique
+ *   3. everything else needs full cryptographic digest
+ *
+ * onUnique(candidate) gets files proven unique, onFullHash(candidate) the rest,
+ * candidates may be moved from.
+ * Both are called from the calling thread, smallest files first, or largest
+ * first when largestFirst is set.
+ */
+template<typename OnUnique, typename OnFullHash>
+PrefilterStats sizePrefilter(std::vector<DedupCandidate> &candidates, unsigned threadCount, OnUnique &&onUnique, OnFullHash &&onFullHash,
+                             bool largestFirst = false)
+{
+  PrefilterStats stats;
+  stats.files = candidates.size();
+
+  const auto before = [largestFirst](uint64_t lhs, uint64_t rhs) { return largestFirst ? lhs > rhs : lhs < rhs; };
+  std::sort(candidates.begin(), candidates.end(), [&](const auto &lhs, const auto &rhs) { return before(lhs.size, rhs.size); });
+
+  std::vector<DedupCandidate*> collisions;
+  for(size_t first = 0; first < candidates.size();)
+  {
+    size_t last = first + 1;
+    while(last < candidates.size() && candidates[last].size == candidates[first].size)
+      ++last;
+
+    if(last - first == 1)
+    {
+      ++stats.uniqueBySize;
+      onUnique(candidates[first]);
+    }
+    else
+    {
+      for(size_t i = first; i < last; ++i)
+        collisions.push_back(&candidates[i]);
+    }
+
+    stats.bytes += candidates[first].size * (last - first);
+    first = last;
+  }
+
+  parallelFor(collisions.size(), threadCount, [&](size_t idx) {
+    collisions[idx]->sample = sampleHash(collisions[idx]->path, collisions[idx]->size);
+  });
+
+  std::sort(collisions.begin(), collisions.end(), [&](const auto *lhs, const auto *rhs) {
+    return before(lhs->size, rhs->size) || (lhs->size == rhs->size && lhs->sample < rhs->sample);
+  });
+
+  for(size_t first = 0; first < collisions.size();)
+  {
+    size_t last = first + 1;
+    while(last < collisions.size() && collisions[last]->size == collisions[first]->size
+          && collisions[last]->sample == collisions[first]->sample)
+      ++last;
+
+    if(last - first == 1)
+    {
+      ++stats.uniqueBySample;
+      onUnique(*collisions[first]);
+    }
+    else
+    {
+      for(size_t i = first; i < last; ++i)
+      {
+        ++stats.fullHashFiles;
+        stats.fullHashBytes += collisions[i]->size;
+        onFullHash(*collisions[i]);
+      }
+    }
+
+    first = last;
+  }
+
+  return stats;
+}
+
+#endif
@@ -0,0 +1,248 @@
+/*
+*  MIT License
+*
+*  Copyright (c) 2025 Pawel Drzycimski
+*
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+*
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+*
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*
+*/
+
+#ifndef LOG_MERGER_TREE_HASH_HPP_
+#define LOG_MERGER_TREE_HASH_HPP_
+
+#include "xxhash.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+struct TreeHashStats
+{
+  std::atomic<uint64_t> files {0};
+  std::atomic<uint64_t> chunks {0};
+  std::atomic<uint64_t> helpedChunks {0};
+  std::atomic<uint64_t> bytes {0};
+  std::atomic<uint64_t> failures {0};
+};
+
+/*
+ * Digest of large file built from fixed size chunks hashed independently
+ * (xxh3-128 seeded with chunk index), combined pairwise into Merkle tree and
+ * root hashed once more with file size. Chunks of one file are spread over
+ * helper threads and the calling thread, so one huge file is hashed at
+ * aggregate speed of all of them instead of by single thread.
+ *
+ * Digest is 16 bytes, it never equals 64 byte BLAKE2b of other files, but
+ * it's not cryptographic, so only files which opted in by size get it.
+ */
+class TreeHasher final
+{
+  static constexpr uint64_t PARENT_SEED = 0x6c6f675f74726565ULL;
+  static constexpr uint64_t ROOT_SEED = 0x6c6f675f726f6f74ULL;
+
+  static_assert(sizeof(xxh::hash128_t) == 2 * sizeof(uint64_t));
+
+  struct Job
+  {
+    int fd;
+    uint64_t size;
+    size_t chunkCount;
+    std::unique_ptr<xxh::hash128_t[]> leaves;
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> done{0};
+    std::atomic<bool> failed{false};
+  };
+
+  const size_t m_chunkSize;
+  const uint64_t m_minSize;
+  TreeHashStats m_stats;
+
+  std::mutex m_mutex;
+  std::condition_variable m_signal;
+  std::deque<std::shared_ptr<Job>> m_jobs;
+  bool m_running {true};
+  std::vector<std::jthread> m_helpers;
+
+public:
+  /*
+   * Files from minSize on are tree hashed in chunkSize pieces by threadCount helpers
+   */
+  TreeHasher(uint64_t minSize, size_t chunkSize, unsigned threadCount)
+    : m_chunkSize{chunkSize}, m_minSize{std::max<uint64_t>(minSize, chunkSize)}
+  {
+    for(unsigned i = 0; i < threadCount; ++i)
+      m_helpers.emplace_back([this] { helper(); });
+  }
+
+  TreeHasher(const TreeHasher&) = delete;
+  TreeHasher(TreeHasher&&) = delete;
+
+  ~TreeHasher()
+  {
+    {
+      std::lock_guard lock(m_mutex);
+      m_running = false;
+    }
+    m_signal.notify_all();
+  }
+
+  uint64_t minSize() const { return m_minSize; }
+  size_t chunkSize() const { return m_chunkSize; }
+  const TreeHashStats &stats() const { return m_stats; }
+
+  /*
+   * size bytes of fd, calling thread takes chunks too. nullopt on read
+   * error or when file turned out shorter than size.
+   */
+  std::optional<std::vector<uint8_t>> hash(int fd, uint64_t size)
+  {
+    auto job = std::make_shared<Job>();
+    job->fd = fd;
+    job->size = size;
+    job->chunkCount = static_cast<size_t>((size + m_chunkSize - 1) / m_chunkSize);
+    job->leaves.reset(new xxh::hash128_t[job->chunkCount]);
+
+    {
+      std::lock_guard lock(m_mutex);
+      m_jobs.push_back(job);
+    }
+    m_signal.notify_all();
+
+    std::unique_ptr<uint8_t[]> buffer{ new uint8_t[m_chunkSize] };
+    while(hashNextChunk(*job, buffer.get()))
+    {}
+
+    // helpers may still be in the middle of their chunks
+    for(size_t done = job->done.load(); done < job->chunkCount; done = job->done.load())
+      job->done.wait(done);
+
+    if(job->failed)
+    {
+      ++m_stats.failures;
+      return std::nullopt;
+    }
+
+    ++m_stats.files;
+    m_stats.bytes += size;
+    return digest(job->leaves.get(), job->chunkCount, size);
+  }
+
+private:
+  /*
+   * False when job has no chunk left to take
+   */
+  bool hashNextChunk(Job &job, uint8_t *buffer)
+  {
+    const size_t idx = job.next.fetch_add(1);
+    if(idx >= job.chunkCount)
+      return false;
+
+    const uint64_t offset = static_cast<uint64_t>(idx) * m_chunkSize;
+    const size_t len = static_cast<size_t>(std::min<uint64_t>(m_chunkSize, job.size - offset));
+    size_t got = 0;
+    while(got < len && !job.failed.load(std::memory_order_relaxed))
+    {
+      const ssize_t ret = ::pread(job.fd, buffer + got, len - got, static_cast<off_t>(offset + got));
+      if(ret < 0 && errno == EINTR)
+        continue;
+      if(ret <= 0)
+      {
+        job.failed = true;
+        break;
+      }
+      got += static_cast<size_t>(ret);
+    }
+
+    if(got == len)
+      job.leaves[idx] = xxh::xxhash3<128>(buffer, len, idx);
+
+    ++m_stats.chunks;
+    if(job.done.fetch_add(1) + 1 == job.chunkCount)
+      job.done.notify_all();
+    return true;
+  }
+
+  void helper()
+  {
+    std::unique_ptr<uint8_t[]> buffer{ new uint8_t[m_chunkSize] };
+    while(true)
+    {
+      std::shared_ptr<Job> job;
+      {
+        std::unique_lock lock(m_mutex);
+        m_signal.wait(lock, [this] { return !m_running || !m_jobs.empty(); });
+        if(!m_running)
+          return;
+
+        // exhausted jobs only wait for chunks in flight, nothing to help with
+        while(!m_jobs.empty() && m_jobs.front()->next.load() >= m_jobs.front()->chunkCount)
+          m_jobs.pop_front();
+        if(m_jobs.empty())
+          continue;
+        job = m_jobs.front();
+      }
+
+      while(hashNextChunk(*job, buffer.get()))
+        ++m_stats.helpedChunks;
+    }
+  }
+
+  static std::vector<uint8_t> digest(xxh::hash128_t *nodes, size_t count, uint64_t size)
+  {
+    // levels are folded in place, odd node goes up as it is
+    while(count > 1)
+    {
+      size_t parents = 0;
+      for(size_t i = 0; i + 1 < count; i += 2)
+      {
+        const xxh::hash128_t pair[2] = { nodes[i], nodes[i + 1] };
+        nodes[parents++] = xxh::xxhash3<128>(pair, sizeof(pair), PARENT_SEED);
+      }
+      if(count % 2)
+        nodes[parents++] = nodes[count - 1];
+      count = parents;
+    }
+
+    struct
+    {
+      xxh::hash128_t root;
+      uint64_t size;
+    } top{ nodes[0], size };
+    const xxh::hash128_t root = xxh::xxhash3<128>(&top, sizeof(top), ROOT_SEED);
+
+    std::vector<uint8_t> ret(sizeof(root.low64) + sizeof(root.high64));
+    std::memcpy(ret.data(), &root.low64, sizeof(root.low64));
+    std::memcpy(ret.data() + sizeof(root.low64), &root.high64, sizeof(root.high64));
+    return ret;
+  }
+};
+
+#endif
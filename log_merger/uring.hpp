@@ -0,0 +1,238 @@
+/*
+*  MIT License
+*
+*  Copyright (c) 2025 Pawel Drzycimski
+*
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+*
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+*
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*
+*/
+
+#ifndef LOG_MERGER_URING_HPP_
+#define LOG_MERGER_URING_HPP_
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/*
+ * Bare minimum io_uring wrapper on top of raw syscalls,
+ * so liburing is not needed to build.
+ *
+ * Not thread safe, meant to be driven by single thread.
+ */
+class IoUring final
+{
+  int m_fd {-1};
+  bool m_fixedBuffers {false};
+
+  void *m_sqRing {MAP_FAILED};
+  void *m_cqRing {MAP_FAILED};
+  size_t m_sqRingSize {0};
+  size_t m_cqRingSize {0};
+
+  io_uring_sqe *m_sqes {static_cast<io_uring_sqe*>(MAP_FAILED)};
+  size_t m_sqesSize {0};
+
+  unsigned *m_sqHead {nullptr};
+  unsigned *m_sqTail {nullptr};
+  unsigned *m_sqMask {nullptr};
+  unsigned *m_sqArray {nullptr};
+  unsigned m_sqEntries {0};
+
+  unsigned *m_cqHead {nullptr};
+  unsigned *m_cqTail {nullptr};
+  unsigned *m_cqMask {nullptr};
+  io_uring_cqe *m_cqes {nullptr};
+
+  unsigned m_toSubmit {0};
+
+public:
+  IoUring() = default;
+  IoUring(const IoUring&) = delete;
+  IoUring(IoUring&&) = delete;
+
+  ~IoUring()
+  {
+    if(m_sqes != MAP_FAILED)
+      ::munmap(m_sqes, m_sqesSize);
+    if(m_cqRing != MAP_FAILED && m_cqRing != m_sqRing)
+      ::munmap(m_cqRing, m_cqRingSize);
+    if(m_sqRing != MAP_FAILED)
+      ::munmap(m_sqRing, m_sqRingSize);
+    if(m_fd >= 0)
+      ::close(m_fd);
+  }
+
+  /*
+   * Returns 0 or errno, ENOSYS/EPERM mean io_uring is not usable here
+   */
+  int init(unsigned entries)
+  {
+    io_uring_params params;
+    std::memset(&params, 0x00, sizeof(params));
+
+    const long fd = ::syscall(__NR_io_uring_setup, entries, &params);
+    if(fd < 0)
+      return errno;
+
+    m_fd = static_cast<int>(fd);
+    m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+    const bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if(singleMmap && m_cqRingSize > m_sqRingSize)
+      m_sqRingSize = m_cqRingSize;
+
+    m_sqRing = ::mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+    if(m_sqRing == MAP_FAILED)
+      return errno;
+
+    if(singleMmap)
+    {
+      m_cqRing = m_sqRing;
+    }
+    else
+    {
+      m_cqRing = ::mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+      if(m_cqRing == MAP_FAILED)
+        return errno;
+    }
+
+    m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    m_sqes = static_cast<io_uring_sqe*>(::mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES));
+    if(m_sqes == MAP_FAILED)
+      return errno;
+
+    auto *sq = static_cast<uint8_t*>(m_sqRing);
+    m_sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    m_sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    m_sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    m_sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    m_sqEntries = params.sq_entries;
+
+    auto *cq = static_cast<uint8_t*>(m_cqRing);
+    m_cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    m_cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    m_cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    m_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    return 0;
+  }
+
+  bool registerBuffers(const iovec *iovecs, unsigned count)
+  {
+    m_fixedBuffers = ::syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_BUFFERS, iovecs, count) == 0;
+    return m_fixedBuffers;
+  }
+
+  bool fixedBuffers() const { return m_fixedBuffers; }
+
+  /*
+   * Returns nullptr when submission queue is full
+   */
+  io_uring_sqe *getSqe()
+  {
+    const unsigned head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+    const unsigned tail = *m_sqTail + m_toSubmit;
+    if(tail - head >= m_sqEntries)
+      return nullptr;
+
+    const unsigned idx = tail & *m_sqMask;
+    io_uring_sqe *sqe = &m_sqes[idx];
+    std::memset(sqe, 0x00, sizeof(*sqe));
+    m_sqArray[idx] = idx;
+    ++m_toSubmit;
+
+    return sqe;
+  }
+
+  /*
+   * Read/write of len bytes at offset, bufIndex is used only when buffers were registered
+   */
+  bool prepRw(bool write, int fd, void *buf, unsigned len, uint64_t offset, unsigned bufIndex, uint64_t userData)
+  {
+    io_uring_sqe *sqe = getSqe();
+    if(!sqe)
+      return false;
+
+    if(m_fixedBuffers)
+    {
+      sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+      sqe->buf_index = static_cast<uint16_t>(bufIndex);
+    }
+    else
+    {
+      sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    }
+
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(buf);
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = userData;
+
+    return true;
+  }
+
+  /*
+   * Submits everything prepared so far and waits for at least waitFor completions.
+   * Entries kernel didn't consume on a failed call are submitted again on the next one.
+   * Returns number of submitted entries or -errno.
+   */
+  int submitAndWait(unsigned waitFor)
+  {
+    __atomic_store_n(m_sqTail, *m_sqTail + m_toSubmit, __ATOMIC_RELEASE);
+    m_toSubmit = 0;
+    const unsigned toSubmit = *m_sqTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+
+    while(true)
+    {
+      const long ret = ::syscall(__NR_io_uring_enter, m_fd, toSubmit, waitFor, waitFor ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+      if(ret >= 0)
+        return static_cast<int>(ret);
+      if(errno != EINTR)
+        return -errno;
+    }
+  }
+
+  /*
+   * Returns nullptr when there are no completions, call seen() after handling returned one
+   */
+  io_uring_cqe *peekCqe()
+  {
+    const unsigned head = *m_cqHead;
+    if(head == __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE))
+      return nullptr;
+
+    return &m_cqes[head & *m_cqMask];
+  }
+
+  void seen()
+  {
+    __atomic_store_n(m_cqHead, *m_cqHead + 1, __ATOMIC_RELEASE);
+  }
+};
+
+#endif